@@ -15,36 +15,134 @@
 
 /******************** HEADER FILES *******************************************/
 #include "uart.h"
+#include "round_robin.h"
+#include "jpeg.h"
+#include "http.h"
 /******************** DEFINE MACROS ******************************************/
 
+#define CAMERA_BUFF_MAX       (16*1024)	// Image buffer in SRAM2
+#define CAMERA_READ_FRAME     5		// 76 00 32 00 00 before and after read data
+#define CAMERA_CHUNK_DEFAULT  512
+#define CAMERA_CHUNK_MAX      ((BUFF_MAX - 2 * CAMERA_READ_FRAME) & ~0x07)
+#define CAMERA_CHUNK_TIMEOUT  2000	// ms per chunk
+#define CAMERA_PIPE_CHUNK     1024	// Chunk size in pipeline mode
+#define CAMERA_UPLOAD_TYPE    "image/jpeg"	// Content type of uploaded images
+#define CAMERA_PROBE_TIMEOUT  10	// Link probe timeout, UART_DELAY units
+
+#define CAMERA_RETRY_MAX      2		// Captures repeated after a corrupt JPEG
+
+#define CAMERA_MOTION_TIMEOUT 3600000	// Longest motion wait before a capture anyway (ms)
+
+#define CAMERA_HASH_HISTORY   8		// Fingerprints of kept images compared against
+#define CAMERA_HASH_DISTANCE  6		// Differing fingerprint bits (of 64) of a duplicate
+#define CAMERA_DUP_MAX        12	// Duplicates in a row before one is kept anyway
+
+#define CAMERA_PROFILE_COUNT  4
+#define CAMERA_PROFILE_NONE   0xFF	// Camera settings unknown
+
+#define CAMERA_RES_640x480    0x00	// imageres values
+#define CAMERA_RES_320x240    0x11
+#define CAMERA_RES_160x120    0x22
+
+#define CAMERA_COLOR_AUTO     0x00	// imagecolor values
+#define CAMERA_COLOR_COLOR    0x01
+#define CAMERA_COLOR_BW       0x02
+
 /******************** GLOBAL VARIABLES ***************************************/
 
 /******************** DEFINE ENUMS and STRUCT ********************************/
 
+/* Image chunk consumer (flash, SD, socket), returns pass or fail */
+typedef char (*Camera_Sink)(void *ctx, uint32_t offset, const char *data, uint16_t size);
+
+/* Chunked image readout */
+typedef struct
+{
+	uint16_t             chunk;         // Bytes per read command
+	Camera_Sink          sink;          // Chunk consumer
+	void                *ctx;           // Sink context
+	uint32_t             length;        // Image length reported by the camera
+	uint32_t             offset;        // Next image byte to read
+	uint16_t             size;          // Bytes in the running read
+
+}Camera_Read;
+
+/* Capture profile, settings sent before a capture when the profile changes */
+typedef struct
+{
+	const char          *name;          // Profile name for the log
+	char                 resolution;    // CAMERA_RES_*
+	char                 compression;   // Compression ratio, 0x00 (best) to 0xFF
+	char                 color;         // CAMERA_COLOR_*
+	uint16_t             width;         // Expected JPEG frame size
+	uint16_t             height;
+
+}Camera_Profile;
+
+/* Per-profile capture timing */
+typedef struct
+{
+	uint32_t             count;         // Captures with this profile
+	uint32_t             capture_ms;    // Last image get (frame capture) time
+	uint32_t             transfer_ms;   // Last image length + readout time
+	uint32_t             bytes;         // Last image size
+	uint32_t             total_ms;      // Capture + transfer time of all captures
+	uint32_t             duplicates;    // Captures found to be near duplicates
+
+}Camera_Stats;
+
+/* Camera link speed, baud command code bytes from the VC0706 protocol */
+typedef struct
+{
+	uint32_t             baud;          // USART3 baud rate
+	char                 code[2];       // imagebaud[5..6]
+
+}Camera_Baud;
+
+/* Double-buffered capture and upload. Chunk N is sent from buff while the
+ * camera writes chunk N+1 into its receive buffer. */
+typedef struct
+{
+	uint8_t             *buff;          // Chunk being sent (SRAM2)
+	uint16_t             fill;          // Bytes in buff
+	uint16_t             pos;           // Bytes of buff taken by the upload
+	uint8_t              error;         // Camera read failed, upload cut short
+
+}Camera_Pipe;
+
 /******************** DEFINE GLOBAL VARIABLES  *******************************/
 
-uint16_t camera_buff[BUFF_MAX];
+extern uint8_t camera_buff[CAMERA_BUFF_MAX];	// Image buffer of the default sink
 
 // Hex commands to test SC03MPA camera
 static char stopcap[]    = {0x56, 0x00, 0x36, 0x01, 0x03};
-static char imageres[]   = {0x56, 0x00, 0x54, 0x01, 0x22}; // set image resolution to 160x120 (smallest setting)
-static char imagecomp[]  = {0x56, 0x00, 0x31, 0x05, 0x01, 0x01, 0x12, 0x04, 0x99}; // set compression ratio to 99 (most compressed)
-static char imagebaud[]  = {0x56, 0x00, 0x24, 0x03, 0x01, 0x0D, 0xA6}; // set camera to 115200 baud
+extern char imageres[];     // set image resolution, value patched from the capture profile
+extern char imagecomp[];    // set compression ratio, value patched from the capture profile
+extern char imagecolor[];   // set color mode, value patched from the capture profile
+extern char imagebaud[];    // set camera baud rate, code patched by api_camera_baudset
 static char imageget[]   = {0x56, 0x00, 0x36, 0x01, 0x00};
 static char imagelen[]   = {0x56, 0x00, 0x34, 0x01, 0x00};
 extern char imagedata[];
 static char imagereset[] = {0x56, 0x00, 0x26, 0x00};
+static char motionctrl[] = {0x56, 0x00, 0x42, 0x03, 0x00, 0x01, 0x01}; // motion alarm over UART
+static char motionon[]   = {0x56, 0x00, 0x37, 0x01, 0x01};
+static char motionoff[]  = {0x56, 0x00, 0x37, 0x01, 0x00};
 
 // Hex responses
 static char Resp_CAM_STOPCAP[]    = {0x76, 0x00, 0x36, 0x00, 0x00};
 static char Resp_CAM_RESOLUTION[] = {0x76, 0x00, 0x54, 0x00, 0x00};
 static char Resp_CAM_COMPRESS[]   = {0x76, 0x00, 0x31, 0x00, 0x00};
+static char Resp_CAM_COLOR[]      = {0x76, 0x00, 0x3C, 0x00, 0x00};
 static char Resp_CAM_BAUD[]       = {0x76, 0x00, 0x24, 0x00, 0x00};
 static char Resp_CAM_IMAGEGET[]   = {0x76, 0x00, 0x36, 0x00, 0x00};
 static char Resp_CAM_LENGTH[]     = {0x76, 0x00, 0x34, 0x00, 0x04, 0x00, 0x00};
 static char Resp_CAM_DATASTART[]  = {0xFF, 0xD8};
 static char Resp_CAM_DATAEND[]    = {0xFF, 0xD9, 0x76, 0x00, 0x32, 0x00, 0x00};
 static char Resp_CAM_RESET[]      = {0x76, 0x00, 0x26, 0x00};
+static char Resp_CAM_READ[]       = {0x76, 0x00, 0x32, 0x00, 0x00};
+static char Resp_CAM_MOTIONCTRL[] = {0x76, 0x00, 0x42, 0x00, 0x00};
+static char Resp_CAM_MOTIONSET[]  = {0x76, 0x00, 0x37, 0x00, 0x00};
+static char Resp_CAM_MOTION[]     = {0x76, 0x00, 0x39, 0x00, 0x00};	// motion detected
 
 /******************** CAMERA APPLICATION FUNCTIONS START *********************/
 
@@ -57,6 +155,77 @@ static char Resp_CAM_RESET[]      = {0x76, 0x00, 0x26, 0x00};
 /*****************************************************************************/
 char api_camera_connect(void);
 
+/*****************************************************************************/
+/*! @Function Name: api_camera_motioncapture
+ *  @brief        : Arms the camera motion detection, waits for motion in
+ *  				Stop 1 and runs the capture sequence once it is seen.
+ *  @param        : longest wait in ms, a capture is made anyway after it
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+char api_camera_motioncapture(uint32_t timeout);
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_upload
+ *  @brief        : Captures an image and POSTs it to path while it is read.
+ *  				Each camera chunk goes out through the client transport
+ *  				while the camera sends the next one, the image is never
+ *  				held whole. While the scene repeats the image is read
+ *  				into camera_buff and fingerprinted first, and a duplicate
+ *  				is not sent.
+ *  @param        : HTTP client (set up with http_init), request path
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+char api_camera_upload(Http_Client *http, const char *path);
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_motionarm
+ *  @brief        : Turns motion detection of USART camera module on (alarm
+ *  				sent over UART) or off.
+ *  @param        : 1 to arm, 0 to disarm
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+char api_camera_motionarm(uint8_t enable);
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_motionwait
+ *  @brief        : Sleeps in Stop 1 until the camera reports motion. USART3
+ *  				wakes the core on the first byte of the alarm.
+ *  @param        : timeout in ms
+ *  @return       : pass on motion, fail on timeout
+ */
+/*****************************************************************************/
+char api_camera_motionwait(uint32_t timeout);
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_baudnegotiate
+ *  @brief        : Finds the current camera link speed and moves the camera
+ *  				and USART3 to the fastest rate that still answers.
+ *  @return       : pass or fail (camera does not answer at any rate)
+ */
+/*****************************************************************************/
+char api_camera_baudnegotiate(void);
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_baudlower
+ *  @brief        : Fallback after a failed transfer. Finds the link again and
+ *  				drops the camera and USART3 one rate lower.
+ *  @return       : pass or fail (no lower rate or no answer)
+ */
+/*****************************************************************************/
+char api_camera_baudlower(void);
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_task
+ *  @brief        : Scheduler task version of api_camera_connect. Yields
+ *  				while the camera answers so other ports can run.
+ *  @return       : RR_RUNNING, RR_DONE or RR_FAILED
+ */
+/*****************************************************************************/
+char api_camera_task(Rr_Task *task);
+
 /******************** CAMERA APPLICATION FUNCTIONS END ***********************/
 
 /******************** CAMERA API START ***************************************/
@@ -85,6 +254,15 @@ char api_camera_imageres(void);
 /*****************************************************************************/
 char api_camera_imagecomp(void);
 
+/*****************************************************************************/
+/*! @Function Name: api_camera_imagecolor
+ *  @brief        : Set color mode (auto, color, black/white) of USART camera
+ *  				module to the value loaded from the capture profile.
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+char api_camera_imagecolor(void);
+
 /*****************************************************************************/
 /*! @Function Name: api_camera_imageget
  *  @brief        : Get image command of USART camera module. The CM_ImageGet
@@ -107,11 +285,62 @@ char api_camera_imagelen(void);
 
 /*****************************************************************************/
 /*! @Function Name: api_camera_imagedata
- *  @brief        : Read image data command of USART camera module. This command
- *  				stores image data into camera_buff.
+ *  @brief        : Read image data command of USART camera module. The image
+ *  				is read in chunks of camera_read.chunk bytes and each
+ *  				chunk is passed to the sink (camera_buff by default).
  *  @return       : pass or fail
  */
 /*****************************************************************************/
 char api_camera_imagedata(void);
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_sinkset
+ *  @brief        : Sets where image chunks go and the chunk size. Chunks are
+ *  				rounded down to a multiple of 8 bytes and limited to
+ *  				CAMERA_CHUNK_MAX.
+ *  @param        : sink (NULL for camera_buff), sink context, chunk size (0
+ *  				for CAMERA_CHUNK_DEFAULT)
+ */
+/*****************************************************************************/
+void api_camera_sinkset(Camera_Sink sink, void *ctx, uint16_t chunk);
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_profileset
+ *  @brief        : Selects the capture profile of the next captures. The
+ *  				settings are sent with the next capture, and only if they
+ *  				differ from the profile the camera is set to.
+ *  @param        : profile index (CAMERA_PROFILE_COUNT max)
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+char api_camera_profileset(uint8_t profile);
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_profilestats
+ *  @brief        : Capture and transfer timing of a profile.
+ *  @param        : profile index
+ *  @return       : statistics or NULL
+ */
+/*****************************************************************************/
+const Camera_Stats* api_camera_profilestats(uint8_t profile);
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_duplicate
+ *  @brief        : Tells if the last image shows the same scene as one of
+ *  				the recently kept images. api_camera_upload then checks
+ *  				the next image before sending it.
+ *  @return       : 1 for a near duplicate, else 0
+ */
+/*****************************************************************************/
+uint8_t api_camera_duplicate(void);
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_jpeg
+ *  @brief        : Marker scan of the last image, holds the marker index and
+ *  				frame dimensions.
+ *  @return       : scanner state
+ */
+/*****************************************************************************/
+const Jpeg_Scan* api_camera_jpeg(void);
 /******************** CAMERA API END *****************************************/
 
@@ -15,25 +15,126 @@
 
 /******************** HEADER FILES *******************************************/
 #include "uart.h"
+#include "round_robin.h"
+#include "transport.h"
+#include "nmea.h"
 /******************** DEFINE MACROS ******************************************/
 
+#define LTEGPS_CMD_MAX    64		// Built command buffer
+#define LTEGPS_APN        "vzwinternet"	// APN whose CID is activated
+
+#define LTEGPS_FIX_TIMEOUT  60000	// Acquisition gives up after (ms)
+
+/* Acquisition defaults, see Ltegps_Acq */
+#define LTEGPS_ACQ_HDOP     200		// HDOP 2.0
+#define LTEGPS_ACQ_USED     6		// Satellites used
+#define LTEGPS_ACQ_SPREAD   1000	// Window radius (cm)
+#define LTEGPS_ACQ_WINDOW   5		// Fixes averaged
+#define LTEGPS_ACQ_MAX      8		// Longest window
+#define LTEGPS_ACQ_POLL     1000	// Deadline check while no fix arrives (ms)
+
+/* Acquisition states */
+#define LTEGPS_ACQ_RUNNING  0		// Waiting for the fixes to settle
+#define LTEGPS_ACQ_SETTLED  1		// Window full and within the spread
+#define LTEGPS_ACQ_TIMEOUT  2		// Deadline passed
+
+#define LTEGPS_HINT_MAGIC   0x47505348	// "GPSH", last fix record
+#define LTEGPS_HOT_AGE      (2UL * 60 * 60 * 1000)	// Last fix young enough for a hot start (ms)
+
+/* GNSS start types, as AT$GPSR takes them */
+#define LTEGPS_START_NONE   0		// No restart sent, receiver starts as it likes
+#define LTEGPS_START_HOT    3		// Recent fix, ephemeris still valid
+
+#define LTEGPS_PROV_MAGIC   0x50524F56	// "PROV", provisioning record in flash
+
+#define LTEGPS_SOCK_ID      1		// Socket connection id used (1..6)
+#define LTEGPS_SOCK_CHUNK   1024	// Bytes per send/receive command, fits rx_buff
+#define LTEGPS_SOCK_TIMEOUT 20000	// Socket command timeout (ms)
+#define LTEGPS_SOCK_POLL    50		// Receive poll period (ms)
+
 /******************** DEFINE GLOBAL VARIABLES  *******************************/
 
 /******************** DEFINE ENUMS and STRUCT ********************************/
 
 typedef struct
 {
-    float UTC_time;
-    float latitude;
-    float longitude;
-    char NS_indicator[2];
-    char EW_indicator[2];
-    float speed;
-    char date[7];
+    uint32_t UTC_time;    // ms since midnight
+    int32_t  latitude;    // 1e-7 degree, north positive
+    int32_t  longitude;   // 1e-7 degree, east positive
+    uint32_t speed;       // m/h
+    uint8_t  day;         // UTC date
+    uint8_t  month;
+    uint16_t year;
+    int32_t  altitude;    // cm above mean sea level
+    uint8_t  fix;         // NMEA_FIX_*
+    uint8_t  used;        // Satellites used
+    uint8_t  view;        // Satellites in view
+    uint16_t hdop;        // 0.01
+    uint16_t pdop;        // 0.01
+    Nmea_Sky sky[NMEA_GNSS_COUNT]; // C/N0 per constellation
+    uint8_t  start;       // LTEGPS_START_* of this fix
+    uint32_t ttff;        // ms from GNSS start to the first fix
+    uint32_t settle;      // ms from GNSS start to this fix
+    uint8_t  averaged;    // Fixes averaged into the position, 0 for a single fix
 
 }LTEGPS_Struct;
 
-LTEGPS_Struct GPS = {0};
+extern LTEGPS_Struct GPS;
+
+/* Provisioning record, kept in flash page FLASH_NV_LTE once the modem was
+ * found at every target setting and attached. The digest covers the set
+ * commands, a firmware update changing any of them makes the record stale. */
+typedef struct
+{
+	uint32_t magic;         // LTEGPS_PROV_MAGIC
+	uint32_t digest;        // Digest of the target settings
+	uint8_t  cid;           // CID of LTEGPS_APN
+	uint8_t  reserved[3];
+	uint32_t check;         // Checksum of the fields above
+
+}Lte_Prov;
+
+/* Last good fix, kept in retained RAM so it survives Stop 2 and resets
+ * of the MCU. Its tick only means something in the power up that wrote
+ * it, the GNSS is powered with the modem and not with the MCU. */
+typedef struct
+{
+	uint32_t magic;         // LTEGPS_HINT_MAGIC
+	int32_t  lat;           // 1e-7 degree
+	int32_t  lon;
+	int32_t  alt;           // cm
+	uint32_t time;          // UTC of the fix, ms since midnight
+	uint8_t  day;           // UTC date of the fix
+	uint8_t  month;
+	uint16_t year;
+	uint32_t tick;          // HAL tick of the fix
+	uint32_t check;         // Checksum of the fields above
+
+}Ltegps_Hint;
+
+/* When an acquisition is good enough to stop the receiver: the last
+ * window fixes all pass hdop_max and used_min and lie within spread_max
+ * of their mean, which is returned. A failing fix empties the window. */
+typedef struct
+{
+	uint16_t hdop_max;      // 0.01
+	uint8_t  used_min;      // Satellites used
+	uint8_t  window;        // Fixes averaged, 1 to LTEGPS_ACQ_MAX
+	uint32_t spread_max;    // Window radius, cm
+	uint32_t timeout;       // Receiver on time limit, ms
+
+}Ltegps_Acq;
+
+/* Fixes of the acquisition window */
+typedef struct
+{
+	int32_t  lat[LTEGPS_ACQ_MAX];   // 1e-7 degree
+	int32_t  lon[LTEGPS_ACQ_MAX];
+	int32_t  alt[LTEGPS_ACQ_MAX];   // cm
+	uint8_t  head;                  // Oldest
+	uint8_t  count;
+
+}Ltegps_Window;
 
 /******************** DEFINE GLOBAL VARIABLES  *******************************/
 
@@ -43,20 +144,41 @@ static char pdpset[] =        "AT+CGDCONT=1,\"IPV4V6\",\"\"\r\n"; // set PDP con
 static char pdpavailable[] =  "AT+CGDCONT?\r\n"; // check available PDP context types
 static char wdsselect[] =     "AT+WS46=28\r\n"; // select WDS to be EU-TRAN (28)
 static char epsmode[] =       "AT+CEMODE=2\r\n"; // set EPS mode of operation to CS/PS mode 2
-char pdpactivate[] =          "AT#SGACT=X,1\r\n"; // activate pdp context set of pdpselect function
+static char pdpactivate[] =   "AT#SGACT="; // + CID,1 activates the pdp context found by pdpavailable
+static char fwswitchquery[] = "AT#FWSWITCH?\r\n"; // read f/w image
+static char wdsquery[] =      "AT+WS46?\r\n";     // read WDS
+static char epsquery[] =      "AT+CEMODE?\r\n";   // read EPS mode of operation
 static char lteping[] =       "AT#PING=\"www.google.com\"\r\n"; // ping google.com
 
+// LTE socket AT commands, built by the socket functions
+static char sockdial[] =      "AT#SD=";       // + id,0,port,"host",0,0,1 TCP in command mode
+static char socksend[] =      "AT#SSENDEXT="; // + id,length, the data follows the prompt
+static char sockinfo[] =      "AT#SI=";       // + id
+static char sockrecv[] =      "AT#SRECV=";    // + id,max length
+static char sockclose[] =     "AT#SH=";       // + id
+
 // LTE AT responses
 static char Resp_LTEGPS_FWSwitch[] = "AT#FWSWITCH=1\r\n";
 static char Resp_LTEGPS_PDPSet[]   = "";
+static char Resp_LTEGPS_FWSwitchIs[] = "#FWSWITCH: 1"; // query answers at the targets
+static char Resp_LTEGPS_WDSIs[]    = "+WS46: 28";
+static char Resp_LTEGPS_EPSIs[]    = "+CEMODE: 2";
 static char Resp_LTEGPS_Ping[]     = "PING:";
+static char Resp_LTEGPS_Prompt[]   = "> ";       // send data now
+static char Resp_LTEGPS_Info[]     = "#SI: ";    // + id,sent,received,buff_in,ack_waiting
+static char Resp_LTEGPS_Recv[]     = "#SRECV: "; // + id,length CR LF data
+static char Resp_LTEGPS_RecvEnd[]  = "\r\nOK\r\n"; // after the data
+
+extern const Transport ltegps_transport;
 
 // GPS AT commands
 static char echodisable[] = "ATE0\r\n";	//disable echo
 static char selectgnss[]  = "AT$GPSAT=1\r\n";// select GNSS antenna
 static char powergnss[]   = "AT$GPSP=1\r\n"; // power up GNSS controller
-static char startnmea[]   = "AT$GPSNMUN=1,0,0,0,0,1,0\r\n"; // start GPS NMEA data stream
+static char startnmea[]   = "AT$GPSNMUN=1,1,0,1,1,1,1\r\n"; // start GPS NMEA data stream, GGA GSA GSV RMC VTG
 static char endnmea[]     = "AT$GPSNMUN=0,0,0,0,0,1,0\r\n"; // start GPS NMEA data stream
+static char offgnss[]     = "AT$GPSP=0\r\n"; // power down GNSS controller
+static char restartgnss[] = "AT$GPSR=";      // + start type, built by api_ltegps_restartgnss
 // GPS AT responses
 static char Resp_LTEGPS_NMEA[] =      "$GPRMC";
 static char Resp_LTEGPS_VALID[] =     ",A,";
@@ -68,6 +190,7 @@ static char atcheck[] = "AT\r\n";
 // Misc. Responses
 static char Resp_LTEGPS_OK[] =        "OK\r\n";
 static char Resp_LTEGPS_ERROR[] =     "ERROR\r\n";
+static char Resp_LTEGPS_CMEERROR[] =  "+CME ERROR";
 
 /******************** FUNCTION DECLARATION************************************/
 
@@ -79,6 +202,9 @@ static char Resp_LTEGPS_ERROR[] =     "ERROR\r\n";
  *  @brief        : High level function to issue command sequence to
  *  				connect to LTE. The EVB requires 20 ms
  *  				delay between command response and next command.
+ *  				Settings are read first and only written when they
+ *  				differ; once attached the result is cached in flash
+ *  				and later calls go straight to the attach.
  *  @return       : pass or fail
  */
 /*****************************************************************************/
@@ -112,6 +238,13 @@ char api_ltegps_gpsconnect(void);
 /*****************************************************************************/
 char api_ltegps_gpsconnect(void);
 
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_gpstask
+ *  @brief        : Scheduler task version of api_ltegps_gpsconnect.
+ *  @return       : RR_RUNNING, RR_DONE or RR_FAILED
+ */
+/*****************************************************************************/
+char api_ltegps_gpstask(Rr_Task *task);
 
 /******************** LTEGPS APPLICATION FUNCTIONS END ***********************/
 
@@ -194,14 +327,65 @@ char api_ltegps_epsmode(void);
 /*****************************************************************************/
 char api_ltegps_pdpactivate(void);
 
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_provclear
+ *  @brief        : Forget the cached provisioning, the next
+ *  				api_ltegps_lteconnect checks every modem setting again.
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+char api_ltegps_provclear(void);
+
 /******************** LTE API END ********************************************/
 
+/******************** LTE SOCKET START ***************************************/
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_sockopen
+ *  @brief        : Opens a TCP socket to host over the active PDP context.
+ *  				The module resolves host names itself.
+ *  @param        : Host name or IP, port, 1 for TLS (not supported)
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+uint8_t api_ltegps_sockopen(const char *host, uint16_t port, uint8_t tls);
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_socksend
+ *  @brief        : Sends data over the open socket.
+ *  @param        : Data, size
+ *  @return       : pass or fail (socket is dropped)
+ */
+/*****************************************************************************/
+uint8_t api_ltegps_socksend(const uint8_t *data, uint16_t size);
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_sockrecv
+ *  @brief        : Reads data from the open socket, waiting up to timeout ms.
+ *  @param        : Buffer, size, timeout in ms
+ *  @return       : bytes read, 0 on timeout or TRANSPORT_CLOSED
+ */
+/*****************************************************************************/
+int16_t api_ltegps_sockrecv(uint8_t *data, uint16_t size, uint32_t timeout);
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_sockclose
+ *  @brief        : Closes the open socket, if any.
+ */
+/*****************************************************************************/
+void api_ltegps_sockclose(void);
+
+/******************** LTE SOCKET END *****************************************/
+
 /******************** GPS API START ******************************************/
 
 /*****************************************************************************/
 /*! @Function Name: api_ltegps_startnmea
  *  @brief        : NMEA data stream start command of USART LTEGPS module.
- *  @return       : pass or fail
+ *  				Returns as soon as the fixes settle (Ltegps_Acq) with
+ *  				their average in GPS, or at the timeout with the best
+ *  				there is.
+ *  @return       : pass, or fail when no valid fix arrived
  */
 /*****************************************************************************/
 char api_ltegps_startnmea(void);
@@ -234,12 +418,43 @@ char api_ltegps_selectgnss(void);
 char api_ltegps_powergnss(void);
 
 /*****************************************************************************/
-/*! @Function Name: LGM_ParseNMEA
- *  @brief        : NMEA parsing function of USART LTEGPS module. Used after
- *  				api_ltegps_startnmea is called.
+/*! @Function Name: api_ltegps_acqconfig
+ *  @brief        : Sets the acquisition thresholds used by the next
+ *  				api_ltegps_startnmea. The window is clamped to
+ *  				1..LTEGPS_ACQ_MAX.
+ *  @param        : thresholds
+ */
+/*****************************************************************************/
+void api_ltegps_acqconfig(const Ltegps_Acq *acq);
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_restartgnss
+ *  @brief        : Restarts the GNSS controller hot when the last fix record
+ *  				is from this power up and recent, else sends nothing.
+ *  				Starts the time to first fix.
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+char api_ltegps_restartgnss(void);
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_offgnss
+ *  @brief        : GNSS power down command of USART LTEGPS module, once the
+ *  				fix is taken. The controller keeps its ephemeris for the
+ *  				next hot start.
  *  @return       : pass or fail
  */
 /*****************************************************************************/
+char api_ltegps_offgnss(void);
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_parsenmea
+ *  @brief        : Copies the last epoch fix of the NMEA stream into GPS.
+ *  				The stream is parsed as it arrives once
+ *  				api_ltegps_startnmea is called.
+ *  @return       : pass, or fail when no valid fix arrived
+ */
+/*****************************************************************************/
 char api_ltegps_parsenmea(void);
 
 /******************** GPS API END ********************************************/
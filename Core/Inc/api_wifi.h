@@ -13,51 +13,119 @@
 /*****************************************************************************/
 
 /******************** HEADER FILES *******************************************/
+#include "round_robin.h"
+#include "transport.h"
 
 /******************** DEFINE MACROS ******************************************/
-#define AP_KNOWN_COUNT 3
-#define RSSI_DEFAULT 255
+#define WIFI_SSID_MAX     32		// SSID length limit (802.11)
+#define WIFI_KNOWN_NONE   0xFF	// SSID not in the known AP table
+#define WIFI_CAND_MAX     4		// Known APs kept from a scan, strongest first
+
+#define WIFI_LINK_OFF     0		// Module state unknown (power up, no response)
+#define WIFI_LINK_READY   1		// Echo off, station mode set
+#define WIFI_LINK_JOINED  2		// Associated to a known AP
+#define WIFI_LINK_TTL     30000	// Link trusted this long after a good exchange (ms)
+
+#define WIFI_SCAN_TTL     600000	// Scan results used this long before scanning again (ms)
+#define WIFI_CACHE_MAGIC  0x57494649	// "WIFI", marks a valid Wifi_Cache
+#define WIFI_CMD_MAX      128		// Built command buffer
+
+#define WIFI_SOCK_NONE    0xFF		// No socket open
+#define WIFI_SOCK_CHUNK   1024		// Bytes per send/receive command, fits rx_buff
+#define WIFI_SOCK_TIMEOUT 10000		// Socket command timeout (ms)
+#define WIFI_SOCK_POLL    50		// Receive poll period (ms)
 
 /******************** DEFINE ENUMS and STRUCT ********************************/
 
+/* Known AP, the table is const and stays in flash */
 typedef struct
 {
-	 char SSID[33];     /* Buffer to hold the SSID for WiFi N/W connection     		      */
-	 char Password[33]; /* Buffer to hold the Password for WiFi N/W connection 			  */
-	 uint8_t RSSI;	    /* Buffer to hold the absolute RSSI value for WiFi N/W connection */
-}WiFi_Struct;
+	const char          *ssid;          // Network name
+	const char          *password;      // Passphrase
 
-/******************** DEFINE GLOBAL VARIABLES  *******************************/
-extern uint8_t strAP_idx;
+}Wifi_Known;
+
+/* Known AP seen in a scan */
+typedef struct
+{
+	uint8_t              known;         // Known AP table index
+	uint8_t              rssi;          // Absolute RSSI, lower is stronger
+	uint8_t              channel;       // 0 when not reported
+	char                 bssid[18];     // "xx:xx:xx:xx:xx:xx", empty when not reported
+
+}Wifi_Cand;
+
+/* Scan result parser, fed a line at a time from the RX interrupt */
+typedef struct
+{
+	char                 field[WIFI_SSID_MAX + 2]; // Field being read
+	uint8_t              len;           // Field length, WIFI_SSID_MAX + 1 when too long
+	uint8_t              quoted;        // Inside quotes
+	uint8_t              wasquoted;     // Field had quotes
+	uint8_t              ssid;          // SSID field of the line seen
+	Wifi_Cand            line;          // AP of the current line
+	Wifi_Cand            cand[WIFI_CAND_MAX]; // Known APs, strongest first
+	uint8_t              count;         // Entries in cand
+
+}Wifi_Scan;
+
+/* Module and association state, kept across connect calls */
+typedef struct
+{
+	uint8_t              state;         // WIFI_LINK_*
+	uint32_t             last_ok;       // Tick of the last good exchange over the link
+	uint16_t             joins;         // Joins done since power up
 
-extern WiFi_Struct AP_1;
+}Wifi_Link;
 
-extern WiFi_Struct AP_2;
+/* Last AP joined, in retained RAM so a wakeup or reset can join it directly */
+typedef struct
+{
+	uint32_t             magic;         // WIFI_CACHE_MAGIC when valid
+	uint8_t              ap;            // Known AP table index
+	char                 bssid[18];     // AP MAC address
+	uint8_t              channel;       // AP channel
+	uint8_t              rssi;          // Absolute RSSI when joined
+	uint32_t             check;         // Checksum of the fields above
 
-extern WiFi_Struct AP_3;
+}Wifi_Cache;
 
-extern WiFi_Struct* AP_List_Known[3];
+/******************** DEFINE GLOBAL VARIABLES  *******************************/
 // WiFi AT commands
 static char AT_check[]  		= "AT\r\n";
 static char AT_station[] 		= "AT+WNI=0\r\n";
 static char AT_scan[]   	    = "AT+WS=1\r\n";
-static char AT_connect[] 		= "AT+WNCN=1,\"Trans 5G\",\"2232portal\"\r\n";
+static char AT_connect[] 		= "AT+WNCN=";	// + 1,"SSID","passphrase"[,"BSSID",channel], built by api_wifi_joincmd
 static char AT_ping[]    		= "AT+NPING=8.8.8.8,64,3\r\n";
+static char AT_linkcheck[]		= "AT+NPING=8.8.8.8,64,1\r\n";	// one packet liveness probe
 static char AT_echodisable[] 	= "ATE0\r\n";
 
+// WiFi socket AT commands, built by the socket functions
+static char AT_dnslookup[]		= "AT+NDNSLOOKUP=";	// + "host", reply holds the IPv4 address
+static char AT_sockopen[]		= "AT+NCTCP=";	// + IP,port, reply "+NCTCP:<cid>"
+static char AT_tlsopen[]		= "AT+NCTLS=";	// + IP,port, reply "+NCTLS:<cid>"
+static char AT_socksend[]		= "AT+NSEND=";	// + cid,length, the data follows
+static char AT_sockrecv[]		= "AT+NRECV=";	// + cid,max length
+static char AT_sockclose[]		= "AT+NCLOSE=";	// + cid
+
 // WiFi AT responses
 static char Resp_WIFI_OK[]      = "OK\r\n";
 static char Resp_WIFI_ERROR[]   = "ERROR";
 static char Resp_WIFI_SCAN[]    = "Trans 5G"; // change for different known AP
 static char Resp_WIFI_SUCCESS[] = "SUCCESS";
+static char Resp_WIFI_Recv[]    = "+NRECV:";	// + length,data
+static char Resp_WIFI_RecvEnd[] = "\r\nOK\r\n";	// after the data
+
+extern const Transport wifi_transport;
 
 /******************** FUNCTION DECLARATION************************************/
 
 /******************** WI-FI APPLICATION FUNCTIONS START **********************/
 /*****************************************************************************/
 /*! @Function Name: api_wifi_connect
- *  @brief        : High level function to issue command sequence to allow
- *  				ping to google.com
+ *  @brief        : High level function to bring the link up so that ping to
+ *  				google.com works. Only the steps the link state needs
+ *  				are sent, an up link returns at once.
  *  @return       : pass or fail
  */
 /*****************************************************************************/
@@ -71,6 +139,40 @@ char api_wifi_connect(void);
 /*****************************************************************************/
 char api_wifi_ping(void);
 
+/*****************************************************************************/
+/*! @Function Name: api_wifi_task
+ *  @brief        : Scheduler task version of api_wifi_connect followed by
+ *  				api_wifi_ping.
+ *  @return       : RR_RUNNING, RR_DONE or RR_FAILED
+ */
+/*****************************************************************************/
+char api_wifi_task(Rr_Task *task);
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_linkstate
+ *  @brief        : Current link state.
+ *  @return       : WIFI_LINK_OFF, WIFI_LINK_READY or WIFI_LINK_JOINED
+ */
+/*****************************************************************************/
+uint8_t api_wifi_linkstate(void);
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_linkok
+ *  @brief        : Marks a good exchange over the link (upload, ping), which
+ *  				saves the liveness probe for WIFI_LINK_TTL.
+ */
+/*****************************************************************************/
+void api_wifi_linkok(void);
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_linkdown
+ *  @brief        : Lowers the link state after a failure, the next connect
+ *  				repeats the steps from there.
+ *  @param        : WIFI_LINK_OFF or WIFI_LINK_READY
+ */
+/*****************************************************************************/
+void api_wifi_linkdown(uint8_t state);
+
 /******************** WI-FI APPLICATION FUNCTIONS END ************************/
 
 /******************** WI-FI API START ****************************************/
@@ -96,9 +198,9 @@ char api_wifi_scan(void);
 
 /*****************************************************************************/
 /*! @Function Name: api_wifi_scanparse
- *  @brief        : This function is used by api_wifi_scan function to parse for
- *  				AP RSSI values.
- *  @return       : pass or fail
+ *  @brief        : Ends the scan result parse started with the scan
+ *  				command and stops feeding it.
+ *  @return       : pass when a known AP was found, else fail
  */
 /*****************************************************************************/
 char api_wifi_scanparse(void);
@@ -112,6 +214,15 @@ char api_wifi_scanparse(void);
 /*****************************************************************************/
 char api_wifi_known(void);
 
+/*****************************************************************************/
+/*! @Function Name: api_wifi_join
+ *  @brief        : Targeted join of the cached AP (BSSID and channel given),
+ *  				no scan needed. Drops the cache on failure.
+ *  @return       : pass or fail (no cache or join failed)
+ */
+/*****************************************************************************/
+char api_wifi_join(void);
+
 /*****************************************************************************/
 /*! @Function Name: api_wifi_echodisable
  *  @brief        : Echo disable command of USART Wi-Fi module.
@@ -129,3 +240,43 @@ char api_wifi_echodisable(void);
 char api_wifi_check(void);
 
 /******************** WI-FI API END ******************************************/
+
+/******************** WI-FI SOCKET START *************************************/
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_sockopen
+ *  @brief        : Opens the module socket to host, resolving the name
+ *  				first unless it is an IPv4 address. An open socket is
+ *  				closed first.
+ *  @param        : Host name or IP, port, 1 for TLS
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+uint8_t api_wifi_sockopen(const char *host, uint16_t port, uint8_t tls);
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_socksend
+ *  @brief        : Sends data over the open socket.
+ *  @param        : Data, size
+ *  @return       : pass or fail (socket is dropped)
+ */
+/*****************************************************************************/
+uint8_t api_wifi_socksend(const uint8_t *data, uint16_t size);
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_sockrecv
+ *  @brief        : Reads data from the open socket, waiting up to timeout ms.
+ *  @param        : Buffer, size, timeout in ms
+ *  @return       : bytes read, 0 on timeout or TRANSPORT_CLOSED
+ */
+/*****************************************************************************/
+int16_t api_wifi_sockrecv(uint8_t *data, uint16_t size, uint32_t timeout);
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_sockclose
+ *  @brief        : Closes the open socket, if any.
+ */
+/*****************************************************************************/
+void api_wifi_sockclose(void);
+
+/******************** WI-FI SOCKET END ***************************************/
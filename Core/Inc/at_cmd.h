@@ -0,0 +1,79 @@
+/*****************************************************************************/
+/*!
+ * @project    EcoSense
+ * @file       at_cmd.h
+ * @author     Long Tran
+ * @version    0.0.1
+ * @brief	   AT command builder
+ * @date       28/July/2021
+ * @bug        NA
+
+ * @note       Builds parameterized AT commands into a caller owned buffer,
+ * 			   no allocation and no printf. Parameters are separated by
+ * 			   commas automatically. Strings are quoted, with '"', '\' and
+ * 			   control characters written as \hh (V.250 string escape).
+ *
+ * 			   Output is bounded: once a parameter does not fit, the
+ * 			   command is marked bad and at_cmd_end fails, so a cut off
+ * 			   command is never sent.
+ */
+/*****************************************************************************/
+#ifndef __AT_CMD_H
+#define __AT_CMD_H
+
+/******************** INCLUDE FILES ******************************************/
+#include "stdint.h"
+
+/******************** DEFINE STRUCT ******************************************/
+
+/* Command being built */
+typedef struct
+{
+	char                *buff;          // Output, NUL terminated
+	uint16_t             size;          // Buffer size
+	uint16_t             len;           // Characters written
+	uint8_t              params;        // Parameters written
+	uint8_t              error;         // Output did not fit
+
+}At_Cmd;
+
+/******************** FUNCTION DECLARATION************************************/
+
+/*****************************************************************************/
+/*! @fn       at_cmd_start
+ *  @brief    Starts a command, ex. at_cmd_start(&cmd, buff, size, "AT+WNCN=")
+ *  @param    Command, buffer, buffer size, command prefix
+ */
+/*****************************************************************************/
+void at_cmd_start(At_Cmd *cmd, char *buff, uint16_t size, const char *prefix);
+
+/*****************************************************************************/
+/*! @fn       at_cmd_uint
+ *  @brief    Adds a decimal parameter.
+ */
+/*****************************************************************************/
+void at_cmd_uint(At_Cmd *cmd, uint32_t value);
+
+/*****************************************************************************/
+/*! @fn       at_cmd_str
+ *  @brief    Adds a quoted string parameter, escaped as needed.
+ */
+/*****************************************************************************/
+void at_cmd_str(At_Cmd *cmd, const char *str);
+
+/*****************************************************************************/
+/*! @fn       at_cmd_raw
+ *  @brief    Adds a parameter as is, without quotes or escaping.
+ */
+/*****************************************************************************/
+void at_cmd_raw(At_Cmd *cmd, const char *str);
+
+/*****************************************************************************/
+/*! @fn       at_cmd_end
+ *  @brief    Ends the command with CR LF.
+ *  @return   pass, or fail when the command did not fit (buffer left empty)
+ */
+/*****************************************************************************/
+uint8_t at_cmd_end(At_Cmd *cmd);
+
+#endif /* __AT_CMD_H */
@@ -0,0 +1,60 @@
+/*****************************************************************************/
+/*!
+ * @project    EcoSense
+ * @file       flash.h
+ * @author     Long Tran
+ * @version    0.0.1
+ * @brief	   Flash record storage
+ * @date       28/July/2021
+ * @bug        NA
+
+ * @note       The NVDATA region at the end of flash (see the linker
+ * 			   scripts) is kept out of the firmware image, so records
+ * 			   written there survive resets and reflashing. Each record
+ * 			   owns one page, a write erases the page first. The region
+ * 			   sits in bank 2 while code runs from bank 1, so the core
+ * 			   keeps running during erase and program.
+ */
+/*****************************************************************************/
+#ifndef __FLASH_H
+#define __FLASH_H
+
+/******************** INCLUDE FILES ******************************************/
+#include "stdint.h"
+
+/******************** DEFINE MACROS ******************************************/
+
+/* NVDATA pages, one record each */
+#define FLASH_NV_LTE      0		// LTE provisioning
+#define FLASH_NV_COUNT    1		// Pages reserved in the linker scripts
+
+/******************** FUNCTION DECLARATION************************************/
+
+/*****************************************************************************/
+/*! @fn       flash_nv_read
+ *  @brief    Copies a record out of its NVDATA page.
+ *  @param    Page, record, record size (page size max)
+ */
+/*****************************************************************************/
+void flash_nv_read(uint8_t page, void *data, uint32_t size);
+
+/*****************************************************************************/
+/*! @fn       flash_nv_write
+ *  @brief    Erases a NVDATA page and programs a record into it. Skipped
+ *  		  when the page already holds the same bytes, to save erase
+ *  		  cycles.
+ *  @param    Page, record, record size (page size max)
+ *  @return   pass or fail
+ */
+/*****************************************************************************/
+uint8_t flash_nv_write(uint8_t page, const void *data, uint32_t size);
+
+/*****************************************************************************/
+/*! @fn       flash_nv_erase
+ *  @brief    Erases a NVDATA page, dropping its record.
+ *  @return   pass or fail
+ */
+/*****************************************************************************/
+uint8_t flash_nv_erase(uint8_t page);
+
+#endif /* __FLASH_H */
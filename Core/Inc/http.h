@@ -0,0 +1,111 @@
+/*****************************************************************************/
+/*!
+ * @project    EcoSense
+ * @file       http.h
+ * @author     Long Tran
+ * @version    0.0.1
+ * @brief	   HTTP/1.1 upload client
+ * @date       28/July/2021
+ * @bug        NA
+
+ * @note       POSTs a body pulled from a producer callback in chunks of
+ * 			   HTTP_CHUNK bytes, so a record never has to be in RAM as a
+ * 			   whole. Bodies of unknown length go out with chunked
+ * 			   transfer encoding.
+ *
+ * 			   The response is parsed as it arrives (status line,
+ * 			   headers, body by Content-Length, chunked or up to close)
+ * 			   and the body is skipped. The connection is kept open for
+ * 			   the next upload unless the server says otherwise, which
+ * 			   saves the TCP/TLS setup per record.
+ */
+/*****************************************************************************/
+#ifndef __HTTP_H
+#define __HTTP_H
+
+/******************** INCLUDE FILES ******************************************/
+#include "stdint.h"
+#include "transport.h"
+
+/******************** DEFINE MACROS ******************************************/
+
+#define HTTP_CHUNK        256		// Body bytes pulled and sent at once
+#define HTTP_FRAME        5		// Chunk size line before the data, "100\r\n"
+#define HTTP_BUFF         (HTTP_FRAME + HTTP_CHUNK + 2)	// Also holds the request head
+#define HTTP_LINE_MAX     64		// Response line kept, longer lines are cut
+#define HTTP_TIMEOUT      10000		// Response wait (ms)
+
+#define HTTP_CHUNKED      0xFFFFFFFF	// Body length unknown, send chunked
+
+/* Response parser states */
+#define HTTP_S_STATUS     0		// Status line
+#define HTTP_S_HEADER     1		// Header lines
+#define HTTP_S_BODY       2		// Body of known length
+#define HTTP_S_EOF        3		// Body up to connection close
+#define HTTP_S_SIZE       4		// Chunk size line
+#define HTTP_S_DATA       5		// Chunk data
+#define HTTP_S_DATAEND    6		// CR LF after chunk data
+#define HTTP_S_TRAILER    7		// Trailer lines after the last chunk
+#define HTTP_S_DONE       8		// Response complete
+#define HTTP_S_ERROR      9		// Malformed response
+
+/******************** DEFINE STRUCT ******************************************/
+
+/* Body producer, fills up to size bytes and returns the count, 0 at the end */
+typedef uint16_t (*Http_Producer)(void *ctx, uint8_t *buff, uint16_t size);
+
+typedef struct
+{
+	const Transport     *net;           // Socket carrying the connection
+	const char          *host;          // Server name, also sent as Host
+	uint16_t             port;          // Server port
+	uint8_t              tls;           // 1 for HTTPS
+	uint8_t              open;          // Connection is up
+	uint16_t             requests;      // Requests sent on this connection
+
+	uint8_t              state;         // HTTP_S_*
+	uint16_t             status;        // Status code of the last response
+	uint8_t              keep;          // Connection may stay open
+	uint8_t              chunked;       // Response body is chunked
+	uint8_t              length;        // Response has Content-Length
+	uint32_t             left;          // Body or chunk bytes left
+	char                 line[HTTP_LINE_MAX]; // Line being read
+	uint8_t              line_len;
+
+	uint8_t              buff[HTTP_BUFF]; // Request head, body chunk, response bytes
+
+}Http_Client;
+
+/******************** FUNCTION DECLARATION************************************/
+
+/*****************************************************************************/
+/*! @fn       http_init
+ *  @brief    Sets up a client, no connection is made yet.
+ *  @param    Client, transport, server name or IP, port, 1 for HTTPS
+ */
+/*****************************************************************************/
+void http_init(Http_Client *http, const Transport *net, const char *host,
+			   uint16_t port, uint8_t tls);
+
+/*****************************************************************************/
+/*! @fn       http_post
+ *  @brief    POSTs a body to path and waits for the response. Connects
+ *  		  when needed; a kept connection the server dropped is
+ *  		  reopened once, before any body byte is pulled.
+ *  @param    Client, path, content type, body length (or HTTP_CHUNKED),
+ *  		  producer, producer context
+ *  @return   pass on a 2xx status, else fail (status in http->status,
+ *  		  0 when no response)
+ */
+/*****************************************************************************/
+uint8_t http_post(Http_Client *http, const char *path, const char *type,
+				  uint32_t length, Http_Producer body, void *ctx);
+
+/*****************************************************************************/
+/*! @fn       http_close
+ *  @brief    Closes the connection.
+ */
+/*****************************************************************************/
+void http_close(Http_Client *http);
+
+#endif /* __HTTP_H */
@@ -0,0 +1,207 @@
+/*****************************************************************************/
+/*!
+ * @project    EcoSense
+ * @file       jpeg.h
+ * @author     Long Tran
+ * @version    0.0.1
+ * @brief	   Streaming JPEG marker scanner
+ * @date       28/July/2021
+ * @bug        NA
+
+ * @note       Bytes are fed as they arrive from the camera, in chunks of
+ * 			   any size. The scanner checks SOI, segment lengths, SOF
+ * 			   dimensions, entropy data stuffing and EOI, and records the
+ * 			   offset of each marker in a small index.
+ *
+ * 			   With a Jpeg_Dc attached, the Huffman data of baseline images
+ * 			   is decoded far enough to recover the luminance DC terms (the
+ * 			   block means). They are averaged on a coarse grid and reduced
+ * 			   to a 64 bit fingerprint of the scene, no IDCT is done.
+ */
+/*****************************************************************************/
+#ifndef __JPEG_H
+#define __JPEG_H
+
+/******************** INCLUDE FILES ******************************************/
+#include "stdint.h"
+
+/******************** DEFINE MACROS ******************************************/
+
+#define JPEG_INDEX_MAX   16		// Markers kept in the index
+
+#define JPEG_DC_GRID     8		// Fingerprint grid, JPEG_DC_GRID x JPEG_DC_GRID cells
+#define JPEG_DC_CELLS    (JPEG_DC_GRID * JPEG_DC_GRID)
+#define JPEG_DC_COMP_MAX 3		// Frame components (gray or YCbCr)
+#define JPEG_DC_BLOCKS   10		// Blocks per MCU, baseline limit
+#define JPEG_HUFF_VALS   162	// Symbols of the largest (AC) table
+
+/* Markers */
+#define JPEG_SOI         0xD8
+#define JPEG_EOI         0xD9
+#define JPEG_SOS         0xDA
+#define JPEG_DQT         0xDB
+#define JPEG_DHT         0xC4
+#define JPEG_SOF0        0xC0
+#define JPEG_SOF1        0xC1
+#define JPEG_RST0        0xD0
+#define JPEG_RST7        0xD7
+
+/* Jpeg_Scan.flags, segments seen so far */
+#define JPEG_HAS_SOI     0x01
+#define JPEG_HAS_SOF     0x02
+#define JPEG_HAS_SOS     0x04
+#define JPEG_HAS_EOI     0x08
+#define JPEG_COMPLETE    (JPEG_HAS_SOI | JPEG_HAS_SOF | JPEG_HAS_SOS | JPEG_HAS_EOI)
+
+/* Function results, the values of PASS and FAIL */
+#define JPEG_PASS        0
+#define JPEG_FAIL        1
+
+/* Jpeg_Scan.error */
+#define JPEG_OK          0
+#define JPEG_ERR_SOI     1		// Stream does not start with SOI
+#define JPEG_ERR_LENGTH  2		// Segment length below 2
+#define JPEG_ERR_SOF     3		// Bad frame header or dimensions
+#define JPEG_ERR_ORDER   4		// Marker out of place (SOS before SOF, ...)
+#define JPEG_ERR_TRUNC   5		// Stream ended before EOI
+
+/******************** DEFINE STRUCT ******************************************/
+
+/* Marker index entry */
+typedef struct
+{
+	uint8_t              marker;        // Marker code (second byte)
+	uint16_t             length;        // Segment length, 0 for standalone markers
+	uint32_t             offset;        // Stream offset of the 0xFF byte
+
+}Jpeg_Marker;
+
+/* Huffman table, as sent in DHT */
+typedef struct
+{
+	uint8_t              bits[16];      // Codes of each length 1..16
+	uint8_t              val[JPEG_HUFF_VALS]; // Symbols in code order
+
+}Jpeg_Huff;
+
+/* DC term decoder */
+typedef struct
+{
+	Jpeg_Huff            huff[4];       // DC0, DC1, AC0, AC1
+	uint8_t              state;         // Decoder state
+	uint16_t             pos;           // Byte position in DHT table / SOF / SOS
+	uint8_t              tbl;           // DHT table being loaded
+	uint16_t             total;         // Symbols of that table
+
+	uint8_t              comps;         // Frame components
+	uint8_t              comp_id[JPEG_DC_COMP_MAX];
+	uint8_t              comp_hv[JPEG_DC_COMP_MAX]; // Sampling factors H << 4 | V
+	uint8_t              blocks;        // Blocks per MCU
+	uint8_t              blk_comp[JPEG_DC_BLOCKS]; // Frame component of each block
+	uint8_t              blk_tbl[JPEG_DC_BLOCKS];  // DC table << 4 | AC table
+	uint8_t              blk_pos[JPEG_DC_BLOCKS];  // Block position in the MCU, v << 4 | h
+	uint8_t              luma_h;        // Luma blocks per MCU, across and down
+	uint8_t              luma_v;
+	uint16_t             mcu_x;         // MCUs per row
+	uint16_t             mcu_y;         // MCU rows
+	uint32_t             mcu;           // MCU being decoded
+
+	uint8_t              blk;           // Block in the MCU
+	uint8_t              k;             // Coefficient in the block
+	int16_t              pred[JPEG_DC_COMP_MAX]; // DC predictors
+	uint16_t             code;          // Huffman code so far
+	uint16_t             first;         // First code of the current length
+	uint16_t             index;         // Symbol index of that code
+	uint8_t              len;           // Code length so far - 1
+	uint8_t              size;          // Coefficient size in bits
+	uint8_t              need;          // Coefficient bits still to read
+	uint16_t             value;         // Coefficient bits so far
+
+	int32_t              sum[JPEG_DC_CELLS]; // Luma DC sum per grid cell
+	uint16_t             cnt[JPEG_DC_CELLS]; // Luma blocks per grid cell
+
+}Jpeg_Dc;
+
+/* Scanner state */
+typedef struct
+{
+	uint8_t              state;         // Parser state
+	uint8_t              marker;        // Marker being parsed
+	uint16_t             seg_len;       // Length field of the segment
+	uint16_t             seg_left;      // Segment bytes left to skip
+	uint8_t              sof[6];        // P, Y, X, Nf of the frame header
+	uint8_t              sof_idx;       // Frame header bytes collected
+	uint32_t             offset;        // Bytes scanned
+	uint32_t             eoi;           // Offset just past EOI
+	uint16_t             width;         // Frame width from SOF
+	uint16_t             height;        // Frame height from SOF
+	uint8_t              components;    // Components from SOF
+	uint8_t              flags;         // JPEG_HAS_*
+	uint8_t              error;         // JPEG_OK or JPEG_ERR_*
+	uint8_t              count;         // Markers in index
+	Jpeg_Marker          index[JPEG_INDEX_MAX]; // Marker index
+	Jpeg_Dc             *dc;            // DC decoder, NULL to skip
+
+}Jpeg_Scan;
+
+/******************** FUNCTION DECLARATION************************************/
+
+/*****************************************************************************/
+/*! @fn       jpeg_init
+ *  @brief    Resets the scanner for a new image.
+ *  @param    Scanner, DC decoder (NULL to only check the markers)
+ */
+/*****************************************************************************/
+void jpeg_init(Jpeg_Scan *scan, Jpeg_Dc *dc);
+
+/*****************************************************************************/
+/*! @fn       jpeg_feed
+ *  @brief    Scans the next bytes of the stream. Bytes after EOI are only
+ *  		  counted.
+ *  @param    Scanner, data, data size
+ *  @return   pass or fail (scan->error tells why)
+ */
+/*****************************************************************************/
+uint8_t jpeg_feed(Jpeg_Scan *scan, const uint8_t *data, uint32_t size);
+
+/*****************************************************************************/
+/*! @fn       jpeg_check
+ *  @brief    Final check once the whole image was fed. The image must be
+ *  		  complete (SOI, SOF, SOS, EOI) and, if given, match the
+ *  		  expected dimensions.
+ *  @param    Scanner, expected width and height (0 to skip)
+ *  @return   pass or fail
+ */
+/*****************************************************************************/
+uint8_t jpeg_check(Jpeg_Scan *scan, uint16_t width, uint16_t height);
+
+/*****************************************************************************/
+/*! @fn       jpeg_find
+ *  @brief    Looks up a marker in the index.
+ *  @param    Scanner, marker code
+ *  @return   first index entry of the marker or NULL
+ */
+/*****************************************************************************/
+const Jpeg_Marker* jpeg_find(const Jpeg_Scan *scan, uint8_t marker);
+
+/*****************************************************************************/
+/*! @fn       jpeg_dc_hash
+ *  @brief    Fingerprint of the image once it was fed completely. Bit n is
+ *  		  set when grid cell n (row major) is brighter than the mean of
+ *  		  all cells. It does not depend on the quality setting and
+ *  		  little on the resolution.
+ *  @param    DC decoder, fingerprint
+ *  @return   pass, or fail when the image could not be decoded
+ *  		  (progressive, corrupt, smaller than the grid)
+ */
+/*****************************************************************************/
+uint8_t jpeg_dc_hash(const Jpeg_Dc *dc, uint64_t *hash);
+
+/*****************************************************************************/
+/*! @fn       jpeg_dc_distance
+ *  @brief    Number of fingerprint bits that differ.
+ */
+/*****************************************************************************/
+uint8_t jpeg_dc_distance(uint64_t a, uint64_t b);
+
+#endif /* __JPEG_H */
@@ -47,6 +47,12 @@ extern "C" {
 
 /* Exported macro ------------------------------------------------------------*/
 /* USER CODE BEGIN EM */
+/* Places a large buffer in SRAM2 (.sram2, not zeroed at startup) */
+#define SECTION_SRAM2 __attribute__((section(".sram2")))
+
+/* Keeps state across Stop modes and resets (.retained, first in SRAM2, not
+ * zeroed at startup). Contents must be validated before use. */
+#define SECTION_RETAINED __attribute__((section(".retained")))
 
 /* USER CODE END EM */
 
@@ -0,0 +1,165 @@
+/*****************************************************************************/
+/*!
+ * @project    EcoSense
+ * @file       mqtt.h
+ * @author     Long Tran
+ * @version    0.0.1
+ * @brief	   MQTT 3.1.1 QoS 1 publisher
+ * @date       28/July/2021
+ * @bug        NA
+
+ * @note       Publishes run over any Transport (Wi-Fi or LTE socket). Up to
+ * 			   MQTT_INFLIGHT QoS 1 publishes are sent back to back before a
+ * 			   PUBACK is waited for, so a batch of records costs one round
+ * 			   trip instead of one per record.
+ *
+ * 			   Each publish stays in its slot until acknowledged. The
+ * 			   session is persistent (clean session 0) and unacknowledged
+ * 			   publishes are sent again with DUP after a reconnect, so a
+ * 			   dropped link loses nothing. Memory is fixed: the client
+ * 			   struct is the whole state, nothing is allocated.
+ */
+/*****************************************************************************/
+#ifndef __MQTT_H
+#define __MQTT_H
+
+/******************** INCLUDE FILES ******************************************/
+#include "stdint.h"
+#include "transport.h"
+
+/******************** DEFINE MACROS ******************************************/
+
+#define MQTT_INFLIGHT     4		// QoS 1 publishes sent before waiting for PUBACK
+#define MQTT_TOPIC_MAX    48		// Topic length limit
+#define MQTT_PAYLOAD_MAX  128		// Payload length limit
+#define MQTT_TIMEOUT      10000		// CONNACK/PUBACK wait (ms)
+#define MQTT_KEEPALIVE    60		// Keep alive sent in CONNECT (s)
+
+/* Packet buffer, the largest packet is a full publish */
+#define MQTT_BUFF         (5 + 2 + MQTT_TOPIC_MAX + 2 + MQTT_PAYLOAD_MAX)
+
+/* Control packet types, upper nibble of the first byte */
+#define MQTT_CONNECT      0x10
+#define MQTT_CONNACK      0x20
+#define MQTT_PUBLISH      0x30
+#define MQTT_PUBACK       0x40
+#define MQTT_PINGREQ      0xC0
+#define MQTT_PINGRESP     0xD0
+#define MQTT_DISCONNECT   0xE0
+
+#define MQTT_QOS1         0x02		// PUBLISH flags
+#define MQTT_DUP          0x08
+
+/* Incoming packet parser states */
+#define MQTT_S_TYPE       0		// First byte
+#define MQTT_S_LENGTH     1		// Remaining length, 1 to 4 bytes
+#define MQTT_S_BODY       2		// Variable header and payload
+
+/******************** DEFINE STRUCT ******************************************/
+
+/* Publish waiting for its PUBACK */
+typedef struct
+{
+	uint16_t             id;            // Packet identifier, 0 when the slot is free
+	uint8_t              sent;          // Sent at least once, DUP on the next send
+	uint8_t              topic_len;
+	uint8_t              len;           // Payload length
+	char                 topic[MQTT_TOPIC_MAX];
+	uint8_t              payload[MQTT_PAYLOAD_MAX];
+
+}Mqtt_Slot;
+
+typedef struct
+{
+	const Transport     *net;           // Socket carrying the connection
+	const char          *host;          // Broker name or IP
+	uint16_t             port;          // Broker port
+	uint8_t              tls;           // 1 for TLS
+	const char          *client_id;     // Fixed id, the session is kept under it
+	uint8_t              connected;     // CONNACK accepted on the open socket
+	uint8_t              connack;       // CONNACK return code, 0xFF while waiting
+	uint8_t              session;       // Broker reported a kept session
+	uint16_t             next_id;       // Last packet identifier used
+	uint32_t             last_tx;       // Tick of the last packet sent
+
+	Mqtt_Slot            slot[MQTT_INFLIGHT]; // In-flight publishes in send order, kept across reconnects
+	uint8_t              head;          // Oldest slot
+	uint8_t              count;         // Slots from head on, acked ones inside included
+	uint8_t              inflight;      // Publishes not acknowledged
+	uint32_t             acked;         // PUBACKs received
+
+	uint8_t              state;         // MQTT_S_*
+	uint8_t              type;          // First byte of the incoming packet
+	uint32_t             left;          // Remaining length still to read
+	uint8_t              shift;         // Remaining length bits read
+	uint8_t              body[4];       // Start of the incoming packet body
+	uint8_t              body_len;
+
+	uint8_t              buff[MQTT_BUFF]; // Outgoing packet, incoming bytes
+
+}Mqtt_Client;
+
+/******************** FUNCTION DECLARATION************************************/
+
+/*****************************************************************************/
+/*! @fn       mqtt_init
+ *  @brief    Sets up a client, no connection is made yet. The in-flight
+ *  		  slots start empty, call once, not per connection.
+ *  @param    Client, transport, broker, port, 1 for TLS, client id
+ */
+/*****************************************************************************/
+void mqtt_init(Mqtt_Client *mqtt, const Transport *net, const char *host,
+			   uint16_t port, uint8_t tls, const char *client_id);
+
+/*****************************************************************************/
+/*! @fn       mqtt_connect
+ *  @brief    Opens the socket, sends CONNECT and waits for CONNACK, then
+ *  		  sends the publishes still in flight again with DUP. Returns
+ *  		  at once when connected.
+ *  @return   pass or fail
+ */
+/*****************************************************************************/
+uint8_t mqtt_connect(Mqtt_Client *mqtt);
+
+/*****************************************************************************/
+/*! @fn       mqtt_publish
+ *  @brief    Queues a QoS 1 publish and sends it without waiting for its
+ *  		  PUBACK. With all MQTT_INFLIGHT slots in use, waits for the
+ *  		  oldest to be acknowledged first. Connects when needed.
+ *  @param    Client, topic, payload, payload length
+ *  @return   pass once sent, fail when it does not fit, no slot came free
+ *  		  or the send failed. A queued publish stays queued through a
+ *  		  failed send and goes out on the next connect.
+ */
+/*****************************************************************************/
+uint8_t mqtt_publish(Mqtt_Client *mqtt, const char *topic, const uint8_t *payload, uint8_t len);
+
+/*****************************************************************************/
+/*! @fn       mqtt_flush
+ *  @brief    Waits until every publish in flight is acknowledged.
+ *  @param    Client, timeout in ms
+ *  @return   pass or fail (some still in flight)
+ */
+/*****************************************************************************/
+uint8_t mqtt_flush(Mqtt_Client *mqtt, uint32_t timeout);
+
+/*****************************************************************************/
+/*! @fn       mqtt_poll
+ *  @brief    Reads incoming packets for up to timeout ms, or until one
+ *  		  arrives. Sends PINGREQ when the link was idle for half the
+ *  		  keep alive.
+ *  @param    Client, timeout in ms
+ *  @return   pass, or fail when the connection was lost
+ */
+/*****************************************************************************/
+uint8_t mqtt_poll(Mqtt_Client *mqtt, uint32_t timeout);
+
+/*****************************************************************************/
+/*! @fn       mqtt_disconnect
+ *  @brief    Sends DISCONNECT and closes the socket. Publishes in flight
+ *  		  stay queued for the next connect.
+ */
+/*****************************************************************************/
+void mqtt_disconnect(Mqtt_Client *mqtt);
+
+#endif /* __MQTT_H */
@@ -0,0 +1,242 @@
+/*****************************************************************************/
+/*!
+ * @project    EcoSense
+ * @file       nmea.h
+ * @author     Long Tran
+ * @version    0.0.1
+ * @brief	   NMEA 0183 stream parser
+ * @date       28/July/2021
+ * @bug        NA
+
+ * @note       Byte driven: nmea_feed takes the stream in whatever pieces
+ * 			   it arrives in (UART hook, interrupt context) and never
+ * 			   copies a sentence. Numbers are converted digit by digit
+ * 			   as the field arrives, so no field text is kept either.
+ *
+ * 			   A sentence only updates the results once its *hh checksum
+ * 			   passed; until then it is read into a pending record.
+ * 			   Empty fields are fields, ",," keeps every later field in
+ * 			   place. Positions are fixed-point 1e-7 degree, no float.
+ *
+ * 			   GGA, RMC, GSA, GSV and VTG of one epoch are merged into a
+ * 			   fix record. Only GGA and RMC carry the time, so an epoch
+ * 			   ends when one of them brings a new time; the record is
+ * 			   published then, one epoch late, or by nmea_close.
+ */
+/*****************************************************************************/
+#ifndef __NMEA_H
+#define __NMEA_H
+
+/******************** INCLUDE FILES ******************************************/
+#include "stdint.h"
+
+/******************** DEFINE MACROS ******************************************/
+
+#define NMEA_LINE_MAX     82		// Longest sentence from '$' to the checksum
+#define NMEA_ADDR_MAX     5		// Address field, talker and type ("GPRMC")
+#define NMEA_FRAC_DIGITS  7		// Fraction digits kept per field, more are cut
+#define NMEA_DEGREE       10000000	// One degree in position units
+
+/* Sentence types, bits of the nmea_feed result */
+#define NMEA_RMC          0x01
+#define NMEA_GGA          0x02
+#define NMEA_GSA          0x04
+#define NMEA_GSV          0x08
+#define NMEA_VTG          0x10
+#define NMEA_FIX          0x80		// Epoch fix record published
+
+/* Constellations, by talker or satellite number */
+#define NMEA_GNSS_GPS     0
+#define NMEA_GNSS_GLONASS 1
+#define NMEA_GNSS_GALILEO 2
+#define NMEA_GNSS_BEIDOU  3
+#define NMEA_GNSS_COUNT   4
+#define NMEA_GNSS_NONE    0xFF
+
+/* Fix types, as GSA reports them */
+#define NMEA_FIX_NONE     1
+#define NMEA_FIX_2D       2
+#define NMEA_FIX_3D       3
+
+#define NMEA_GSV_SATS     4		// Satellites per GSV sentence
+
+/* Parser states */
+#define NMEA_S_IDLE       0		// Waiting for '$'
+#define NMEA_S_BODY       1		// Fields, checksum running
+#define NMEA_S_SUM_HI     2		// First checksum digit
+#define NMEA_S_SUM_LO     3		// Second checksum digit
+
+/******************** DEFINE STRUCT ******************************************/
+
+/* Field being read, numbers are converted as the digits arrive */
+typedef struct
+{
+	uint8_t              len;           // Characters, 0 for an empty field
+	char                 first;         // First character
+	uint8_t              number;        // Only a sign, digits and one dot so far
+	uint8_t              neg;           // Leading '-'
+	uint8_t              dot;           // Decimal point seen
+	uint8_t              frac_len;      // Fraction digits read
+	uint32_t             whole;         // Integer part
+	uint32_t             frac;          // Fraction, NMEA_FRAC_DIGITS digits
+
+}Nmea_Field;
+
+/* Recommended minimum data */
+typedef struct
+{
+	uint8_t              valid;         // Status A with time and position
+	uint8_t              timed;         // Time present
+	uint32_t             time;          // UTC, ms since midnight
+	int32_t              lat;           // 1e-7 degree, north positive
+	int32_t              lon;           // 1e-7 degree, east positive
+	uint32_t             speed;         // Speed over ground, m/h
+	uint16_t             course;        // Course over ground, 0.01 degree
+	uint8_t              day;           // UTC date, 0 when not sent
+	uint8_t              month;
+	uint16_t             year;
+
+}Nmea_Rmc;
+
+/* Fix data */
+typedef struct
+{
+	uint8_t              valid;         // Fix quality above 0 with position
+	uint8_t              timed;         // Time present
+	uint32_t             time;          // UTC, ms since midnight
+	int32_t              lat;           // 1e-7 degree, north positive
+	int32_t              lon;           // 1e-7 degree, east positive
+	int32_t              alt;           // Altitude above mean sea level, cm
+	uint8_t              quality;       // 0 none, 1 GNSS, 2 DGNSS..
+	uint8_t              used;          // Satellites used
+	uint16_t             hdop;          // 0.01, 0 when not sent
+
+}Nmea_Gga;
+
+/* DOP and active satellites, one per constellation in a combined fix */
+typedef struct
+{
+	uint8_t              fix;           // NMEA_FIX_*, 0 when not sent
+	uint8_t              used;          // Satellite fields filled
+	uint16_t             pdop;          // 0.01, 0 when not sent
+	uint16_t             hdop;
+	uint16_t             vdop;
+
+}Nmea_Gsa;
+
+/* One sentence of a satellites in view set */
+typedef struct
+{
+	uint8_t              gnss;          // NMEA_GNSS_*
+	uint8_t              number;        // Sentence of the set, from 1
+	uint8_t              view;          // Satellites in view
+	uint8_t              count;         // Satellites in this sentence
+	uint8_t              cn0[NMEA_GSV_SATS]; // dB-Hz, 0 when not tracked
+
+}Nmea_Gsv;
+
+/* Course and speed */
+typedef struct
+{
+	uint8_t              valid;         // Speed present
+	uint16_t             course;        // True course, 0.01 degree
+	uint32_t             speed;         // m/h
+
+}Nmea_Vtg;
+
+/* Signal of one constellation */
+typedef struct
+{
+	uint8_t              view;          // Satellites in view
+	uint8_t              tracked;       // Satellites with a C/N0
+	uint8_t              cn0_max;       // dB-Hz
+	uint8_t              cn0_mean;      // dB-Hz, over the tracked ones
+
+}Nmea_Sky;
+
+/* Everything known about one epoch */
+typedef struct
+{
+	uint8_t              valid;         // Position fix
+	uint8_t              seen;          // NMEA_* of the sentences merged
+	uint32_t             time;          // UTC, ms since midnight
+	uint8_t              day;           // UTC date, 0 when no RMC
+	uint8_t              month;
+	uint16_t             year;
+	int32_t              lat;           // 1e-7 degree, north positive
+	int32_t              lon;           // 1e-7 degree, east positive
+	int32_t              alt;           // Altitude above mean sea level, cm
+	uint32_t             speed;         // m/h
+	uint16_t             course;        // 0.01 degree
+	uint8_t              fix;           // NMEA_FIX_*, 0 when no GSA
+	uint8_t              quality;       // GGA fix quality
+	uint8_t              used;          // Satellites used
+	uint8_t              view;          // Satellites in view, all constellations
+	uint16_t             hdop;          // 0.01, 0 when unknown
+	uint16_t             pdop;
+	uint16_t             vdop;
+	Nmea_Sky             sky[NMEA_GNSS_COUNT];
+
+}Nmea_Fix;
+
+typedef struct
+{
+	uint8_t              state;         // NMEA_S_*
+	uint8_t              sum;           // XOR of the characters after '$'
+	uint8_t              check;         // Checksum sent
+	uint8_t              length;        // Characters after '$'
+	uint8_t              type;          // NMEA_* of the sentence, 0 when ignored
+	uint8_t              index;         // Field being read, 0 is the address
+	uint8_t              addr_len;
+	char                 addr[NMEA_ADDR_MAX];
+	Nmea_Field           field;
+
+	union                               // Sentence being read
+	{
+		Nmea_Rmc         rmc;
+		Nmea_Gga         gga;
+		Nmea_Gsa         gsa;
+		Nmea_Gsv         gsv;
+		Nmea_Vtg         vtg;
+	}                    pend;
+
+	Nmea_Rmc             rmc;           // Last RMC that passed
+	Nmea_Fix             epoch;         // Epoch being merged
+	uint8_t              epoch_timed;   // Epoch time known
+	uint8_t              gsa_used;      // Satellites used over the epoch GSAs
+	uint16_t             cn0_sum[NMEA_GNSS_COUNT]; // Over the tracked satellites
+	Nmea_Fix             fix;           // Last epoch published
+
+	uint32_t             sentences;     // Sentences taken
+	uint32_t             errors;        // Checksum and format failures
+
+}Nmea_Parser;
+
+/******************** FUNCTION DECLARATION************************************/
+
+/*****************************************************************************/
+/*! @fn       nmea_init
+ *  @brief    Clears the parser and its results.
+ */
+/*****************************************************************************/
+void nmea_init(Nmea_Parser *nmea);
+
+/*****************************************************************************/
+/*! @fn       nmea_feed
+ *  @brief    Parses the next bytes of the stream. Sentences may be split
+ *  		  across calls at any byte.
+ *  @param    Parser, data, size
+ *  @return   NMEA_* bits of the sentences taken in this call
+ */
+/*****************************************************************************/
+uint8_t nmea_feed(Nmea_Parser *nmea, const char *data, uint16_t size);
+
+/*****************************************************************************/
+/*! @fn       nmea_close
+ *  @brief    Publishes the epoch being merged, for the end of a stream.
+ *  @return   NMEA_FIX, or 0 when nothing was merged
+ */
+/*****************************************************************************/
+uint8_t nmea_close(Nmea_Parser *nmea);
+
+#endif /* __NMEA_H */
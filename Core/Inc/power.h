@@ -0,0 +1,99 @@
+/*****************************************************************************/
+/*!
+ * @project    EcoSense
+ * @file       power.h
+ * @author     Long Tran
+ * @version    0.0.1
+ * @brief	   Low power wait handler
+ * @date       28/July/2021
+ * @bug        NA
+
+ * @note       Waits put the core to sleep instead of spinning in HAL_Delay.
+ * 			   power_wait sleeps (WFI, SysTick off) until an interrupt sets
+ * 			   the awaited event or TIM7 ends the timeout; UART DMA keeps
+ * 			   running. power_stop enters Stop 2 for idle gaps when no
+ * 			   module response is pending, woken by LPTIM1 on LSI.
+ * 			   power_stop_wait uses Stop 1 instead, where a port set up
+ * 			   with uart_wake can also wake the core.
+ */
+/*****************************************************************************/
+#ifndef __POWER_H
+#define __POWER_H
+
+/******************** INCLUDE FILES ******************************************/
+#include "stdint.h"
+
+/******************** DEFINE MACROS ******************************************/
+
+#define POWER_TIM_HZ       10000	// TIM7 wake timer tick
+#define POWER_TIM_MAX_MS   6500		// Longest single TIM7 sleep, longer waits loop
+#define POWER_LPTIM_MAX_MS 65000	// Longest single Stop 1/2 period
+#define POWER_RX_MS        20		// Time awake after a port woke the core from Stop 1
+
+/******************** FUNCTION DECLARATION************************************/
+
+/*****************************************************************************/
+/*! @fn       power_init
+ *  @brief    Sets up the TIM7 (sleep) and LPTIM1 (Stop 2) wake timers.
+ *  		  Called once after SystemClock_Config.
+ */
+/*****************************************************************************/
+void power_init(void);
+
+/*****************************************************************************/
+/*! @fn       power_wait
+ *  @brief    Sleeps until *event no longer equals idle or timeout ms pass.
+ *  		  *event must be changed from interrupt context (UART, DMA).
+ *  @param    Event to wait on, its idle value, timeout in ms
+ *  @return   pass when the event fired, fail on timeout
+ */
+/*****************************************************************************/
+uint8_t power_wait(volatile uint8_t *event, uint8_t idle, uint32_t timeout);
+
+/*****************************************************************************/
+/*! @fn       power_sleep
+ *  @brief    Sleep mode replacement for HAL_Delay. Peripherals and DMA
+ *  		  keep running.
+ *  @param    Time in ms
+ */
+/*****************************************************************************/
+void power_sleep(uint32_t ms);
+
+/*****************************************************************************/
+/*! @fn       power_stop
+ *  @brief    Enters Stop 2 for ms and restores the system clock on wake.
+ *  		  UART reception stops, only use between command sequences.
+ *  @param    Time in ms
+ */
+/*****************************************************************************/
+void power_stop(uint32_t ms);
+
+/*****************************************************************************/
+/*! @fn       power_stop_wait
+ *  @brief    Waits in Stop 1 until *event no longer equals idle or timeout
+ *  		  ms pass. Meant for a port armed with uart_wake: its start bit
+ *  		  wakes the core, which then stays in Sleep mode for
+ *  		  POWER_RX_MS so DMA can take in the rest of the message before
+ *  		  stopping again. Falls back to power_wait while a UART transmit
+ *  		  is running.
+ *  @param    Event to wait on, its idle value, timeout in ms
+ *  @return   pass when the event fired, fail on timeout
+ */
+/*****************************************************************************/
+uint8_t power_stop_wait(volatile uint8_t *event, uint8_t idle, uint32_t timeout);
+
+/*****************************************************************************/
+/*! @Function Name: power_tim_isr
+ *  @brief        : Handles TIM7 wake timer interrupt request
+ */
+/*****************************************************************************/
+void power_tim_isr(void);
+
+/*****************************************************************************/
+/*! @Function Name: power_lptim_isr
+ *  @brief        : Handles LPTIM1 wake timer interrupt request
+ */
+/*****************************************************************************/
+void power_lptim_isr(void);
+
+#endif /* __POWER_H */
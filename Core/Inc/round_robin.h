@@ -1,38 +1,123 @@
 /*****************************************************************************/
 /*!
  * @project    EcoSense
- * @file       round_robin.c
+ * @file       round_robin.h
  * @author     Long Tran
- * @version    1.1
+ * @version    1.2
  * @brief	   Round Robin handler
  * @date       28/July/2021
  * @bug        NA
 
- * @note
+ * @note       Cooperative scheduler for the module command sequences. Each
+ * 			   device runs as a protothread style task on its own UART, so
+ * 			   the camera, Wi-Fi and GPS sequences overlap. A task returns
+ * 			   RR_RUNNING whenever it waits; the scheduler sleeps until a
+ * 			   response matches on any port or the nearest task timeout.
+ *
+ * 			   Task locals do not survive a wait, keep state in Rr_Task.
+ * 			   Wait macros cannot be used inside a switch statement.
  */
 /*****************************************************************************/
+#ifndef __ROUND_ROBIN_H
+#define __ROUND_ROBIN_H
 
 /******************** HEADER FILES *******************************************/
+#include "stdint.h"
+#include "uart.h"
+#include "stm32l4xx_hal.h"
 
 /******************** DEFINE MACROS ******************************************/
 
+#define RR_RUNNING 0	// Task is waiting, call again
+#define RR_DONE    1	// Task finished its sequence
+#define RR_FAILED  2	// Task gave up
+
+#define RR_TASK_MAX     4
+#define RR_CMD_TIMEOUT  1000	// Default AT/camera command timeout (ms)
+
+/* Protothread style task body, RR_BEGIN/RR_END enclose the whole sequence */
+#define RR_BEGIN(task)	switch((task)->line){ case 0:
+
+#define RR_END(task)	} (task)->line = 0; return RR_DONE
+
+#define RR_EXIT(task)	do{ (task)->line = 0; return RR_FAILED; }while(0)
+
+/* Yields until cond is true or ms pass, check rr_expired after a timeout */
+#define RR_WAIT_UNTIL(task, cond, ms)								\
+	do{																\
+		(task)->start   = HAL_GetTick();							\
+		(task)->timeout = (ms);										\
+		(task)->line    = __LINE__; case __LINE__:					\
+		if( !(cond) && !rr_expired(task) ){							\
+			return RR_RUNNING;										\
+		}															\
+	}while(0)
+
+#define RR_SLEEP(task, ms)	RR_WAIT_UNTIL(task, 0, ms)
+
+/* Yields until one of the patterns arrives on the task port, the pattern
+ * index (or UART_NO_MATCH) is left in task->hit */
+#define RR_WAIT_RESP(task, resp, count, ms)							\
+	do{																\
+		uart_rx_match((task)->port, (resp), (count));				\
+		RR_WAIT_UNTIL(task, (task)->port->match_hit != UART_NO_MATCH, ms); \
+		(task)->hit = (task)->port->match_hit;						\
+	}while(0)
+
+/* Yields until count bytes arrived on the task port since the last flush,
+ * task->hit is 0 or UART_NO_MATCH */
+#define RR_WAIT_COUNT(task, count, ms)								\
+	do{																\
+		uart_rx_count((task)->port, (count));						\
+		RR_WAIT_UNTIL(task, (task)->port->match_hit != UART_NO_MATCH, ms); \
+		(task)->hit = (task)->port->match_hit;						\
+	}while(0)
+
+/* Sends a command on the task port and yields until a response matches */
+#define RR_CMD(task, cmd, len, resp, count, ms)						\
+	do{																\
+		uart_tx((task)->port, (cmd), (len));						\
+		RR_WAIT_RESP(task, resp, count, ms);						\
+	}while(0)
 
 /******************** DEFINE ENUMS and STRUCT ********************************/
 
-/* Enumeration for Round Robin States */
-typedef enum
+typedef struct Rr_Task Rr_Task;
+
+/* Task body, returns RR_RUNNING, RR_DONE or RR_FAILED */
+typedef char (*Rr_Thread)(Rr_Task *task);
+
+struct Rr_Task
 {
-	START,
-	WIFI,
-	//LTE,
-	CAMERA,
-	DATA_AQ,
-}rr_States;
+	const char          *name;          // Task name for the log
+	Rr_Thread            thread;        // Task body
+	Uart_Port           *port;          // Module port the task drives
+	uint16_t             line;          // Protothread resume point
+	uint32_t             start;         // Tick the current wait began
+	uint32_t             timeout;       // Current wait timeout in ms
+	uint8_t              state;         // RR_RUNNING, RR_DONE or RR_FAILED
+	uint8_t              hit;           // Last RR_WAIT_RESP result
+	uint16_t             step;          // Free for the task (loop counters)
+};
 
+/******************** FUNCTION DECLARATION************************************/
 
-/******************** DEFINE GLOBAL VARIABLES  *******************************/
+/*****************************************************************************/
+/*! @fn       rr_run
+ *  @brief    Runs the tasks concurrently until every task is done or failed.
+ *  		  The core sleeps between task steps.
+ *  @param    Task array, number of tasks (RR_TASK_MAX max)
+ *  @return   pass when all tasks are done, else fail
+ */
+/*****************************************************************************/
+char rr_run(Rr_Task *tasks, uint8_t count);
 
-rr_States rrCurrentState = START;
-rr_States rrPreviousState = START;
+/*****************************************************************************/
+/*! @fn       rr_expired
+ *  @brief    Check the current wait of a task for timeout.
+ *  @return   1 when the wait timed out, else 0
+ */
+/*****************************************************************************/
+uint8_t rr_expired(Rr_Task *task);
 
-/******************** FUNCTION DECLARATION************************************/
+#endif /* __ROUND_ROBIN_H */
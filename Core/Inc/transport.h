@@ -0,0 +1,46 @@
+/*****************************************************************************/
+/*!
+ * @project    EcoSense
+ * @file       transport.h
+ * @author     Long Tran
+ * @version    0.0.1
+ * @brief	   Byte stream transport interface
+ * @date       28/July/2021
+ * @bug        NA
+
+ * @note       A module socket (Wi-Fi or LTE) seen as a plain byte stream,
+ * 			   so the upload protocols do not depend on the AT dialect of
+ * 			   the module carrying them. Each module offers one socket.
+ * 			   All calls block, sleeping while the module answers.
+ */
+/*****************************************************************************/
+#ifndef __TRANSPORT_H
+#define __TRANSPORT_H
+
+/******************** INCLUDE FILES ******************************************/
+#include "stdint.h"
+
+/******************** DEFINE MACROS ******************************************/
+
+#define TRANSPORT_CLOSED  (-1)	// recv result, connection lost or closed by peer
+
+/******************** DEFINE STRUCT ******************************************/
+
+typedef struct
+{
+	/* Opens a TCP (tls = 0) or TLS connection, pass or fail */
+	uint8_t (*open)(const char *host, uint16_t port, uint8_t tls);
+
+	/* Sends all size bytes, pass or fail */
+	uint8_t (*send)(const uint8_t *data, uint16_t size);
+
+	/* Waits up to timeout ms for data, returns the bytes read (size max),
+	 * 0 on timeout or TRANSPORT_CLOSED */
+	int16_t (*recv)(uint8_t *data, uint16_t size, uint32_t timeout);
+
+	/* Closes the connection, safe to call when closed */
+	void    (*close)(void);
+
+}Transport;
+
+#endif /* __TRANSPORT_H */
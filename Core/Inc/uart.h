@@ -3,14 +3,22 @@
  * @project    EcoSense
  * @file       uart.h
  * @author     Long Tran
- * @version    0.0.1
+ * @version    0.0.2
  * @brief	   UART handler
  * @date       28/July/2021
  * @bug        NA
 
- * @note
+ * @note       Each module port (Wi-Fi, camera, LTE/GPS) owns a receive
+ * 			   buffer filled by a circular DMA channel. USART IDLE-line
+ * 			   interrupts mark the end of each received frame. Transmit
+ * 			   buffers are queued per port and sent by a TX DMA channel.
+ * 			   Received bytes are fed to a per-port set of KMP matchers
+ * 			   from the RX interrupts, so waits end as soon as any of the
+ * 			   expected responses (OK, ERROR, ...) arrives.
  */
 /*****************************************************************************/
+#ifndef __UART_H
+#define __UART_H
 
 /******************** INCLUDE FILES ******************************************/
 #include "stdint.h"
@@ -19,6 +27,7 @@
 
 #define TX_FREE                  		 (uint8_t)0
 #define TX_BUSY                  		 (uint8_t)1
+#define TX_ERROR                 		 (uint8_t)2
 
 #define PASS 0
 #define FAIL 1
@@ -34,59 +43,237 @@
 #define UART_DELAY      20
 #define UART_1S_TIMEOUT 1000/UART_DELAY
 
-/******************** DEFINE GLOBAL VARIABLES  *******************************/
-// generic uart return buffer
-char rx_buff[BUFF_MAX];
-volatile uint16_t rx_idx;
+#define UART_DMA_REQ    2	// CSELR request number of every USART/UART channel
+#define UART_DMA_MAX    0xFFFF	// CNDTR limit, longer buffers are sent in blocks
+#define UART_TXQ_MAX    4	// Queued transmit buffers per port
+#define UART_MATCH_MAX  32	// Longest response pattern the matcher accepts
+#define UART_MATCH_SET  4	// Patterns one wait can match in parallel
+#define UART_NO_MATCH   0xFF	// uart_rx_wait timeout result
 
 /******************** DEFINE STRUCT ******************************************/
 
+/* Transmit completion callback, called from DMA interrupt with TX_FREE or TX_ERROR */
+typedef void (*Uart_TxDone)(void *ctx, uint8_t status);
+
+/* Receive hook, gets each received byte range once, in interrupt context */
+typedef void (*Uart_RxHook)(void *ctx, const char *data, uint16_t size);
+
+/* Structure for UART Tx */
+typedef struct
+{
+	const char          *ptr;           // Buffer pointer
+	uint32_t             count;         // Bytes left to send
+	uint16_t             block;         // Bytes in the running DMA block
+	Uart_TxDone          done;          // Completion callback or NULL
+	void                *ctx;           // Callback context
+	volatile uint8_t    *status;        // Buffer status or NULL
+
+}Tx_Struct;
+
+/* Response pattern for uart_rx_wait */
+typedef struct
+{
+	const char          *str;           // Pattern bytes
+	uint8_t              size;          // Pattern length
+
+}Uart_Pattern;
+
+/* Streaming response matcher (KMP automaton) */
+typedef struct
+{
+	const char          *needle;        // Pattern
+	uint8_t              size;          // Pattern length
+	uint8_t              fail[UART_MATCH_MAX]; // KMP failure function
+	uint8_t              state;         // Pattern bytes currently matched
 
+}Uart_Match;
 
+/* Per-port UART handle */
+typedef struct
+{
+	USART_TypeDef       *uart;          // USART peripheral
+	DMA_TypeDef         *dma;           // DMA controller serving the port
+	DMA_Request_TypeDef *dma_sel;       // DMA request selection register
+	DMA_Channel_TypeDef *rx_dma;        // Circular RX DMA channel
+	uint8_t              rx_ch;         // RX DMA channel number (1..7)
+	IRQn_Type            rx_irq;        // RX DMA channel interrupt
+	char                *rx_buff;       // Port receive buffer
+	uint16_t             rx_size;       // Receive buffer size
+	volatile uint16_t    rx_idx;        // DMA write index into rx_buff
+	volatile uint16_t    rx_frames;     // Idle-line frames since last flush
+	uint16_t             rx_scan;       // Bytes already fed to the matchers
+	Uart_Match           match[UART_MATCH_SET]; // Armed response matchers
+	uint8_t              match_count;   // Armed matchers, 0 when disarmed
+	volatile uint8_t     match_hit;     // Index of the first pattern received
+	volatile uint16_t    match_end;     // rx_buff index just past that match
+	uint16_t             rx_need;       // Byte count that latches match_hit, 0 when off
+	Uart_RxHook          rx_hook;       // Receive hook, NULL when off
+	void                *rx_hook_ctx;   // Receive hook context
+	uint16_t             rx_hook_pos;   // Bytes already passed to the hook
+	DMA_Channel_TypeDef *tx_dma;        // TX DMA channel
+	uint8_t              tx_ch;         // TX DMA channel number (1..7)
+	IRQn_Type            tx_irq;        // TX DMA channel interrupt
+	Tx_Struct            tx_q[UART_TXQ_MAX]; // Transmit queue
+	volatile uint8_t     tx_head;       // Queue index of the buffer on DMA
+	volatile uint8_t     tx_count;      // Buffers queued, including active
+	uint32_t             baud;          // Baud rate, kept across kernel clock changes
+
+}Uart_Port;
+
+/******************** DEFINE GLOBAL VARIABLES  *******************************/
+
+extern Uart_Port uart_wifi;
+extern Uart_Port uart_camera;
+extern Uart_Port uart_ltegps;
+
+extern volatile uint8_t uart_event;	// A response matched or a transmit ended on some port
 
 /******************** FUNCTION DECLARATION************************************/
 
+/*****************************************************************************/
+/*! @fn       uart_init
+ *  @brief    Starts circular RX DMA, IDLE-line detection and the TX DMA
+ *  		  queue on every module port. Called once after the MX_*_Init
+ *  		  functions.
+ */
+/*****************************************************************************/
+void uart_init(void);
+
 /*****************************************************************************/
 /*! @fn       uart_tx
- *  @brief    Sends data to the USART3 data buffer
- *  @param    Pointer to the data to be sent, data length, USART handler
+ *  @brief    Flushes the port receive buffer and queues a command for DMA
+ *  		  transmit. Returns without waiting for the bytes to go out.
+ *  @param    Port handle, pointer to the data to be sent, data length
+ *  @return   pass or fail (queue full)
+ */
+/*****************************************************************************/
+uint8_t uart_tx(Uart_Port *port, const char* cmd, uint32_t cmd_length);
+
+/*****************************************************************************/
+/*! @fn       uart_tx_submit
+ *  @brief    Queues a buffer of any length for DMA transmit. The buffer must
+ *  		  stay valid until completion. On completion *status is set to
+ *  		  TX_FREE (or TX_ERROR) and done(ctx, status) is called from
+ *  		  interrupt context.
+ *  @param    Port handle, data, length, callback (or NULL), callback context,
+ *  		  status (or NULL)
+ *  @return   pass or fail (queue full)
+ */
+/*****************************************************************************/
+uint8_t uart_tx_submit(Uart_Port *port, const char* data, uint32_t length,
+					   Uart_TxDone done, void *ctx, volatile uint8_t *status);
+
+/*****************************************************************************/
+/*! @fn       uart_baud
+ *  @brief    Changes the port baud rate. Waits until queued transmits and
+ *  		  the last stop bit are out, then flushes the receive buffer.
+ *  @param    Port handle, baud rate
+ */
+/*****************************************************************************/
+void uart_baud(Uart_Port *port, uint32_t baud);
+
+/*****************************************************************************/
+/*! @fn       uart_wake
+ *  @brief    Lets a received start bit wake the core from Stop 1. The port
+ *  		  kernel clock moves to HSI16, which the USART turns on by
+ *  		  itself while the core is stopped, so the byte is not lost.
+ *  		  Disabling moves the port back to its bus clock.
+ *  @param    Port handle, 1 to enable, 0 to disable
  */
 /*****************************************************************************/
-void uart_tx(char* cmd, uint8_t cmd_length, USART_TypeDef *uart);
+void uart_wake(Uart_Port *port, uint8_t enable);
+
+/*****************************************************************************/
+/*! @fn       uart_tx_busy
+ *  @brief    Check for queued or running transmit buffers on the port.
+ *  @return   TX_BUSY or TX_FREE
+ */
+/*****************************************************************************/
+uint8_t uart_tx_busy(Uart_Port *port);
 
 /*****************************************************************************/
 /*! @fn       uart_rx_print
- *  @brief    Print uart response buffer to PC
+ *  @brief    Print port response buffer to PC
  *  @return   ret -  0 for success and -1 for failure
  */
 /*****************************************************************************/
-char uart_rx_print(void);
+char uart_rx_print(Uart_Port *port);
 
 /*****************************************************************************/
 /*! @fn       uart_rx_flush
- *  @brief    Resets uart receive buffer and index
+ *  @brief    Resets port receive buffer and restarts its DMA at index 0
+ */
+/*****************************************************************************/
+void uart_rx_flush(Uart_Port *port);
+
+/*****************************************************************************/
+/*! @fn        uart_rx_match
+ *   @brief    Arms the port matchers with a set of patterns. Bytes already
+ *   		   received since the last flush are scanned once, later bytes
+ *   		   are fed from the RX interrupts as they arrive. The first
+ *   		   pattern to complete is latched in match_hit/match_end.
+ *   @param    Port handle, patterns, number of patterns (UART_MATCH_SET max)
+ *  @return    ret -  0 for success and 1 for failure
+ */
+/*****************************************************************************/
+uint8_t uart_rx_match(Uart_Port *port, const Uart_Pattern* patterns, uint8_t count);
+
+/*****************************************************************************/
+/*! @fn        uart_rx_count
+ *   @brief    Arms the port to latch match_hit = 0 once count bytes have
+ *   		   been received since the last flush. Used for binary replies
+ *   		   of known length, where a pattern could also occur in the data.
+ *   @param    Port handle, byte count (rx_size max)
+ *  @return    ret -  0 for success and 1 for failure
+ */
+/*****************************************************************************/
+uint8_t uart_rx_count(Uart_Port *port, uint16_t count);
+
+/*****************************************************************************/
+/*! @fn        uart_rx_hook
+ *   @brief    Passes the bytes received since the last flush, and then
+ *   		   each new byte range as it arrives, to hook. The hook reads
+ *   		   rx_buff in place and must not change it. The next flush
+ *   		   (uart_tx) removes the hook.
+ *   @param    Port handle, hook (NULL to remove), hook context
  */
 /*****************************************************************************/
-void uart_rx_flush(void);
+void uart_rx_hook(Uart_Port *port, Uart_RxHook hook, void *ctx);
+
+/*****************************************************************************/
+/*! @fn        uart_rx_wait
+ *   @brief    Sleeps until any of the patterns arrives or test_cnt *
+ *   		   UART_DELAY ms pass. All patterns advance together on each
+ *   		   received byte, so e.g. OK and ERROR are told apart in one
+ *   		   pass and a failing command returns as soon as it fails.
+ *   @param    Port handle, patterns, number of patterns, timeout in
+ *   		   UART_DELAY units, end (optional) receives the rx_buff index
+ *   		   just past the match
+ *  @return    index of the matched pattern or UART_NO_MATCH on timeout
+ */
+/*****************************************************************************/
+uint8_t uart_rx_wait(Uart_Port *port, const Uart_Pattern* patterns, uint8_t count,
+					 uint16_t test_cnt, uint16_t *end);
 
 /*****************************************************************************/
 /*! @fn        uart_rx_check
- *   @brief    Calls uart_rx_find until success or timeout
- *   @param    needle to scanned for in rx_buff, size of needle,
- *   		   times to call UART_Rx_Find
- *  @return    ret -  0 for success and -1 for failure
+ *   @brief    Arms the port matcher and waits until needle arrives or
+ *   		   test_cnt * UART_DELAY ms pass.
+ *   @param    Port handle, needle to scanned for in rx_buff, size of needle,
+ *   		   timeout in UART_DELAY units
+ *  @return    ret -  0 for success and 1 for failure
  */
 /*****************************************************************************/
-uint8_t uart_rx_check(char* needle, uint8_t needle_size, uint16_t test_cnt);
+uint8_t uart_rx_check(Uart_Port *port, char* needle, uint8_t needle_size, uint16_t test_cnt);
 
 /*****************************************************************************/
 /*! @Function Name: uart_rx_find
- *  @brief        : This function finds needle inside rx_buffer.
+ *  @brief        : This function finds needle inside the port rx_buff.
  *  @return		  : index to end of needle, used for rx_idx
  *  				else 0
  */
 /*****************************************************************************/
-uint16_t uart_rx_find(char* needle, uint8_t needle_size);
+uint16_t uart_rx_find(Uart_Port *port, char* needle, uint8_t needle_size);
 
 /*****************************************************************************/
 /*! @fn       LOG
@@ -106,8 +293,23 @@ void LOG_BOX(char* message);
 
 /*****************************************************************************/
 /*! @Function Name: uart_isr
- *  @brief        : Handles generic USART global interrupt request
+ *  @brief        : Handles port USART global interrupt request (IDLE)
+ */
+/*****************************************************************************/
+void uart_isr(Uart_Port *port);
+
+/*****************************************************************************/
+/*! @Function Name: uart_dma_rx_isr
+ *  @brief        : Handles port RX DMA half/full transfer interrupt request
+ */
+/*****************************************************************************/
+void uart_dma_rx_isr(Uart_Port *port);
+
+/*****************************************************************************/
+/*! @Function Name: uart_dma_tx_isr
+ *  @brief        : Handles port TX DMA transfer complete interrupt request
  */
 /*****************************************************************************/
-void uart_isr(USART_TypeDef *uart);
+void uart_dma_tx_isr(Uart_Port *port);
 
+#endif /* __UART_H */
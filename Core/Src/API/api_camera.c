@@ -15,13 +15,99 @@
 /******************** INCLUDE FILES ******************************************/
 #include "stdint.h"
 #include "stm32l476xx.h"
+#include "main.h"
 #include "api_camera.h"
+#include "string.h"
 #include "uart.h"
+#include "power.h"
+#include "jpeg.h"
 
 /******************** GLOBAL VARIABLES ***************************************/
 char imagedata[] = {0x56, 0x00, 0x32, 0x0C, 0x00, 0x0A, 0x00, 0x00,
 		            0x00, 0x00, 0x00, 0x00, 0xBE, 0xEF, 0x00, 0x0A};
 
+char imageres[]   = {0x56, 0x00, 0x54, 0x01, 0x22}; // resolution, patched from the profile
+char imagecomp[]  = {0x56, 0x00, 0x31, 0x05, 0x01, 0x01, 0x12, 0x04, 0x99}; // compression ratio, patched from the profile
+char imagecolor[] = {0x56, 0x00, 0x3C, 0x02, 0x01, 0x00}; // color mode, patched from the profile
+char imagebaud[]  = {0x56, 0x00, 0x24, 0x03, 0x01, 0x0D, 0xA6}; // 115200 until patched
+
+uint8_t camera_buff[CAMERA_BUFF_MAX] SECTION_SRAM2;
+
+// Single response patterns for the camera task
+static const Uart_Pattern Resp_CAM_Stopcap[]    = { { Resp_CAM_STOPCAP,    sizeof(Resp_CAM_STOPCAP) } };
+static const Uart_Pattern Resp_CAM_Resolution[] = { { Resp_CAM_RESOLUTION, sizeof(Resp_CAM_RESOLUTION) } };
+static const Uart_Pattern Resp_CAM_Compress[]   = { { Resp_CAM_COMPRESS,   sizeof(Resp_CAM_COMPRESS) } };
+static const Uart_Pattern Resp_CAM_Imageget[]   = { { Resp_CAM_IMAGEGET,   sizeof(Resp_CAM_IMAGEGET) } };
+static const Uart_Pattern Resp_CAM_Length[]     = { { Resp_CAM_LENGTH,     sizeof(Resp_CAM_LENGTH) } };
+static const Uart_Pattern Resp_CAM_Color[]      = { { Resp_CAM_COLOR,      sizeof(Resp_CAM_COLOR) } };
+static const Uart_Pattern Resp_CAM_Motion[]     = { { Resp_CAM_MOTION,     sizeof(Resp_CAM_MOTION) } };
+
+/******************** FUNCTION DECLARATION************************************/
+
+static void api_camera_lenparse(void);
+static uint16_t api_camera_readstart(void);
+static char api_camera_readdone(void);
+static char api_camera_buffsink(void *ctx, uint32_t offset, const char *data, uint16_t size);
+static char api_camera_setup(void);
+static void api_camera_chunkstart(void);
+static char api_camera_chunkwait(void);
+static void api_camera_pipestart(void);
+static void api_camera_pipestop(void);
+static char api_camera_pipesink(void *ctx, uint32_t offset, const char *data, uint16_t size);
+static uint16_t api_camera_pipebody(void *ctx, uint8_t *buff, uint16_t size);
+static uint16_t api_camera_buffbody(void *ctx, uint8_t *buff, uint16_t size);
+static char api_camera_baudprobe(void);
+static char api_camera_baudset(uint8_t idx);
+static void api_camera_profileload(void);
+static void api_camera_statsadd(void);
+static char api_camera_jpegcheck(void);
+static void api_camera_hashcheck(void);
+
+/******************** STATIC VARIABLES ***************************************/
+// Chunked readout state, image goes to camera_buff unless a sink is set
+static Camera_Read camera_read = { CAMERA_CHUNK_DEFAULT, api_camera_buffsink, NULL };
+
+// Pipeline upload buffer, chunk N is sent from it while N+1 is read
+static uint8_t camera_pipe_buff[CAMERA_PIPE_CHUNK] SECTION_SRAM2;
+static Camera_Pipe camera_pipe = { camera_pipe_buff };
+
+// Link speeds the SC03MPA (VC0706) accepts, fastest first
+static const Camera_Baud camera_bauds[] = {
+	{ 115200, { 0x0D, 0xA6 } },
+	{  57600, { 0x1C, 0x4C } },
+	{  38400, { 0x2A, 0xF2 } },
+	{  19200, { 0x56, 0xE4 } },
+	{   9600, { 0xAE, 0xC8 } },
+};
+
+#define CAMERA_BAUD_COUNT (sizeof(camera_bauds) / sizeof(camera_bauds[0]))
+
+static uint8_t camera_baud_idx = 0;	// USART3 rate, MX_USART3_UART_Init sets 115200
+
+// Capture profiles, smallest and most compressed first
+static const Camera_Profile camera_profiles[CAMERA_PROFILE_COUNT] = {
+	{ "160x120 q99", CAMERA_RES_160x120, 0x99, CAMERA_COLOR_AUTO, 160, 120 },
+	{ "320x240 q99", CAMERA_RES_320x240, 0x99, CAMERA_COLOR_AUTO, 320, 240 },
+	{ "320x240 q36", CAMERA_RES_320x240, 0x36, CAMERA_COLOR_AUTO, 320, 240 },
+	{ "640x480 q36", CAMERA_RES_640x480, 0x36, CAMERA_COLOR_AUTO, 640, 480 },
+};
+
+static Camera_Stats camera_stats[CAMERA_PROFILE_COUNT];
+
+static uint8_t camera_profile_next   = 0;					// Profile of the next capture
+static uint8_t camera_profile_active = CAMERA_PROFILE_NONE;	// Profile the camera is set to
+static uint32_t camera_t0, camera_t1;	// Capture start and capture done ticks
+
+// Marker scan and DC fingerprint of the image being read
+static Jpeg_Scan camera_jpeg;
+static Jpeg_Dc camera_dc;
+
+// Fingerprints of the last kept images, duplicates are not added
+static uint64_t camera_hash[CAMERA_HASH_HISTORY];
+static uint8_t camera_hash_count = 0;
+static uint8_t camera_hash_next  = 0;
+static uint8_t camera_dup_run    = 0;	// Duplicates in a row
+static uint8_t camera_dup        = 0;	// Last image is a duplicate
 
 /******************** CAMERA APPLICATION FUNCTIONS START *********************/
 
@@ -34,41 +120,298 @@ char imagedata[] = {0x56, 0x00, 0x32, 0x0C, 0x00, 0x0A, 0x00, 0x00,
 /*****************************************************************************/
 char api_camera_connect(void){
 
+	uint8_t retry;
+
 	LOG_BOX("\r\nBeginning camera capture image sequence.\r\n");
 
+	if( api_camera_setup() ){
+		return FAIL;
+	}
+
+	// Capture again while the scanner rejects the image
+	for(retry = 0; ; retry++){
+
+		camera_t0 = HAL_GetTick();
+
+		if( api_camera_imageget() ){
+			return FAIL;
+		}
+
+		camera_t1 = HAL_GetTick();
+
+		if( api_camera_imagelen() ){
+			return FAIL;
+		}
+
+		if( api_camera_imagedata() == PASS ){
+			break;
+		}
+
+		if(camera_jpeg.error == JPEG_OK || retry >= CAMERA_RETRY_MAX){
+			return FAIL;
+		}
+
+		LOG("\r\nERROR: Corrupt image, capturing again.\r\n");
+
+		if( api_camera_stopcap() ){	// Resume frame updates
+			return FAIL;
+		}
+	}
+
+	api_camera_hashcheck();
+	api_camera_statsadd();
+
 	if( api_camera_stopcap() ){
 		return FAIL;
 	}
 
-	if( api_camera_imageres() ){
+	LOG_BOX("\r\nSUCCESS: Camera image captured successfully.\r\n");
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_motioncapture
+ *  @brief        : Arms the camera motion detection, waits for motion in
+ *  				Stop 1 and runs the capture sequence once it is seen.
+ *  @param        : longest wait in ms, a capture is made anyway after it
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+char api_camera_motioncapture(uint32_t timeout){
+
+	LOG_BOX("\r\nWaiting for camera motion.\r\n");
+
+	if( api_camera_baudnegotiate() ){
+		return FAIL;
+	}
+
+	if( api_camera_motionarm(1) ){
 		return FAIL;
 	}
 
-	if( api_camera_imagecomp() ){
+	if( api_camera_motionwait(timeout) ){
+		LOG("\r\nNo motion, capturing anyway.\r\n");
+	}
+
+	// Alarms during the readout would break the chunk framing
+	if( api_camera_motionarm(0) ){
+		return FAIL;
+	}
+
+	return api_camera_connect();
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_upload
+ *  @brief        : Captures an image and POSTs it to path while it is read.
+ *  				Each camera chunk goes out through the client transport
+ *  				while the camera sends the next one, the image is never
+ *  				held whole. While the scene repeats the image is read
+ *  				into camera_buff and fingerprinted first, and a duplicate
+ *  				is not sent.
+ *  @param        : HTTP client (set up with http_init), request path
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+char api_camera_upload(Http_Client *http, const char *path){
+
+	uint32_t pos = 0;
+	uint8_t status;
+	uint8_t buffered;
+
+	LOG_BOX("\r\nBeginning camera capture and upload sequence.\r\n");
+
+	if( api_camera_setup() ){
 		return FAIL;
 	}
 
+	camera_t0 = HAL_GetTick();
+
 	if( api_camera_imageget() ){
 		return FAIL;
 	}
 
+	camera_t1 = HAL_GetTick();
+
 	if( api_camera_imagelen() ){
 		return FAIL;
 	}
 
-	if( api_camera_imagedata() ){
+	// A streamed image is sent before its fingerprint is known, so after a
+	// duplicate the next one is read and checked first
+	buffered = (camera_dup && camera_read.length <= CAMERA_BUFF_MAX) ? 1 : 0;
+
+	if(buffered){
+
+		api_camera_sinkset(NULL, NULL, 0);	// Into camera_buff
+
+		if( api_camera_imagedata() ){
+			api_camera_stopcap();	// Resume frame updates
+			return FAIL;
+		}
+
+		api_camera_hashcheck();
+
+		if(camera_dup){
+			LOG("\r\nDuplicate image, upload skipped.\r\n");
+			api_camera_statsadd();
+			return api_camera_stopcap();
+		}
+
+		status = http_post(http, path, CAMERA_UPLOAD_TYPE, camera_read.length, api_camera_buffbody, &pos);
+
+	}else{
+
+		// The first chunk is read while the connection and request head are set up
+		api_camera_pipestart();
+		status = http_post(http, path, CAMERA_UPLOAD_TYPE, camera_read.length, api_camera_pipebody, &camera_pipe);
+		api_camera_pipestop();
+
+		if(camera_pipe.error){
+			status = FAIL;
+		}
+	}
+
+	if(status){
+		LOG("\r\nERROR: Image upload failed.\r\n");
+		api_camera_stopcap();	// Resume frame updates
 		return FAIL;
 	}
 
+	if(!buffered){
+		api_camera_hashcheck();
+	}
+	api_camera_statsadd();
+
 	if( api_camera_stopcap() ){
 		return FAIL;
 	}
 
-	LOG_BOX("\r\nSUCCESS: Camera image captured successfully.\r\n");
+	LOG_BOX("\r\nSUCCESS: Camera image uploaded successfully.\r\n");
 
 	return PASS;
 }
 
+/*****************************************************************************/
+/*! @Function Name: api_camera_task
+ *  @brief        : Scheduler task version of api_camera_connect. Yields
+ *  				while the camera answers so other ports can run.
+ *  @return       : RR_RUNNING, RR_DONE or RR_FAILED
+ */
+/*****************************************************************************/
+char api_camera_task(Rr_Task *task){
+
+	RR_BEGIN(task);
+
+	LOG_BOX("\r\nBeginning camera capture image sequence.\r\n");
+
+	// Only blocks for the probe exchanges, fast when the link is up
+	if( api_camera_baudnegotiate() ){
+		RR_EXIT(task);
+	}
+
+	RR_CMD(task, stopcap, 5, Resp_CAM_Stopcap, 1, RR_CMD_TIMEOUT);
+	if(task->hit){
+		RR_EXIT(task);
+	}
+
+	// Settings are only sent when the profile changed
+	if(camera_profile_active != camera_profile_next){
+
+		api_camera_profileload();
+
+		RR_CMD(task, imageres, 5, Resp_CAM_Resolution, 1, RR_CMD_TIMEOUT);
+		if(task->hit){
+			RR_EXIT(task);
+		}
+
+		RR_CMD(task, imagecomp, 9, Resp_CAM_Compress, 1, RR_CMD_TIMEOUT);
+		if(task->hit){
+			RR_EXIT(task);
+		}
+
+		RR_CMD(task, imagecolor, 6, Resp_CAM_Color, 1, RR_CMD_TIMEOUT);
+		if(task->hit){
+			RR_EXIT(task);
+		}
+
+		camera_profile_active = camera_profile_next;
+	}
+
+	// Capture again while the scanner rejects the image
+	task->step = 0;
+	while(1){
+
+		camera_t0 = HAL_GetTick();
+
+		RR_CMD(task, imageget, 5, Resp_CAM_Imageget, 1, RR_CMD_TIMEOUT);
+		if(task->hit){
+			RR_EXIT(task);
+		}
+
+		camera_t1 = HAL_GetTick();
+
+		RR_CMD(task, imagelen, 5, Resp_CAM_Length, 1, RR_CMD_TIMEOUT);
+		if(task->hit){
+			RR_EXIT(task);
+		}
+
+		api_camera_lenparse();
+
+		// Read the image chunk by chunk, each reply goes to the sink
+		while(camera_read.offset < camera_read.length){
+
+			api_camera_readstart();
+			uart_tx(task->port, imagedata, 16);
+
+			RR_WAIT_COUNT(task, camera_read.size + 2 * CAMERA_READ_FRAME, CAMERA_CHUNK_TIMEOUT);
+			if(task->hit){
+				LOG("\r\nERROR: No response.\r\n");
+				if( api_camera_baudlower() ){
+					RR_EXIT(task);
+				}
+				continue;	// Read the chunk again at the lower rate
+			}
+
+			if( api_camera_readdone() ){
+				if(camera_jpeg.error == JPEG_OK){
+					LOG("\r\nERROR: Bad image chunk.\r\n");
+					RR_EXIT(task);
+				}
+				break;	// Corrupt image, no more chunks go to the sink
+			}
+		}
+
+		if( api_camera_jpegcheck() == PASS ){
+			break;
+		}
+
+		if(++task->step > CAMERA_RETRY_MAX){
+			RR_EXIT(task);
+		}
+
+		LOG("\r\nERROR: Corrupt image, capturing again.\r\n");
+
+		RR_CMD(task, stopcap, 5, Resp_CAM_Stopcap, 1, RR_CMD_TIMEOUT);	// Resume frame updates
+		if(task->hit){
+			RR_EXIT(task);
+		}
+	}
+
+	api_camera_hashcheck();
+	api_camera_statsadd();
+
+	RR_CMD(task, stopcap, 5, Resp_CAM_Stopcap, 1, RR_CMD_TIMEOUT);
+	if(task->hit){
+		RR_EXIT(task);
+	}
+
+	LOG_BOX("\r\nSUCCESS: Camera image captured successfully.\r\n");
+
+	RR_END(task);
+}
+
 
 /******************** CAMERA APPLICATION FUNCTIONS END ***********************/
 
@@ -84,14 +427,14 @@ char api_camera_connect(void){
 char api_camera_stopcap(void){
 
 	LOG_BOX("SEND: camera stop capture");
-	uart_tx(stopcap, 5, CAMERA_UART);
+	uart_tx(&uart_camera, stopcap, 5);
 
-	if( uart_rx_check(Resp_CAM_STOPCAP, 5, UART_1S_TIMEOUT) ){
+	if( uart_rx_check(&uart_camera, Resp_CAM_STOPCAP, 5, UART_1S_TIMEOUT) ){
 		LOG("ERROR: Bad response");
-		uart_rx_print();
+		uart_rx_print(&uart_camera);
 		return FAIL;
 	}else{
-		uart_rx_print();
+		uart_rx_print(&uart_camera);
 		return PASS;
 	}
 
@@ -100,21 +443,22 @@ char api_camera_stopcap(void){
 
 /*****************************************************************************/
 /*! @Function Name: api_camera_imageres
- *  @brief        : Set resolution of USART camera module.
+ *  @brief        : Set resolution of USART camera module to the value loaded
+ *  				from the capture profile.
  *  @return       : pass or fail
  */
 /*****************************************************************************/
 char api_camera_imageres(void){
 
-	LOG_BOX("SEND: camera image resolution to 160x120");
-	uart_tx(imageres, 5, CAMERA_UART);
+	LOG_BOX("SEND: camera image resolution");
+	uart_tx(&uart_camera, imageres, 5);
 
-	if( uart_rx_check(Resp_CAM_RESOLUTION, 5, UART_1S_TIMEOUT) ){
+	if( uart_rx_check(&uart_camera, Resp_CAM_RESOLUTION, 5, UART_1S_TIMEOUT) ){
 		LOG("ERROR: Bad response");
-		uart_rx_print();
+		uart_rx_print(&uart_camera);
 		return FAIL;
 	}else{
-		uart_rx_print();
+		uart_rx_print(&uart_camera);
 		return PASS;
 	}
 
@@ -123,27 +467,113 @@ char api_camera_imageres(void){
 
 /*****************************************************************************/
 /*! @Function Name: api_camera_imagecomp
- *  @brief        : Set compression ratio of USART camera module.
+ *  @brief        : Set compression ratio of USART camera module to the value
+ *  				loaded from the capture profile.
  *  @return       : pass or fail
  */
 /*****************************************************************************/
 char api_camera_imagecomp(void){
 
-	LOG_BOX("SEND: camera image compression ratio to 99");
-	uart_tx(imagecomp, 9, CAMERA_UART);
+	LOG_BOX("SEND: camera image compression ratio");
+	uart_tx(&uart_camera, imagecomp, 9);
 
-	if( uart_rx_check(Resp_CAM_COMPRESS, 5, UART_1S_TIMEOUT) ){
+	if( uart_rx_check(&uart_camera, Resp_CAM_COMPRESS, 5, UART_1S_TIMEOUT) ){
 		LOG("ERROR: Bad response");
-		uart_rx_print();
+		uart_rx_print(&uart_camera);
 		return FAIL;
 	}else{
-		uart_rx_print();
+		uart_rx_print(&uart_camera);
 		return PASS;
 	}
 
 	return FAIL; // Out of bounds
 }
 
+/*****************************************************************************/
+/*! @Function Name: api_camera_imagecolor
+ *  @brief        : Set color mode (auto, color, black/white) of USART camera
+ *  				module to the value loaded from the capture profile.
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+char api_camera_imagecolor(void){
+
+	LOG_BOX("SEND: camera color mode");
+	uart_tx(&uart_camera, imagecolor, 6);
+
+	if( uart_rx_check(&uart_camera, Resp_CAM_COLOR, 5, UART_1S_TIMEOUT) ){
+		LOG("ERROR: Bad response");
+		uart_rx_print(&uart_camera);
+		return FAIL;
+	}
+
+	uart_rx_print(&uart_camera);
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_motionarm
+ *  @brief        : Turns motion detection of USART camera module on (alarm
+ *  				sent over UART) or off.
+ *  @param        : 1 to arm, 0 to disarm
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+char api_camera_motionarm(uint8_t enable){
+
+	if(enable){
+
+		LOG_BOX("SEND: camera motion control");
+		uart_tx(&uart_camera, motionctrl, 7);
+
+		if( uart_rx_check(&uart_camera, Resp_CAM_MOTIONCTRL, 5, UART_1S_TIMEOUT) ){
+			LOG("ERROR: Bad response");
+			uart_rx_print(&uart_camera);
+			return FAIL;
+		}
+
+		uart_rx_print(&uart_camera);
+	}
+
+	LOG_BOX(enable ? "SEND: camera motion on" : "SEND: camera motion off");
+	uart_tx(&uart_camera, enable ? motionon : motionoff, 5);
+
+	if( uart_rx_check(&uart_camera, Resp_CAM_MOTIONSET, 5, UART_1S_TIMEOUT) ){
+		LOG("ERROR: Bad response");
+		uart_rx_print(&uart_camera);
+		return FAIL;
+	}
+
+	uart_rx_print(&uart_camera);
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_motionwait
+ *  @brief        : Sleeps in Stop 1 until the camera reports motion. USART3
+ *  				wakes the core on the first byte of the alarm.
+ *  @param        : timeout in ms
+ *  @return       : pass on motion, fail on timeout
+ */
+/*****************************************************************************/
+char api_camera_motionwait(uint32_t timeout){
+
+	char Status;
+
+	uart_rx_flush(&uart_camera);
+	uart_rx_match(&uart_camera, Resp_CAM_Motion, 1);
+
+	uart_wake(&uart_camera, 1);
+	Status = power_stop_wait(&uart_camera.match_hit, UART_NO_MATCH, timeout);
+	uart_wake(&uart_camera, 0);
+
+	if(Status == PASS){
+		LOG("\r\nMotion detected.\r\n");
+	}
+
+	return Status;
+}
+
 /*****************************************************************************/
 /*! @Function Name: api_camera_imageget
  *  @brief        : Get image command of USART camera module. The CM_ImageGet
@@ -155,14 +585,14 @@ char api_camera_imagecomp(void){
 char api_camera_imageget(void){
 
 	LOG_BOX("SEND: camera image get");
-	uart_tx(imageget, 5, CAMERA_UART);
+	uart_tx(&uart_camera, imageget, 5);
 
-	if( uart_rx_check(Resp_CAM_IMAGEGET, 5, UART_1S_TIMEOUT) ){
+	if( uart_rx_check(&uart_camera, Resp_CAM_IMAGEGET, 5, UART_1S_TIMEOUT) ){
 		LOG("ERROR: Bad response");
-		uart_rx_print();
+		uart_rx_print(&uart_camera);
 		return FAIL;
 	}else{
-		uart_rx_print();
+		uart_rx_print(&uart_camera);
 		return PASS;
 	}
 
@@ -179,58 +609,666 @@ char api_camera_imageget(void){
 /*****************************************************************************/
 char api_camera_imagelen(void){
 
-	uint16_t i = 0;
-
 	LOG_BOX("SEND: camera image length");
-	uart_tx(imagelen, 5, CAMERA_UART);
+	uart_tx(&uart_camera, imagelen, 5);
 
-	if( uart_rx_check(Resp_CAM_LENGTH, 7, UART_1S_TIMEOUT) ){
+	if( uart_rx_check(&uart_camera, Resp_CAM_LENGTH, 7, UART_1S_TIMEOUT) ){
 		LOG("\r\nERROR: Bad response.\r\n");
-		uart_rx_print();
+		uart_rx_print(&uart_camera);
 		return FAIL;
 	}
 
-	i = uart_rx_find(Resp_CAM_LENGTH, 7);
-	imagedata[12] = rx_buff[i];
-	imagedata[13] = rx_buff[i+1];
+	api_camera_lenparse();
 
 	LOG("\r\nSuccess: image length \r\n");
-	uart_rx_print();
+	uart_rx_print(&uart_camera);
 
 	return PASS;
 }
 
 /*****************************************************************************/
 /*! @Function Name: api_camera_imagedata
- *  @brief        : Read image data command of USART camera module. This command
- *  				stores image data into camera_buff.
+ *  @brief        : Read image data command of USART camera module. The image
+ *  				is read in chunks of camera_read.chunk bytes and each
+ *  				chunk is passed to the sink (camera_buff by default).
  *  @return       : pass or fail
  */
 /*****************************************************************************/
 char api_camera_imagedata(void){
 
-	uint16_t camera_idx = 0, i = 0, offset = 0;
-
 	LOG_BOX("SEND: camera image data");
-	uart_tx(imagedata, 16, CAMERA_UART);
 
-	if( uart_rx_check(Resp_CAM_DATAEND, 7, 3 * UART_1S_TIMEOUT) ){
-		LOG("\r\nERROR: Bad response.\r\n");
-		uart_rx_print();
+	while(camera_read.offset < camera_read.length){
+
+		api_camera_chunkstart();
+
+		if( api_camera_chunkwait() ){
+			return FAIL;
+		}
+
+		if( api_camera_readdone() ){
+			LOG("\r\nERROR: Bad image chunk.\r\n");
+			return FAIL;
+		}
+	}
+
+	if( api_camera_jpegcheck() ){
 		return FAIL;
 	}
 
-	offset = uart_rx_find(Resp_CAM_DATASTART, 2) - 2;
-	i = offset;
+	LOG("\r\nSuccess: image data \r\n");
 
-	while( i < rx_idx - offset){
-		camera_buff[camera_idx] = rx_buff[i];
-		camera_idx++;
-		i++;
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_sinkset
+ *  @brief        : Sets where image chunks go and the chunk size. Chunks are
+ *  				rounded down to a multiple of 8 bytes and limited to
+ *  				CAMERA_CHUNK_MAX.
+ *  @param        : sink (NULL for camera_buff), sink context, chunk size (0
+ *  				for CAMERA_CHUNK_DEFAULT)
+ */
+/*****************************************************************************/
+void api_camera_sinkset(Camera_Sink sink, void *ctx, uint16_t chunk){
+
+	if(chunk == 0){
+		chunk = CAMERA_CHUNK_DEFAULT;
+	}
+
+	if(chunk > CAMERA_CHUNK_MAX){
+		chunk = CAMERA_CHUNK_MAX;
+	}
+
+	camera_read.chunk = chunk & ~0x07;
+	camera_read.sink  = sink ? sink : api_camera_buffsink;
+	camera_read.ctx   = sink ? ctx : NULL;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_baudnegotiate
+ *  @brief        : Finds the current camera link speed and moves the camera
+ *  				and USART3 to the fastest rate that still answers.
+ *  @return       : pass or fail (camera does not answer at any rate)
+ */
+/*****************************************************************************/
+char api_camera_baudnegotiate(void){
+
+	uint8_t target;
+
+	for(target = 0; target < CAMERA_BAUD_COUNT; target++){
+
+		if( api_camera_baudprobe() ){
+			LOG("\r\nERROR: Camera does not answer at any baud rate.\r\n");
+			return FAIL;
+		}
+
+		if(camera_baud_idx <= target){
+			return PASS;	// Already at the fastest rate left to try
+		}
+
+		if( api_camera_baudset(target) == PASS ){
+			return PASS;
+		}
+
+		// No answer at target, probe finds the link again and the next rate is tried
+	}
+
+	return FAIL;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_baudlower
+ *  @brief        : Fallback after a failed transfer. Finds the link again and
+ *  				drops the camera and USART3 one rate lower.
+ *  @return       : pass or fail (no lower rate or no answer)
+ */
+/*****************************************************************************/
+char api_camera_baudlower(void){
+
+	uint8_t idx;
+
+	if( api_camera_baudprobe() ){
+		return FAIL;
+	}
+
+	for(idx = camera_baud_idx + 1; idx < CAMERA_BAUD_COUNT; idx++){
+
+		if( api_camera_baudset(idx) == PASS ){
+			return PASS;
+		}
+
+		if( api_camera_baudprobe() ){
+			return FAIL;
+		}
+	}
+
+	return FAIL;
+}
+/*****************************************************************************/
+/*! @Function Name: api_camera_profileset
+ *  @brief        : Selects the capture profile of the next captures. The
+ *  				settings are sent with the next capture, and only if they
+ *  				differ from the profile the camera is set to.
+ *  @param        : profile index (CAMERA_PROFILE_COUNT max)
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+char api_camera_profileset(uint8_t profile){
+
+	if(profile >= CAMERA_PROFILE_COUNT){
+		return FAIL;
 	}
 
-	uart_rx_print();
+	camera_profile_next = profile;
 
 	return PASS;
 }
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_profilestats
+ *  @brief        : Capture and transfer timing of a profile.
+ *  @param        : profile index
+ *  @return       : statistics or NULL
+ */
+/*****************************************************************************/
+const Camera_Stats* api_camera_profilestats(uint8_t profile){
+
+	if(profile >= CAMERA_PROFILE_COUNT){
+		return NULL;
+	}
+
+	return &camera_stats[profile];
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_duplicate
+ *  @brief        : Tells if the last image shows the same scene as one of
+ *  				the recently kept images. api_camera_upload then checks
+ *  				the next image before sending it.
+ *  @return       : 1 for a near duplicate, else 0
+ */
+/*****************************************************************************/
+uint8_t api_camera_duplicate(void){
+
+	return camera_dup;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_jpeg
+ *  @brief        : Marker scan of the last image, holds the marker index and
+ *  				frame dimensions.
+ *  @return       : scanner state
+ */
+/*****************************************************************************/
+const Jpeg_Scan* api_camera_jpeg(void){
+
+	return &camera_jpeg;
+}
+
 /******************** CAMERA API END *****************************************/
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_lenparse
+ *  @brief        : Reads the image length of the image length response and
+ *  				restarts the chunked readout.
+ */
+/*****************************************************************************/
+static void api_camera_lenparse(void){
+
+	uint16_t i = 0;
+
+	i = uart_rx_find(&uart_camera, Resp_CAM_LENGTH, 7);
+	imagedata[12] = uart_camera.rx_buff[i];
+	imagedata[13] = uart_camera.rx_buff[i+1];
+
+	camera_read.length = ((uint8_t)imagedata[12] << 8) | (uint8_t)imagedata[13];
+	camera_read.offset = 0;
+
+	jpeg_init(&camera_jpeg, &camera_dc);
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_readstart
+ *  @brief        : Writes the address and length of the next chunk into the
+ *  				image data command.
+ *  @return       : chunk size, 0 when the image is complete
+ */
+/*****************************************************************************/
+static uint16_t api_camera_readstart(void){
+
+	uint32_t left = camera_read.length - camera_read.offset;
+
+	camera_read.size = (left > camera_read.chunk) ? camera_read.chunk : left;
+
+	// Big endian start address (bytes 6-9) and data length (bytes 10-13)
+	imagedata[6]  = camera_read.offset >> 24;
+	imagedata[7]  = camera_read.offset >> 16;
+	imagedata[8]  = camera_read.offset >> 8;
+	imagedata[9]  = camera_read.offset;
+	imagedata[10] = 0;
+	imagedata[11] = 0;
+	imagedata[12] = camera_read.size >> 8;
+	imagedata[13] = camera_read.size;
+
+	return camera_read.size;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_readdone
+ *  @brief        : Checks the reply framing of the running chunk, passes the
+ *  				data to the sink and moves to the next chunk.
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+static char api_camera_readdone(void){
+
+	char *reply = uart_camera.rx_buff;
+
+	// 76 00 32 00 00 <data> 76 00 32 00 00
+	if( memcmp(reply, Resp_CAM_READ, CAMERA_READ_FRAME) ||
+		memcmp(reply + CAMERA_READ_FRAME + camera_read.size, Resp_CAM_READ, CAMERA_READ_FRAME) ){
+		return FAIL;
+	}
+
+	// Corrupt data is caught here, before it reaches the sink
+	if( jpeg_feed(&camera_jpeg, (const uint8_t*)reply + CAMERA_READ_FRAME, camera_read.size) ){
+		return FAIL;
+	}
+
+	if( camera_read.sink(camera_read.ctx, camera_read.offset, reply + CAMERA_READ_FRAME, camera_read.size) ){
+		return FAIL;
+	}
+
+	camera_read.offset += camera_read.size;
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_buffsink
+ *  @brief        : Default sink, stores the image in camera_buff.
+ *  @return       : pass or fail (image larger than camera_buff)
+ */
+/*****************************************************************************/
+static char api_camera_buffsink(void *ctx, uint32_t offset, const char *data, uint16_t size){
+
+	if(offset + size > CAMERA_BUFF_MAX){
+		return FAIL;
+	}
+
+	memcpy(&camera_buff[offset], data, size);
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_setup
+ *  @brief        : Brings the camera link up and sends the profile settings
+ *  				when the profile changed, before a capture.
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+static char api_camera_setup(void){
+
+	if( api_camera_baudnegotiate() ){
+		return FAIL;
+	}
+
+	if( api_camera_stopcap() ){
+		return FAIL;
+	}
+
+	// Settings are only sent when the profile changed
+	if(camera_profile_active != camera_profile_next){
+
+		api_camera_profileload();
+
+		if( api_camera_imageres() ){
+			return FAIL;
+		}
+
+		if( api_camera_imagecomp() ){
+			return FAIL;
+		}
+
+		if( api_camera_imagecolor() ){
+			return FAIL;
+		}
+
+		camera_profile_active = camera_profile_next;
+	}
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_chunkstart
+ *  @brief        : Sends the read command of the next chunk. The reply is
+ *  				taken by DMA, the caller is free until api_camera_chunkwait.
+ */
+/*****************************************************************************/
+static void api_camera_chunkstart(void){
+
+	api_camera_readstart();
+	uart_tx(&uart_camera, imagedata, 16);
+	uart_rx_count(&uart_camera, camera_read.size + 2 * CAMERA_READ_FRAME);
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_chunkwait
+ *  @brief        : Waits for the reply of the running chunk read. Without
+ *  				one the link drops one rate and the chunk is read again.
+ *  @return       : pass or fail (no lower rate answers)
+ */
+/*****************************************************************************/
+static char api_camera_chunkwait(void){
+
+	while( power_wait(&uart_camera.match_hit, UART_NO_MATCH, CAMERA_CHUNK_TIMEOUT) ){
+
+		LOG("\r\nERROR: No response.\r\n");
+
+		if( api_camera_baudlower() ){
+			return FAIL;
+		}
+
+		api_camera_chunkstart();	// Read the chunk again at the lower rate
+	}
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_pipestart
+ *  @brief        : Pipeline mode for the image api_camera_imagelen found.
+ *  				Chunks go to the pipeline buffer, the first read starts.
+ */
+/*****************************************************************************/
+static void api_camera_pipestart(void){
+
+	camera_pipe.fill  = 0;
+	camera_pipe.pos   = 0;
+	camera_pipe.error = 0;
+
+	api_camera_sinkset(api_camera_pipesink, &camera_pipe, CAMERA_PIPE_CHUNK);
+
+	if(camera_read.length){
+		api_camera_chunkstart();
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_pipestop
+ *  @brief        : Ends pipeline mode, images go to camera_buff again.
+ */
+/*****************************************************************************/
+static void api_camera_pipestop(void){
+
+	api_camera_sinkset(NULL, NULL, 0);
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_pipesink
+ *  @brief        : Pipeline sink, copies the chunk out of the camera receive
+ *  				buffer so the next read can reuse it.
+ *  @return       : pass or fail (chunk larger than the buffer)
+ */
+/*****************************************************************************/
+static char api_camera_pipesink(void *ctx, uint32_t offset, const char *data, uint16_t size){
+
+	Camera_Pipe *pipe = ctx;
+
+	if(size > CAMERA_PIPE_CHUNK){
+		return FAIL;
+	}
+
+	memcpy(pipe->buff, data, size);
+	pipe->fill = size;
+	pipe->pos  = 0;
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_pipebody
+ *  @brief        : HTTP body producer of the pipeline. Once the chunk in the
+ *  				buffer is taken, the next one is collected from the
+ *  				camera and the read after it started, so the camera
+ *  				sends chunk N+1 while the module sends chunk N. The last
+ *  				chunk is only sent once the whole image passed
+ *  				api_camera_jpegcheck.
+ *  @return       : bytes copied, 0 at the end or when a read failed
+ */
+/*****************************************************************************/
+static uint16_t api_camera_pipebody(void *ctx, uint8_t *buff, uint16_t size){
+
+	Camera_Pipe *pipe = ctx;
+	uint16_t n;
+
+	if(pipe->pos == pipe->fill){
+
+		if(pipe->error || camera_read.offset >= camera_read.length){
+			return 0;
+		}
+
+		// A short body makes http_post fail, the server never sees a bad image
+		if( api_camera_chunkwait() || api_camera_readdone() ){
+			LOG("\r\nERROR: Bad image chunk.\r\n");
+			pipe->error = 1;
+			return 0;
+		}
+
+		if(camera_read.offset < camera_read.length){
+			api_camera_chunkstart();
+		}else if( api_camera_jpegcheck() ){	// Last chunk is held until the image checks out
+			pipe->error = 1;
+			return 0;
+		}
+	}
+
+	n = pipe->fill - pipe->pos;
+	if(n > size){
+		n = size;
+	}
+
+	memcpy(buff, &pipe->buff[pipe->pos], n);
+	pipe->pos += n;
+
+	return n;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_buffbody
+ *  @brief        : HTTP body producer of an image read into camera_buff.
+ *  @return       : bytes copied, 0 at the end
+ */
+/*****************************************************************************/
+static uint16_t api_camera_buffbody(void *ctx, uint8_t *buff, uint16_t size){
+
+	uint32_t *pos = ctx;
+	uint32_t n = camera_read.length - *pos;
+
+	if(n > size){
+		n = size;
+	}
+
+	memcpy(buff, &camera_buff[*pos], n);
+	*pos += n;
+
+	return n;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_baudprobe
+ *  @brief        : Checks that the camera answers at the current USART3 rate,
+ *  				else tries every known rate until it does.
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+static char api_camera_baudprobe(void){
+
+	uint8_t i, idx;
+
+	for(i = 0; i <= CAMERA_BAUD_COUNT; i++){
+
+		// Current rate first, then fastest to slowest
+		idx = (i == 0) ? camera_baud_idx : i - 1;
+
+		if(i > 0 && idx == camera_baud_idx){
+			continue;
+		}
+
+		if(i > 0){
+			uart_baud(&uart_camera, camera_bauds[idx].baud);
+			camera_baud_idx = idx;
+			camera_profile_active = CAMERA_PROFILE_NONE;	// Camera may have been reset
+		}
+
+		uart_tx(&uart_camera, stopcap, 5);
+
+		if( uart_rx_check(&uart_camera, Resp_CAM_STOPCAP, 5, CAMERA_PROBE_TIMEOUT) == PASS ){
+			return PASS;
+		}
+	}
+
+	return FAIL;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_baudset
+ *  @brief        : Moves the camera and USART3 to camera_bauds[idx]. The
+ *  				command is answered at the old rate, the link is then
+ *  				checked at the new one.
+ *  @return       : pass or fail (link did not come up at the new rate)
+ */
+/*****************************************************************************/
+static char api_camera_baudset(uint8_t idx){
+
+	imagebaud[5] = camera_bauds[idx].code[0];
+	imagebaud[6] = camera_bauds[idx].code[1];
+
+	LOG_BOX("SEND: camera baud rate change");
+	uart_tx(&uart_camera, imagebaud, 7);
+
+	if( uart_rx_check(&uart_camera, Resp_CAM_BAUD, 5, CAMERA_PROBE_TIMEOUT) ){
+		return FAIL;
+	}
+
+	uart_baud(&uart_camera, camera_bauds[idx].baud);
+	camera_baud_idx = idx;
+
+	power_sleep(UART_DELAY);	// Camera switches after its reply
+
+	uart_tx(&uart_camera, stopcap, 5);
+
+	return uart_rx_check(&uart_camera, Resp_CAM_STOPCAP, 5, CAMERA_PROBE_TIMEOUT);
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_profileload
+ *  @brief        : Patches the settings commands with the next profile.
+ */
+/*****************************************************************************/
+static void api_camera_profileload(void){
+
+	const Camera_Profile *profile = &camera_profiles[camera_profile_next];
+
+	LOG("\r\nCamera profile: ");
+	LOG((char*)profile->name);
+	LOG("\r\n");
+
+	imageres[4]   = profile->resolution;
+	imagecomp[8]  = profile->compression;
+	imagecolor[5] = profile->color;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_statsadd
+ *  @brief        : Adds the timing of the finished capture to the active
+ *  				profile statistics.
+ */
+/*****************************************************************************/
+static void api_camera_statsadd(void){
+
+	Camera_Stats *stats;
+
+	if(camera_profile_active >= CAMERA_PROFILE_COUNT){
+		return;
+	}
+
+	stats = &camera_stats[camera_profile_active];
+
+	stats->capture_ms   = camera_t1 - camera_t0;
+	stats->transfer_ms  = HAL_GetTick() - camera_t1;
+	stats->bytes        = camera_read.length;
+	stats->total_ms    += stats->capture_ms + stats->transfer_ms;
+	stats->count++;
+
+	if(camera_dup){
+		stats->duplicates++;
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_jpegcheck
+ *  @brief        : Checks that the image read is a complete JPEG of the
+ *  				active profile resolution.
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+static char api_camera_jpegcheck(void){
+
+	uint16_t width = 0, height = 0;
+
+	if(camera_profile_active < CAMERA_PROFILE_COUNT){
+		width  = camera_profiles[camera_profile_active].width;
+		height = camera_profiles[camera_profile_active].height;
+	}
+
+	if( jpeg_check(&camera_jpeg, width, height) ){
+		LOG("\r\nERROR: Corrupt JPEG image.\r\n");
+		return FAIL;
+	}
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_camera_hashcheck
+ *  @brief        : Compares the fingerprint of the image read with the kept
+ *  				history. Within CAMERA_HASH_DISTANCE bits of any entry it
+ *  				is a duplicate, unless CAMERA_DUP_MAX duplicates came in a
+ *  				row. Images without a fingerprint are always kept.
+ */
+/*****************************************************************************/
+static void api_camera_hashcheck(void){
+
+	uint64_t hash;
+	uint8_t i;
+
+	camera_dup = 0;
+
+	if( jpeg_dc_hash(&camera_dc, &hash) ){
+		return;
+	}
+
+	for(i = 0; i < camera_hash_count; i++){
+		if(jpeg_dc_distance(hash, camera_hash[i]) <= CAMERA_HASH_DISTANCE){
+			camera_dup = 1;
+		}
+	}
+
+	if(camera_dup && ++camera_dup_run < CAMERA_DUP_MAX){
+		LOG("\r\nDuplicate image.\r\n");
+		return;
+	}
+
+	camera_dup     = 0;
+	camera_dup_run = 0;
+
+	camera_hash[camera_hash_next] = hash;
+	camera_hash_next = (camera_hash_next + 1) % CAMERA_HASH_HISTORY;
+	if(camera_hash_count < CAMERA_HASH_HISTORY){
+		camera_hash_count++;
+	}
+}
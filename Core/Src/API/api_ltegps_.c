@@ -16,15 +16,114 @@
 #include "stdint.h"
 #include "string.h"
 #include "stdlib.h"
+#include "stddef.h"
 #include "stm32l476xx.h"
+#include "main.h"
 #include "api_ltegps.h"
+#include "at_cmd.h"
+#include "flash.h"
 #include "uart.h"
+#include "power.h"
 
 /******************** DEFINE GLOBAL VARIABLES  *******************************/
 
+LTEGPS_Struct GPS = {0};
+
+static uint8_t ltegps_cid = 0;	// CID found by api_ltegps_pdpavailable, 0 for none
+
+static char ltegps_cmd[LTEGPS_CMD_MAX];	// Built command being sent
+
+static uint8_t ltegps_sock = 0;	// Socket LTEGPS_SOCK_ID is open
+
+static Nmea_Parser ltegps_nmea;	// NMEA stream parser, fed by the RX hook
+
+static volatile uint8_t ltegps_fix = 0;	// Valid epoch fix published since the stream started
+
+static volatile uint32_t ltegps_fix_tick = 0;	// Tick of the first valid fix
+
+static Ltegps_Hint ltegps_hint SECTION_RETAINED;	// Last good fix, validated before use
+
+static uint8_t ltegps_hint_fresh = 0;	// Hint tick is from this power up
+
+static uint8_t ltegps_start = LTEGPS_START_NONE;	// Start type of the running GNSS
+
+static uint32_t ltegps_start_tick = 0;	// Tick the GNSS was started
+
+static Ltegps_Acq ltegps_acq = {	// Acquisition thresholds
+	LTEGPS_ACQ_HDOP, LTEGPS_ACQ_USED, LTEGPS_ACQ_WINDOW, LTEGPS_ACQ_SPREAD, LTEGPS_FIX_TIMEOUT
+};
+
+static Ltegps_Window ltegps_window;	// Qualifying fixes of the running acquisition
+
+static Nmea_Fix ltegps_last;	// Last valid fix of the running acquisition
+
+static uint32_t ltegps_acq_tick = 0;	// Tick the running acquisition began
+
+// cos of 0, 10 .. 90 degree latitude, Q15, shrinks longitude to distance
+static const uint16_t ltegps_cos[10] = {
+	32768, 32270, 30792, 28378, 25102, 21063, 16384, 11207, 5690, 0
+};
+
+// Socket of the module as a byte stream for the upload clients
+const Transport ltegps_transport = {
+	api_ltegps_sockopen,
+	api_ltegps_socksend,
+	api_ltegps_sockrecv,
+	api_ltegps_sockclose,
+};
+
+// Final result codes of an AT command, OK first
+static const Uart_Pattern Resp_LTEGPS_Final[] = {
+	{ Resp_LTEGPS_OK,       sizeof(Resp_LTEGPS_OK) - 1 },
+	{ Resp_LTEGPS_ERROR,    sizeof(Resp_LTEGPS_ERROR) - 1 },
+	{ Resp_LTEGPS_CMEERROR, sizeof(Resp_LTEGPS_CMEERROR) - 1 },
+};
+
+// Ping reply or failure
+static const Uart_Pattern Resp_LTEGPS_PingFinal[] = {
+	{ Resp_LTEGPS_Ping,     sizeof(Resp_LTEGPS_Ping) - 1 },
+	{ Resp_LTEGPS_ERROR,    sizeof(Resp_LTEGPS_ERROR) - 1 },
+	{ Resp_LTEGPS_CMEERROR, sizeof(Resp_LTEGPS_CMEERROR) - 1 },
+};
+
+// Socket data header or failure
+static const Uart_Pattern Resp_LTEGPS_RecvStart[] = {
+	{ Resp_LTEGPS_Recv,     sizeof(Resp_LTEGPS_Recv) - 1 },
+	{ Resp_LTEGPS_ERROR,    sizeof(Resp_LTEGPS_ERROR) - 1 },
+	{ Resp_LTEGPS_CMEERROR, sizeof(Resp_LTEGPS_CMEERROR) - 1 },
+};
+
+// Send prompt or failure
+static const Uart_Pattern Resp_LTEGPS_SendStart[] = {
+	{ Resp_LTEGPS_Prompt,   sizeof(Resp_LTEGPS_Prompt) - 1 },
+	{ Resp_LTEGPS_ERROR,    sizeof(Resp_LTEGPS_ERROR) - 1 },
+	{ Resp_LTEGPS_CMEERROR, sizeof(Resp_LTEGPS_CMEERROR) - 1 },
+};
+
+#define LTEGPS_FINAL_COUNT (sizeof(Resp_LTEGPS_Final) / sizeof(Resp_LTEGPS_Final[0]))
 
 /******************** FUNCTION DECLARATION************************************/
 
+static char api_ltegps_final(uint16_t test_cnt);
+static uint16_t api_ltegps_sockwaiting(void);
+static char api_ltegps_provquery(char *cmd, char *want);
+static uint32_t api_ltegps_provdigest(void);
+static uint32_t api_ltegps_provsum(const Lte_Prov *prov);
+static uint8_t api_ltegps_provload(void);
+static void api_ltegps_provsave(void);
+static void api_ltegps_nmeastart(void);
+static uint8_t api_ltegps_restartcmd(void);
+static uint8_t api_ltegps_acqstep(void);
+static uint8_t api_ltegps_acqtake(const Nmea_Fix *fix);
+static uint8_t api_ltegps_acqdone(uint8_t state);
+static void api_ltegps_fixcopy(const Nmea_Fix *fix);
+static uint64_t api_ltegps_dist2(int32_t lat1, int32_t lon1, int32_t lat2, int32_t lon2);
+static uint32_t api_ltegps_hintsum(const Ltegps_Hint *hint);
+static uint8_t api_ltegps_hintvalid(void);
+static void api_ltegps_hintsave(void);
+static uint32_t api_ltegps_diff(int32_t a, int32_t b);
+static void api_ltegps_nmeahook(void *ctx, const char *data, uint16_t size);
+
 
 /******************** LTEGPS APPLICATION FUNCTIONS START *********************/
 
@@ -40,41 +139,80 @@ char api_ltegps_lteconnect(void){
 
 	LOG_BOX("\r\nBeginning LTE connection sequence.\r\n");
 
-	HAL_Delay(20);
-	if( api_ltegps_fwswitch() ){
-		//return FAIL;
+	// Provisioned before with these settings, only attach
+	if( api_ltegps_provload() == PASS ){
+
+		LOG("LTE: Provisioning cached, attaching.\r\n");
+
+		power_sleep(UART_DELAY);
+		if( api_ltegps_signalquality() ){
+			return FAIL;
+		}
+
+		power_sleep(UART_DELAY);
+		if( api_ltegps_pdpactivate() == PASS ){
+			LOG_BOX("\r\nSUCCESS: LTE connection successful.\r\n");
+			return PASS;
+		}
+
+		// May only be coverage, the record is kept and the checks below
+		// rewrite it when the settings really changed
+		LOG("LTE: Cached provisioning rejected, checking settings.\r\n");
+		ltegps_cid = 0;
 	}
 
-	HAL_Delay(20);
-	if( api_ltegps_signalquality() ){
+	// Switching the image restarts the modem, only do it when needed
+	power_sleep(UART_DELAY);
+	if( api_ltegps_provquery(fwswitchquery, Resp_LTEGPS_FWSwitchIs) ){
+		power_sleep(UART_DELAY);
+		api_ltegps_fwswitch();
+		LOG("LTE: F/W image switched, modem restarting.\r\n");
 		return FAIL;
 	}
 
-	HAL_Delay(20);
-	if( api_ltegps_pdpset() ){
+	power_sleep(UART_DELAY);
+	if( api_ltegps_signalquality() ){
 		return FAIL;
 	}
 
-	HAL_Delay(20);
+	// Context of the APN may already be defined
+	power_sleep(UART_DELAY);
 	if( api_ltegps_pdpavailable() ){
-		return FAIL;
+
+		power_sleep(UART_DELAY);
+		if( api_ltegps_pdpset() ){
+			return FAIL;
+		}
+
+		power_sleep(UART_DELAY);
+		if( api_ltegps_pdpavailable() ){
+			return FAIL;
+		}
 	}
 
-	HAL_Delay(20);
-	if( api_ltegps_wdsselect() ){
-		return FAIL;
+	power_sleep(UART_DELAY);
+	if( api_ltegps_provquery(wdsquery, Resp_LTEGPS_WDSIs) ){
+		power_sleep(UART_DELAY);
+		if( api_ltegps_wdsselect() ){
+			return FAIL;
+		}
 	}
 
-	HAL_Delay(20);
-	if( api_ltegps_epsmode() ){
-		return FAIL;
+	power_sleep(UART_DELAY);
+	if( api_ltegps_provquery(epsquery, Resp_LTEGPS_EPSIs) ){
+		power_sleep(UART_DELAY);
+		if( api_ltegps_epsmode() ){
+			return FAIL;
+		}
 	}
 
-	HAL_Delay(20);
+	power_sleep(UART_DELAY);
 	if( api_ltegps_pdpactivate() ){
 		return FAIL;
 	}
 
+	api_ltegps_provsave();
+
 	LOG_BOX("\r\nSUCCESS: LTE connection successful.\r\n");
 
 	return PASS;
@@ -91,32 +229,25 @@ char api_ltegps_lteping(void){
 
 	LOG_BOX("SEND: Ping to www.google.com");
 
-	uart_tx(lteping, strlen(lteping), LTEGPS_UART);
-
-	uint32_t timeout = 0;
-
-	while( timeout < 30 * UART_1S_TIMEOUT){
-
-		HAL_Delay(UART_DELAY); // 20 ms delay
-
-		if( uart_rx_find(Resp_LTEGPS_Ping, strlen(Resp_LTEGPS_Ping) ) ){
-			uart_rx_print();
-			return PASS;
-		}
+	uart_tx(&uart_ltegps, lteping, strlen(lteping));
 
-		if( uart_rx_find(Resp_LTEGPS_ERROR, strlen(Resp_LTEGPS_ERROR) ) ){
-			LOG("ERROR: Ping failed.\r\n");
-			uart_rx_print();
-			return PASS;
-		}
+	switch( uart_rx_wait(&uart_ltegps, Resp_LTEGPS_PingFinal, 3, 30 * UART_1S_TIMEOUT, NULL) ){
 
-		timeout += UART_DELAY;
-	}
+	case 0:
+		uart_rx_print(&uart_ltegps);
+		return PASS;
 
-		uart_rx_print();
+	case UART_NO_MATCH:
+		uart_rx_print(&uart_ltegps);
 		LOG("ERROR: No response.\r\n");
 		return FAIL;
 
+	default:
+		LOG("ERROR: Ping failed.\r\n");
+		uart_rx_print(&uart_ltegps);
+		return FAIL;
+	}
+
 }
 
 /*****************************************************************************/
@@ -129,35 +260,50 @@ char api_ltegps_lteping(void){
 /*****************************************************************************/
 char api_ltegps_gpsconnect(void){
 
+	char status;
+
 	LOG_BOX("\r\nBeginning GPS connection sequence.\r\n");
 
-	HAL_Delay(20);
+	power_sleep(UART_DELAY);
 	if( api_ltegps_echodisable() ){
 		return FAIL;
 	}
 
-	HAL_Delay(20);
+	power_sleep(UART_DELAY);
 	if( api_ltegps_endnmea() ){
 		return FAIL;
 	}
 
-	HAL_Delay(20);
+	power_sleep(UART_DELAY);
 	if( api_ltegps_selectgnss() ){
 		return FAIL;
 	}
 
-	HAL_Delay(20);
+	power_sleep(UART_DELAY);
 	if( api_ltegps_powergnss() ){
 		return FAIL;
 	}
 
-	HAL_Delay(20);
-	if( api_ltegps_startnmea() ){
-		return FAIL;
+	// The GNSS is powered now, it goes down again whatever fails below
+	power_sleep(UART_DELAY);
+	status = api_ltegps_restartgnss();
+
+	if(status == PASS){
+		power_sleep(UART_DELAY);
+		status = api_ltegps_startnmea();
 	}
 
-	HAL_Delay(20);
+	power_sleep(UART_DELAY);
 	if( api_ltegps_endnmea() ){
+		status = FAIL;
+	}
+
+	power_sleep(UART_DELAY);
+	if( api_ltegps_offgnss() ){
+		status = FAIL;
+	}
+
+	if(status){
 		return FAIL;
 	}
 
@@ -166,6 +312,99 @@ char api_ltegps_gpsconnect(void){
 	return PASS;
 }
 
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_gpstask
+ *  @brief        : Scheduler task version of api_ltegps_gpsconnect. The
+ *  				wait for a valid fix yields, so other ports run during
+ *  				the GNSS acquisition.
+ *  @return       : RR_RUNNING, RR_DONE or RR_FAILED
+ */
+/*****************************************************************************/
+char api_ltegps_gpstask(Rr_Task *task){
+
+	RR_BEGIN(task);
+
+	LOG_BOX("\r\nBeginning GPS connection sequence.\r\n");
+
+	RR_CMD(task, echodisable, strlen(echodisable), Resp_LTEGPS_Final, LTEGPS_FINAL_COUNT, RR_CMD_TIMEOUT);
+	if(task->hit){
+		RR_EXIT(task);
+	}
+
+	RR_SLEEP(task, UART_DELAY);
+	RR_CMD(task, endnmea, strlen(endnmea), Resp_LTEGPS_Final, LTEGPS_FINAL_COUNT, RR_CMD_TIMEOUT);
+	if(task->hit){
+		RR_EXIT(task);
+	}
+
+	RR_SLEEP(task, UART_DELAY);
+	RR_CMD(task, selectgnss, strlen(selectgnss), Resp_LTEGPS_Final, LTEGPS_FINAL_COUNT, RR_CMD_TIMEOUT);
+	if(task->hit){
+		RR_EXIT(task);
+	}
+
+	// ERROR is returned when the GNSS controller is already powered
+	RR_SLEEP(task, UART_DELAY);
+	RR_CMD(task, powergnss, strlen(powergnss), Resp_LTEGPS_Final, 2, RR_CMD_TIMEOUT);
+	if(task->hit == UART_NO_MATCH){
+		RR_EXIT(task);
+	}
+
+	// The GNSS is powered now, step keeps the result until it is down again
+	task->step = PASS;
+
+	RR_SLEEP(task, UART_DELAY);
+	if( api_ltegps_restartcmd() != LTEGPS_START_NONE ){
+		RR_CMD(task, ltegps_cmd, strlen(ltegps_cmd), Resp_LTEGPS_Final, LTEGPS_FINAL_COUNT, RR_CMD_TIMEOUT);
+		if(task->hit){
+			task->step = FAIL;
+		}
+	}
+
+	if(task->step == PASS){
+		RR_SLEEP(task, UART_DELAY);
+		RR_CMD(task, startnmea, strlen(startnmea), Resp_LTEGPS_Final, LTEGPS_FINAL_COUNT, RR_CMD_TIMEOUT);
+		if(task->hit){
+			task->step = FAIL;
+		}
+	}
+
+	if(task->step == PASS){
+
+		// Until the fixes settle, hit keeps the acquisition state across yields
+		api_ltegps_nmeastart();
+		while( (task->hit = api_ltegps_acqstep()) == LTEGPS_ACQ_RUNNING ){
+			RR_WAIT_UNTIL(task, ltegps_fix, LTEGPS_ACQ_POLL);
+		}
+		uart_rx_hook(&uart_ltegps, NULL, NULL);	// Later bytes skip the parser
+
+		if( api_ltegps_acqdone(task->hit) ){ // Populate GPS struct
+			LOG("ERROR: Valid GPS response not found.\r\n");
+			task->step = FAIL;
+		}
+	}
+
+	RR_SLEEP(task, UART_DELAY);
+	RR_CMD(task, endnmea, strlen(endnmea), Resp_LTEGPS_Final, LTEGPS_FINAL_COUNT, RR_CMD_TIMEOUT);
+	if(task->hit){
+		task->step = FAIL;
+	}
+
+	RR_SLEEP(task, UART_DELAY);
+	RR_CMD(task, offgnss, strlen(offgnss), Resp_LTEGPS_Final, LTEGPS_FINAL_COUNT, RR_CMD_TIMEOUT);
+	if(task->hit){
+		task->step = FAIL;
+	}
+
+	if(task->step == FAIL){
+		RR_EXIT(task);
+	}
+
+	LOG_BOX("\r\nSUCCESS: GPS data succesfully retrieved.\r\n");
+
+	RR_END(task);
+}
+
 /******************** LTEGPS APPLICATION FUNCTIONS END ***********************/
 
 /******************** LTE API START ******************************************/
@@ -180,15 +419,14 @@ char api_ltegps_fwswitch(void){
 
 	LOG_BOX("SEND: F/W Switch to Verizon");
 
-	uart_tx(fwswitch, strlen(fwswitch), LTEGPS_UART);
+	uart_tx(&uart_ltegps, fwswitch, strlen(fwswitch));
 
-	if( uart_rx_check(Resp_LTEGPS_OK, strlen(Resp_LTEGPS_OK), UART_1S_TIMEOUT) ){
-		LOG("ERROR: No response.\r\n");
-		uart_rx_print();
+	if( api_ltegps_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_ltegps);
 		return FAIL;
 	}
 
-	uart_rx_print();
+	uart_rx_print(&uart_ltegps);
 	return PASS;
 
 }
@@ -203,21 +441,20 @@ char api_ltegps_signalquality(void){
 
 	LOG_BOX("SEND: Signal quality test");
 
-	uart_tx(signalquality, strlen(signalquality), LTEGPS_UART);
+	uart_tx(&uart_ltegps, signalquality, strlen(signalquality));
 
-	if( uart_rx_check(Resp_LTEGPS_OK, strlen(Resp_LTEGPS_OK), UART_1S_TIMEOUT) ){
-		LOG("ERROR: No response.\r\n");
-		uart_rx_print();
+	if( api_ltegps_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_ltegps);
 		return FAIL;
 	}
 
 	if( api_ltegps_signalqualitycheck() ){
 		LOG("ERROR: Weak tower signal\r\n");
-		uart_rx_print();
+		uart_rx_print(&uart_ltegps);
 		return FAIL;
 	}
 
-	uart_rx_print();
+	uart_rx_print(&uart_ltegps);
 	return PASS;
 
 }
@@ -239,7 +476,7 @@ char api_ltegps_signalqualitycheck(void){
 	const char s[2] = ",";
 	char *token;
 
-	str = rx_buff;
+	str = uart_ltegps.rx_buff;
 
 	token = strtok(str, s);
 
@@ -283,15 +520,14 @@ char api_ltegps_pdpset(void){
 
 	LOG_BOX("SEND: Set PDP context");
 
-	uart_tx(pdpset, strlen(pdpset), LTEGPS_UART);
+	uart_tx(&uart_ltegps, pdpset, strlen(pdpset));
 
-	if( uart_rx_check(Resp_LTEGPS_OK, strlen(Resp_LTEGPS_OK), UART_1S_TIMEOUT) ){
-		LOG("ERROR: No response.\r\n");
-		uart_rx_print();
+	if( api_ltegps_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_ltegps);
 		return FAIL;
 	}
 
-	uart_rx_print();
+	uart_rx_print(&uart_ltegps);
 	return PASS;
 
 }
@@ -307,26 +543,25 @@ char api_ltegps_pdpavailable(void){
 
 	char cid = 0;
 
-	uart_tx(pdpavailable, strlen(pdpavailable), LTEGPS_UART);
+	uart_tx(&uart_ltegps, pdpavailable, strlen(pdpavailable));
 
-	if( uart_rx_check(Resp_LTEGPS_OK, strlen(Resp_LTEGPS_OK), UART_1S_TIMEOUT) ){
-		LOG("ERROR: No response.\r\n");
-		uart_rx_print();
+	if( api_ltegps_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_ltegps);
 		return FAIL;
 	}
 
 	// scan for CID value of "vzwadmin"
-	cid = api_ltegps_pdpavailableparse("vzwinternet");
+	cid = api_ltegps_pdpavailableparse(LTEGPS_APN);
 
 	// cid must be from 1 to max
 	if(cid == '0'){
-		uart_rx_print();
+		uart_rx_print(&uart_ltegps);
 		return FAIL;
 	}
 
-	pdpactivate[9] = cid;
+	ltegps_cid = cid - '0';
 
-	uart_rx_print();
+	uart_rx_print(&uart_ltegps);
 
 	return PASS;
 
@@ -354,7 +589,7 @@ char api_ltegps_pdpavailableparse(char* apn)
 	*/
 
 	// Blank AP at CID = 1 is necessary
-	if ( !uart_rx_find(",\"\",", strlen(",\"\",") ) ){
+	if ( !uart_rx_find(&uart_ltegps, ",\"\",", strlen(",\"\",") ) ){
 		return '0'; // ERROR
 	}
 	char *str = NULL;
@@ -362,7 +597,7 @@ char api_ltegps_pdpavailableparse(char* apn)
 	char *token;
 	char cid = '0';
 
-	str = rx_buff;
+	str = uart_ltegps.rx_buff;
 
 	token = strtok(str, s);
 
@@ -394,15 +629,14 @@ char api_ltegps_wdsselect(void){
 
 	LOG_BOX("SEND: Set WDS setting to EU-TRAN (28)");
 
-	uart_tx(wdsselect, strlen(wdsselect), LTEGPS_UART);
+	uart_tx(&uart_ltegps, wdsselect, strlen(wdsselect));
 
-	if( uart_rx_check(Resp_LTEGPS_OK, strlen(Resp_LTEGPS_OK), UART_1S_TIMEOUT) ){
-		LOG("ERROR: No response.\r\n");
-		uart_rx_print();
+	if( api_ltegps_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_ltegps);
 		return FAIL;
 	}
 
-	uart_rx_print();
+	uart_rx_print(&uart_ltegps);
 	return PASS;
 
 }
@@ -417,15 +651,14 @@ char api_ltegps_epsmode(void){
 
 	LOG_BOX("SEND: Set EPS mode of operation to CS/PS mode 2");
 
-	uart_tx(epsmode, strlen(epsmode), LTEGPS_UART);
+	uart_tx(&uart_ltegps, epsmode, strlen(epsmode));
 
-	if( uart_rx_check(Resp_LTEGPS_OK, strlen(Resp_LTEGPS_OK), UART_1S_TIMEOUT) ){
-		LOG("ERROR: No response.\r\n");
-		uart_rx_print();
+	if( api_ltegps_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_ltegps);
 		return FAIL;
 	}
 
-	uart_rx_print();
+	uart_rx_print(&uart_ltegps);
 	return PASS;
 
 }
@@ -439,51 +672,294 @@ char api_ltegps_epsmode(void){
 /*****************************************************************************/
 char api_ltegps_pdpactivate(void){
 
+	At_Cmd cmd;
+
 	LOG_BOX("SEND: Activate PDP context");
 
-	uart_tx(pdpactivate, strlen(pdpactivate), LTEGPS_UART);
+	if(ltegps_cid == 0){
+		LOG("ERROR: No PDP context found.\r\n");
+		return FAIL;
+	}
 
-	if( uart_rx_check(Resp_LTEGPS_OK, strlen(Resp_LTEGPS_OK), UART_1S_TIMEOUT) ){
-		LOG("ERROR: No response.\r\n");
-		uart_rx_print();
+	at_cmd_start(&cmd, ltegps_cmd, sizeof(ltegps_cmd), pdpactivate);
+	at_cmd_uint(&cmd, ltegps_cid);
+	at_cmd_uint(&cmd, 1);
+	at_cmd_end(&cmd);
+
+	uart_tx(&uart_ltegps, ltegps_cmd, strlen(ltegps_cmd));
+
+	if( api_ltegps_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_ltegps);
 		return FAIL;
 	}
 
-	uart_rx_print();
+	uart_rx_print(&uart_ltegps);
 	return PASS;
 
 }
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_provclear
+ *  @brief        : Forget the cached provisioning, the next
+ *  				api_ltegps_lteconnect checks every modem setting again.
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+char api_ltegps_provclear(void){
+
+	return flash_nv_erase(FLASH_NV_LTE);
+
+}
+
 /******************** LTE API END ********************************************/
 
+/******************** LTE SOCKET START ***************************************/
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_sockopen
+ *  @brief        : Opens a TCP socket to host over the active PDP context.
+ *  				The module resolves host names itself. An open socket is
+ *  				closed first.
+ *  @param        : Host name or IP, port, 1 for TLS (not supported)
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+uint8_t api_ltegps_sockopen(const char *host, uint16_t port, uint8_t tls){
+
+	At_Cmd cmd;
+
+	api_ltegps_sockclose();
+
+	if(tls){
+		LOG("ERROR: TLS sockets are not set up on LTE.\r\n");
+		return FAIL;
+	}
+
+	LOG_BOX("SEND: Opening socket");
+	at_cmd_start(&cmd, ltegps_cmd, sizeof(ltegps_cmd), sockdial);
+	at_cmd_uint(&cmd, LTEGPS_SOCK_ID);
+	at_cmd_uint(&cmd, 0);	// TCP
+	at_cmd_uint(&cmd, port);
+	at_cmd_str(&cmd, host);
+	at_cmd_uint(&cmd, 0);	// Closure type
+	at_cmd_uint(&cmd, 0);	// Local port
+	at_cmd_uint(&cmd, 1);	// Command mode, AT commands stay available
+	if( at_cmd_end(&cmd) ){
+		return FAIL;
+	}
+
+	uart_tx(&uart_ltegps, ltegps_cmd, strlen(ltegps_cmd));
+
+	if( api_ltegps_final(LTEGPS_SOCK_TIMEOUT / UART_DELAY) ){
+		uart_rx_print(&uart_ltegps);
+		return FAIL;
+	}
+
+	uart_rx_print(&uart_ltegps);
+	ltegps_sock = 1;
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_socksend
+ *  @brief        : Sends data over the open socket, LTEGPS_SOCK_CHUNK bytes
+ *  				per command. The data goes out after the prompt.
+ *  @param        : Data, size
+ *  @return       : pass or fail (socket is dropped)
+ */
+/*****************************************************************************/
+uint8_t api_ltegps_socksend(const uint8_t *data, uint16_t size){
+
+	uint16_t n;
+	At_Cmd cmd;
+
+	if( !ltegps_sock ){
+		return FAIL;
+	}
+
+	while(size){
+
+		n = (size < LTEGPS_SOCK_CHUNK) ? size : LTEGPS_SOCK_CHUNK;
+
+		at_cmd_start(&cmd, ltegps_cmd, sizeof(ltegps_cmd), socksend);
+		at_cmd_uint(&cmd, LTEGPS_SOCK_ID);
+		at_cmd_uint(&cmd, n);
+		at_cmd_end(&cmd);
+
+		if( uart_tx(&uart_ltegps, ltegps_cmd, strlen(ltegps_cmd)) ){
+			break;
+		}
+
+		if( uart_rx_wait(&uart_ltegps, Resp_LTEGPS_SendStart, 3, UART_1S_TIMEOUT, NULL) != 0 ){
+			break;
+		}
+
+		// The modem now takes the next n bytes as data, whatever they are
+		while( uart_tx_busy(&uart_ltegps) == TX_BUSY );
+		if( uart_tx_submit(&uart_ltegps, (const char*)data, n, NULL, NULL, NULL) ){
+			LOG("ERROR: Socket send not queued.\r\n");
+			api_ltegps_sockclose();
+			return FAIL;
+		}
+
+		if( api_ltegps_final(LTEGPS_SOCK_TIMEOUT / UART_DELAY) ){
+			break;
+		}
+
+		data += n;
+		size -= n;
+	}
+
+	if(size){
+		LOG("ERROR: Socket send failed.\r\n");
+		uart_rx_print(&uart_ltegps);
+		ltegps_sock = 0;
+		return FAIL;
+	}
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_sockrecv
+ *  @brief        : Reads data from the open socket. The bytes waiting in
+ *  				the module are polled every LTEGPS_SOCK_POLL ms until
+ *  				there are some or timeout ms pass, then read by length,
+ *  				so they may hold any bytes.
+ *  @param        : Buffer, size, timeout in ms
+ *  @return       : bytes read, 0 on timeout or TRANSPORT_CLOSED
+ */
+/*****************************************************************************/
+int16_t api_ltegps_sockrecv(uint8_t *data, uint16_t size, uint32_t timeout){
+
+	uint32_t start = HAL_GetTick();
+	uint16_t head, n, waiting, digits, value;
+	At_Cmd cmd;
+
+	if( !ltegps_sock ){
+		return TRANSPORT_CLOSED;
+	}
+
+	if(size > LTEGPS_SOCK_CHUNK){
+		size = LTEGPS_SOCK_CHUNK;
+	}
+
+	while(1){
+
+		waiting = api_ltegps_sockwaiting();
+
+		if(waiting == 0xFFFF){
+			ltegps_sock = 0;
+			return TRANSPORT_CLOSED;
+		}
+
+		if(waiting){
+			break;
+		}
+
+		if(HAL_GetTick() - start >= timeout){
+			return 0;
+		}
+
+		power_sleep(LTEGPS_SOCK_POLL);
+	}
+
+	n = (waiting < size) ? waiting : size;
+
+	at_cmd_start(&cmd, ltegps_cmd, sizeof(ltegps_cmd), sockrecv);
+	at_cmd_uint(&cmd, LTEGPS_SOCK_ID);
+	at_cmd_uint(&cmd, n);
+	at_cmd_end(&cmd);
+
+	uart_tx(&uart_ltegps, ltegps_cmd, strlen(ltegps_cmd));
+
+	if( uart_rx_wait(&uart_ltegps, Resp_LTEGPS_RecvStart, 3, LTEGPS_SOCK_TIMEOUT / UART_DELAY, &head) != 0 ){
+		LOG("ERROR: Socket closed.\r\n");
+		uart_rx_print(&uart_ltegps);
+		ltegps_sock = 0;
+		return TRANSPORT_CLOSED;
+	}
+
+	// "id,n" CR LF, then the n bytes asked for, then the final result
+	for(digits = 1, value = n; value >= 10; value /= 10){
+		digits++;
+	}
+	head += 2 + digits + 2;
+
+	uart_rx_count(&uart_ltegps, head + n + sizeof(Resp_LTEGPS_RecvEnd) - 1);
+	if( power_wait(&uart_ltegps.match_hit, UART_NO_MATCH, LTEGPS_SOCK_TIMEOUT) ){
+		ltegps_sock = 0;
+		return TRANSPORT_CLOSED;
+	}
+
+	memcpy(data, &uart_ltegps.rx_buff[head], n);
+	return n;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_sockclose
+ *  @brief        : Closes the open socket, if any.
+ */
+/*****************************************************************************/
+void api_ltegps_sockclose(void){
+
+	At_Cmd cmd;
+
+	if( !ltegps_sock ){
+		return;
+	}
+
+	LOG_BOX("SEND: Closing socket");
+	at_cmd_start(&cmd, ltegps_cmd, sizeof(ltegps_cmd), sockclose);
+	at_cmd_uint(&cmd, LTEGPS_SOCK_ID);
+	at_cmd_end(&cmd);
+
+	uart_tx(&uart_ltegps, ltegps_cmd, strlen(ltegps_cmd));
+	api_ltegps_final(UART_1S_TIMEOUT);	// Closed either way
+	uart_rx_print(&uart_ltegps);
+
+	ltegps_sock = 0;
+}
+
+/******************** LTE SOCKET END *****************************************/
+
 /******************** GPS API START ******************************************/
 
 /*****************************************************************************/
 /*! @Function Name: api_ltegps_startnmea
  *  @brief        : NMEA data stream start command of USART LTEGPS module.
- *  @return       : pass or fail
+ *  				Returns as soon as the fixes settle (Ltegps_Acq) with
+ *  				their average in GPS, or at the timeout with the best
+ *  				there is.
+ *  @return       : pass, or fail when no valid fix arrived
  */
 /*****************************************************************************/
 char api_ltegps_startnmea(void){
 
+	uint8_t state;
+
 	LOG_BOX("SEND: NMEA data stream start ");
-	LOG("Waiting for valid GPS response. (1 minute timeout)");
-	uart_tx(startnmea, strlen(startnmea), LTEGPS_UART);
+	LOG("Waiting for valid GPS response.");
+	uart_tx(&uart_ltegps, startnmea, strlen(startnmea));
 
-	if( uart_rx_check(Resp_LTEGPS_OK, strlen(Resp_LTEGPS_OK), UART_1S_TIMEOUT) ){
-		LOG("ERROR: No response.\r\n");
-		uart_rx_print();
+	if( api_ltegps_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_ltegps);
 		return FAIL;
 	}
 
-	if( uart_rx_check(Resp_LTEGPS_VALID, strlen(Resp_LTEGPS_VALID), 60 * UART_1S_TIMEOUT) ){
+	api_ltegps_nmeastart();
+
+	while( (state = api_ltegps_acqstep()) == LTEGPS_ACQ_RUNNING ){
+		power_wait(&ltegps_fix, 0, LTEGPS_ACQ_POLL);
+	}
+	uart_rx_hook(&uart_ltegps, NULL, NULL);	// Later bytes skip the parser
+
+	if( api_ltegps_acqdone(state) ){ // Populate GPS struct
 		LOG("ERROR: Valid GPS response not found.\r\n");
-		uart_rx_print();
+		uart_rx_print(&uart_ltegps);
 		return FAIL;
 	}
 
-	api_ltegps_parsenmea(); // Populate GPS struct
-
-	uart_rx_print();
+	uart_rx_print(&uart_ltegps);
 	return PASS;
 
 
@@ -499,15 +975,14 @@ char api_ltegps_endnmea(void){
 
 	LOG_BOX("SEND: NMEA data stream end ");
 
-	uart_tx(endnmea, strlen(endnmea), LTEGPS_UART);
+	uart_tx(&uart_ltegps, endnmea, strlen(endnmea));
 
-	if( uart_rx_check(Resp_LTEGPS_OK, strlen(Resp_LTEGPS_OK), UART_1S_TIMEOUT) ){
-		LOG("ERROR: No response.\r\n");
-		uart_rx_print();
+	if( api_ltegps_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_ltegps);
 		return FAIL;
 	}
 
-	uart_rx_print();
+	uart_rx_print(&uart_ltegps);
 	return PASS;
 
 }
@@ -525,15 +1000,14 @@ char api_ltegps_selectgnss(void){
 
 	LOG_BOX("SEND: GNSS select antenna");
 
-	uart_tx(selectgnss, strlen(selectgnss), LTEGPS_UART);
+	uart_tx(&uart_ltegps, selectgnss, strlen(selectgnss));
 
-	if( uart_rx_check(Resp_LTEGPS_OK, strlen(Resp_LTEGPS_OK), UART_1S_TIMEOUT) ){
-		LOG("ERROR: No response.\r\n");
-		uart_rx_print();
+	if( api_ltegps_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_ltegps);
 		return FAIL;
 	}
 
-	uart_rx_print();
+	uart_rx_print(&uart_ltegps);
 	return PASS;
 
 }
@@ -549,105 +1023,131 @@ char api_ltegps_powergnss(void){
 
 	LOG_BOX("SEND: GNSS controller power up");
 
-	uart_tx(powergnss, strlen(powergnss), LTEGPS_UART);
+	uart_tx(&uart_ltegps, powergnss, strlen(powergnss));
 
-	uint32_t timeout = 0;
+	// ERROR is returned when the GNSS controller is already powered
+	if( uart_rx_wait(&uart_ltegps, Resp_LTEGPS_Final, 2, UART_1S_TIMEOUT, NULL) == UART_NO_MATCH ){
+		uart_rx_print(&uart_ltegps);
+		LOG("ERROR: No response.\r\n");
+		return FAIL;
+	}
 
-	while( timeout < UART_1S_TIMEOUT){
+	uart_rx_print(&uart_ltegps);
+	return PASS;
 
-		HAL_Delay(UART_DELAY); // 20 ms delay
+}
 
-		if( uart_rx_find(Resp_LTEGPS_OK, strlen(Resp_LTEGPS_OK) ) ){
-			uart_rx_print();
-			return PASS;
-		}
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_acqconfig
+ *  @brief        : Sets the acquisition thresholds used by the next
+ *  				api_ltegps_startnmea. The window is clamped to
+ *  				1..LTEGPS_ACQ_MAX.
+ *  @param        : thresholds
+ */
+/*****************************************************************************/
+void api_ltegps_acqconfig(const Ltegps_Acq *acq){
 
-		if( uart_rx_find(Resp_LTEGPS_ERROR, strlen(Resp_LTEGPS_ERROR) ) ){
-			uart_rx_print();
-			return PASS;
-		}
+	ltegps_acq = *acq;
 
-		timeout += UART_DELAY;
+	if(ltegps_acq.window == 0){
+		ltegps_acq.window = 1;
+	}
+	if(ltegps_acq.window > LTEGPS_ACQ_MAX){
+		ltegps_acq.window = LTEGPS_ACQ_MAX;
 	}
-
-		uart_rx_print();
-		LOG("ERROR: No response.\r\n");
-		return FAIL;
-
-
 }
 
 /*****************************************************************************/
-/*! @Function Name: LGM_ParseNMEA
- *  @brief        : NMEA parsing function of USART LTEGPS module. Used after
- *  				api_ltegps_startnmea is called.
+/*! @Function Name: api_ltegps_restartgnss
+ *  @brief        : Restarts the GNSS controller hot when the last fix record
+ *  				was written this power up less than LTEGPS_HOT_AGE ago.
+ *  				Otherwise nothing is sent, the modem may still hold
+ *  				ephemeris the MCU does not know about. Starts the time
+ *  				to first fix.
  *  @return       : pass or fail
  */
 /*****************************************************************************/
-char api_ltegps_parsenmea(void){
+char api_ltegps_restartgnss(void){
 
-	// $GPRMC,161229.487,A,3723.2475,N,12158.3416,W,0.13,309.62,120598,,*10<CR><LF>
-
-	char Status = PASS;
-	char *str = NULL;
-	const char s[2] = ",";
-	char *token;
+	LOG_BOX("SEND: GNSS restart");
 
-	str = rx_buff;
+	switch( api_ltegps_restartcmd() ){
 
-	token = strtok(str, s);
+	case LTEGPS_START_HOT:
+		LOG("GPS: Hot start from the last fix.\r\n");
+		break;
 
-	while( token != NULL && Status == PASS){
+	default:
+		if( api_ltegps_hintvalid() && !ltegps_hint_fresh ){
+			LOG("GPS: Last fix is from before a reset, starting as is.\r\n");
+		}else{
+			LOG("GPS: No recent fix, starting as is.\r\n");
+		}
+		return PASS;
+	}
 
-        // if token is start of RMC message
-        if (strstr(token, "$GPRMC")) {
+	uart_tx(&uart_ltegps, ltegps_cmd, strlen(ltegps_cmd));
 
-        	// store RMC data
-        	token = strtok(NULL, s);
-        	 GPS.UTC_time = strtof(token, NULL);
+	if( api_ltegps_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_ltegps);
+		return FAIL;
+	}
 
-            // store latitude
-            token = strtok(NULL, s);
+	uart_rx_print(&uart_ltegps);
+	return PASS;
 
-        	// if valid stream
-        	if(*token == 'A'){
+}
 
-        		Status = PASS;
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_offgnss
+ *  @brief        : GNSS power down command of USART LTEGPS module, once the
+ *  				fix is taken. The controller keeps its ephemeris for the
+ *  				next hot start.
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+char api_ltegps_offgnss(void){
 
-            	// store latitude
-                token = strtok(NULL, s);
-                GPS.latitude = strtof(token, NULL);
+	LOG_BOX("SEND: GNSS controller power down");
 
-                // store N/S indicator
-                token = strtok(NULL, s);
-                strcpy(GPS.NS_indicator, token);
+	uart_tx(&uart_ltegps, offgnss, strlen(offgnss));
 
-                // store longitude
-                token = strtok(NULL, s);
-                GPS.longitude = strtof(token, NULL);
+	if( api_ltegps_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_ltegps);
+		return FAIL;
+	}
 
-                // store E/W indicator
-                token = strtok(NULL, s);
-                strcpy( GPS.EW_indicator, token);
+	uart_rx_print(&uart_ltegps);
+	return PASS;
 
-                // store speed over ground as km/h
-                token = strtok(NULL, s);
-                GPS.speed = strtof(token, NULL);
-                GPS.speed *= 1.852;
+}
 
-                // store date
-                token = strtok(NULL, s); // skip course over ground
-                token = strtok(NULL, s);
-                strcpy( GPS.date, token);
-        	}
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_parsenmea
+ *  @brief        : Copies the last epoch fix of the NMEA stream into GPS.
+ *  				The stream is parsed as it arrives once
+ *  				api_ltegps_startnmea is called.
+ *  @return       : pass, or fail when no valid fix arrived
+ */
+/*****************************************************************************/
+char api_ltegps_parsenmea(void){
 
-        }
+	Nmea_Fix fix;
+	uint32_t primask;
 
-    token = strtok(NULL, s);
+	// The hook may be writing it
+	primask = __get_PRIMASK();
+	__disable_irq();
+	fix = ltegps_nmea.fix;
+	__set_PRIMASK(primask);
 
+	if(!fix.valid){
+		return FAIL;
 	}
 
-	return Status;
+	api_ltegps_fixcopy(&fix);
+
+	return PASS;
 }
 
 /******************** GPS API END ********************************************/
@@ -662,15 +1162,14 @@ char api_ltegps_parsenmea(void){
 char api_ltegps_check(void){
 
 	LOG_BOX("SEND: response check");
-	uart_tx(atcheck, strlen(atcheck), LTEGPS_UART);
+	uart_tx(&uart_ltegps, atcheck, strlen(atcheck));
 
-	if( uart_rx_check(Resp_LTEGPS_OK, strlen(Resp_LTEGPS_OK), UART_1S_TIMEOUT) ){
-		LOG("ERROR: No response.\r\n");
-		uart_rx_print();
+	if( api_ltegps_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_ltegps);
 		return FAIL;
 	}
 
-	uart_rx_print();
+	uart_rx_print(&uart_ltegps);
 	return PASS;
 }
 
@@ -683,14 +1182,533 @@ char api_ltegps_check(void){
 char api_ltegps_echodisable(void){
 
 	LOG_BOX("SEND: echo disable");
-	uart_tx(echodisable, strlen(echodisable), LTEGPS_UART);
+	uart_tx(&uart_ltegps, echodisable, strlen(echodisable));
+
+	if( api_ltegps_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_ltegps);
+		return FAIL;
+	}
+
+	uart_rx_print(&uart_ltegps);
+	return PASS;
+}
 
-	if( uart_rx_check(Resp_LTEGPS_OK, strlen(Resp_LTEGPS_OK), UART_1S_TIMEOUT) ){
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_final
+ *  @brief        : Waits for the final result code of the last command. An
+ *  				ERROR or +CME ERROR ends the wait as soon as it arrives.
+ *  @param        : timeout in UART_DELAY units
+ *  @return       : pass on OK, fail on error response or timeout
+ */
+/*****************************************************************************/
+static char api_ltegps_final(uint16_t test_cnt){
+
+	switch( uart_rx_wait(&uart_ltegps, Resp_LTEGPS_Final, LTEGPS_FINAL_COUNT, test_cnt, NULL) ){
+
+	case 0:
+		return PASS;
+
+	case UART_NO_MATCH:
 		LOG("ERROR: No response.\r\n");
-		uart_rx_print();
 		return FAIL;
+
+	default:
+		LOG("ERROR: Command rejected.\r\n");
+		return FAIL;
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_sockwaiting
+ *  @brief        : Bytes received on the socket and not read yet, the
+ *  				buff_in field of the socket information.
+ *  @return       : byte count, 0xFFFF when the socket is gone
+ */
+/*****************************************************************************/
+static uint16_t api_ltegps_sockwaiting(void){
+
+	uint16_t i, value = 0;
+	uint8_t field = 0;
+	At_Cmd cmd;
+
+	at_cmd_start(&cmd, ltegps_cmd, sizeof(ltegps_cmd), sockinfo);
+	at_cmd_uint(&cmd, LTEGPS_SOCK_ID);
+	at_cmd_end(&cmd);
+
+	uart_tx(&uart_ltegps, ltegps_cmd, strlen(ltegps_cmd));
+
+	if( api_ltegps_final(UART_1S_TIMEOUT) ){
+		return 0xFFFF;
+	}
+
+	i = uart_rx_find(&uart_ltegps, Resp_LTEGPS_Info, sizeof(Resp_LTEGPS_Info) - 1);
+	if(i == 0){
+		return 0xFFFF;
+	}
+
+	// id,sent,received,buff_in,ack_waiting
+	for(; i < uart_ltegps.rx_idx && field <= 3; i++){
+
+		char c = uart_ltegps.rx_buff[i];
+
+		if(c == ','){
+			field++;
+		}else if(field == 3 && c >= '0' && c <= '9'){
+			value = value * 10 + (c - '0');
+		}else if(field == 3){
+			break;
+		}
+	}
+
+	return value;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_provquery
+ *  @brief        : Read a modem setting.
+ *  @param        : query command, answer when already at the target
+ *  @return       : pass when at the target, fail when it must be set
+ */
+/*****************************************************************************/
+static char api_ltegps_provquery(char *cmd, char *want){
+
+	uint16_t found;
+
+	uart_tx(&uart_ltegps, cmd, strlen(cmd));
+
+	if( api_ltegps_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_ltegps);
+		return FAIL;
+	}
+
+	found = uart_rx_find(&uart_ltegps, want, strlen(want));
+
+	uart_rx_print(&uart_ltegps);
+
+	return found ? PASS : FAIL;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_provdigest
+ *  @brief        : FNV-1a digest of the set commands and APN, a record
+ *  				saved for other settings does not match.
+ *  @return       : digest
+ */
+/*****************************************************************************/
+static uint32_t api_ltegps_provdigest(void){
+
+	const char *target[] = { fwswitch, pdpset, wdsselect, epsmode, LTEGPS_APN };
+	uint32_t digest = 0x811C9DC5;
+	const char *c;
+	uint8_t i;
+
+	for(i = 0; i < sizeof(target) / sizeof(target[0]); i++){
+		for(c = target[i]; *c; c++){
+			digest = (digest ^ (uint8_t)*c) * 0x01000193;
+		}
+	}
+
+	return digest;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_provsum
+ *  @brief        : Checksum of a provisioning record.
+ *  @return       : checksum
+ */
+/*****************************************************************************/
+static uint32_t api_ltegps_provsum(const Lte_Prov *prov){
+
+	const uint8_t *p = (const uint8_t*)prov;
+	uint32_t sum = 0x5A5A5A5A;
+	uint16_t i;
+
+	for(i = 0; i < offsetof(Lte_Prov, check); i++){
+		sum = (sum << 1 | sum >> 31) + p[i];
+	}
+
+	return sum;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_provload
+ *  @brief        : Read the provisioning record and take its CID. An erased
+ *  				page, a bad checksum or other target settings all fail.
+ *  @return       : pass when the modem was provisioned for these settings
+ */
+/*****************************************************************************/
+static uint8_t api_ltegps_provload(void){
+
+	Lte_Prov prov;
+
+	flash_nv_read(FLASH_NV_LTE, &prov, sizeof(prov));
+
+	if( prov.magic != LTEGPS_PROV_MAGIC ||
+		prov.check != api_ltegps_provsum(&prov) ||
+		prov.digest != api_ltegps_provdigest() ||
+		prov.cid == 0 ){
+		return FAIL;
+	}
+
+	ltegps_cid = prov.cid;
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_provsave
+ *  @brief        : Record the settings and CID of a successful attach.
+ *  				Nothing is written when the record is unchanged.
+ */
+/*****************************************************************************/
+static void api_ltegps_provsave(void){
+
+	Lte_Prov prov;
+
+	memset(&prov, 0, sizeof(prov));
+	prov.magic = LTEGPS_PROV_MAGIC;
+	prov.digest = api_ltegps_provdigest();
+	prov.cid = ltegps_cid;
+	prov.check = api_ltegps_provsum(&prov);
+
+	if( flash_nv_write(FLASH_NV_LTE, &prov, sizeof(prov)) ){
+		LOG("LTE: Provisioning not saved.\r\n");
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_nmeastart
+ *  @brief        : Hooks the NMEA parser to the LTEGPS port and starts an
+ *  				acquisition. Called once the stream start command is
+ *  				answered, bytes already in are parsed first. The caller
+ *  				removes the hook when the acquisition ends.
+ */
+/*****************************************************************************/
+static void api_ltegps_nmeastart(void){
+
+	nmea_init(&ltegps_nmea);
+	memset(&ltegps_window, 0, sizeof(ltegps_window));
+	ltegps_last.valid = 0;
+	ltegps_acq_tick   = HAL_GetTick();
+	ltegps_fix_tick   = 0;
+	ltegps_fix        = 0;
+
+	uart_rx_hook(&uart_ltegps, api_ltegps_nmeahook, &ltegps_nmea);
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_nmeahook
+ *  @brief        : Feeds the NMEA parser, runs in the RX interrupt. Each
+ *  				valid epoch fix wakes the waiting caller.
+ */
+/*****************************************************************************/
+static void api_ltegps_nmeahook(void *ctx, const char *data, uint16_t size){
+
+	Nmea_Parser *nmea = (Nmea_Parser*)ctx;
+
+	if( (nmea_feed(nmea, data, size) & NMEA_FIX) && nmea->fix.valid ){
+		if(!ltegps_fix_tick){
+			ltegps_fix_tick = HAL_GetTick();
+		}
+		ltegps_fix = 1;	// Cleared by api_ltegps_acqstep
+		uart_event = 1;	// Wake the scheduler
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_restartcmd
+ *  @brief        : Picks the start type from the last fix record and builds
+ *  				its AT$GPSR command. A record of this power up is the
+ *  				only proof the modem holds ephemeris; after a reset of
+ *  				the MCU alone it may hold them too, so no restart is
+ *  				forced that would drop them.
+ *  				The time to first fix counts from here.
+ *  @return       : LTEGPS_START_*, NONE when no command is to be sent
+ */
+/*****************************************************************************/
+static uint8_t api_ltegps_restartcmd(void){
+
+	At_Cmd cmd;
+
+	ltegps_start_tick = HAL_GetTick();
+	ltegps_start      = LTEGPS_START_NONE;
+
+	if( api_ltegps_hintvalid() && ltegps_hint_fresh &&
+		ltegps_start_tick - ltegps_hint.tick < LTEGPS_HOT_AGE ){
+		ltegps_start = LTEGPS_START_HOT;
+	}
+
+	if(ltegps_start == LTEGPS_START_NONE){
+		return LTEGPS_START_NONE;
+	}
+
+	at_cmd_start(&cmd, ltegps_cmd, sizeof(ltegps_cmd), restartgnss);
+	at_cmd_uint(&cmd, ltegps_start);
+
+	if( at_cmd_end(&cmd) ){
+		ltegps_start = LTEGPS_START_NONE;
+	}
+
+	return ltegps_start;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_acqstep
+ *  @brief        : Takes the fix the hook reported, if any, into the window
+ *  				and checks the deadline.
+ *  @return       : LTEGPS_ACQ_*
+ */
+/*****************************************************************************/
+static uint8_t api_ltegps_acqstep(void){
+
+	Nmea_Fix fix;
+	uint32_t primask;
+
+	if(ltegps_fix){
+
+		// The hook may be writing it
+		primask = __get_PRIMASK();
+		__disable_irq();
+		fix = ltegps_nmea.fix;
+		ltegps_fix = 0;
+		__set_PRIMASK(primask);
+
+		if(fix.valid){
+			ltegps_last = fix;
+			if( api_ltegps_acqtake(&fix) == PASS ){
+				return LTEGPS_ACQ_SETTLED;
+			}
+		}
+	}
+
+	if(HAL_GetTick() - ltegps_acq_tick >= ltegps_acq.timeout){
+		return LTEGPS_ACQ_TIMEOUT;
+	}
+
+	return LTEGPS_ACQ_RUNNING;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_acqtake
+ *  @brief        : Adds a valid fix to the window. A fix failing the HDOP or
+ *  				satellite threshold empties it, a full window drops its
+ *  				oldest fix.
+ *  @return       : pass once the window is full and within the spread
+ */
+/*****************************************************************************/
+static uint8_t api_ltegps_acqtake(const Nmea_Fix *fix){
+
+	Ltegps_Window *w = &ltegps_window;
+	uint64_t spread2 = (uint64_t)ltegps_acq.spread_max * ltegps_acq.spread_max;
+	int64_t lat = 0, lon = 0;
+	uint8_t i, slot;
+
+	if(fix->hdop == 0 || fix->hdop > ltegps_acq.hdop_max || fix->used < ltegps_acq.used_min){
+		w->count = 0;
+		return FAIL;
+	}
+
+	if(w->count >= ltegps_acq.window){
+		w->head = (w->head + 1) % LTEGPS_ACQ_MAX;
+		w->count--;
+	}
+
+	slot = (w->head + w->count) % LTEGPS_ACQ_MAX;
+	w->lat[slot] = fix->lat;
+	w->lon[slot] = fix->lon;
+	w->alt[slot] = fix->alt;
+	w->count++;
+
+	if(w->count < ltegps_acq.window){
+		return FAIL;
+	}
+
+	for(i = 0; i < w->count; i++){
+		slot = (w->head + i) % LTEGPS_ACQ_MAX;
+		lat += w->lat[slot];
+		lon += w->lon[slot];
+	}
+	lat /= w->count;
+	lon /= w->count;
+
+	for(i = 0; i < w->count; i++){
+		slot = (w->head + i) % LTEGPS_ACQ_MAX;
+		if(api_ltegps_dist2(w->lat[slot], w->lon[slot], (int32_t)lat, (int32_t)lon) > spread2){
+			return FAIL;
+		}
+	}
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_acqdone
+ *  @brief        : Ends an acquisition. GPS gets the last valid fix with the
+ *  				window average as position: the settled window, or at a
+ *  				timeout whatever qualified so far. The fix is kept for the
+ *  				next start.
+ *  @param        : LTEGPS_ACQ_* the acquisition ended with
+ *  @return       : pass, or fail when no valid fix arrived
+ */
+/*****************************************************************************/
+static uint8_t api_ltegps_acqdone(uint8_t state){
+
+	Ltegps_Window *w = &ltegps_window;
+	int64_t lat = 0, lon = 0, alt = 0;
+	uint8_t i, slot;
+
+	if(!ltegps_last.valid){
+		return FAIL;
+	}
+
+	api_ltegps_fixcopy(&ltegps_last);
+
+	GPS.averaged = 0;
+	if(w->count > 1){
+		for(i = 0; i < w->count; i++){
+			slot = (w->head + i) % LTEGPS_ACQ_MAX;
+			lat += w->lat[slot];
+			lon += w->lon[slot];
+			alt += w->alt[slot];
+		}
+		GPS.latitude  = (int32_t)(lat / w->count);
+		GPS.longitude = (int32_t)(lon / w->count);
+		GPS.altitude  = (int32_t)(alt / w->count);
+		GPS.averaged  = w->count;
 	}
 
-	uart_rx_print();
+	if(state != LTEGPS_ACQ_SETTLED){
+		LOG("GPS: Fixes did not settle, taking the best so far.\r\n");
+	}
+
+	GPS.start  = ltegps_start;
+	GPS.ttff   = ltegps_fix_tick - ltegps_start_tick;
+	GPS.settle = HAL_GetTick() - ltegps_start_tick;
+
+	api_ltegps_hintsave();
+
 	return PASS;
 }
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_fixcopy
+ *  @brief        : Copies an epoch fix into GPS.
+ */
+/*****************************************************************************/
+static void api_ltegps_fixcopy(const Nmea_Fix *fix){
+
+	GPS.UTC_time  = fix->time;
+	GPS.latitude  = fix->lat;
+	GPS.longitude = fix->lon;
+	GPS.speed     = fix->speed;
+	GPS.day       = fix->day;
+	GPS.month     = fix->month;
+	GPS.year      = fix->year;
+	GPS.altitude  = fix->alt;
+	GPS.fix       = fix->fix;
+	GPS.used      = fix->used;
+	GPS.view      = fix->view;
+	GPS.hdop      = fix->hdop;
+	GPS.pdop      = fix->pdop;
+	memcpy(GPS.sky, fix->sky, sizeof(GPS.sky));
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_dist2
+ *  @brief        : Squared distance between two positions in cm^2, flat
+ *  				earth over the few metres compared. One 1e-7 degree of
+ *  				latitude is 1.1132 cm, longitude shrinks with cos(lat).
+ *  @return       : distance squared, cm^2
+ */
+/*****************************************************************************/
+static uint64_t api_ltegps_dist2(int32_t lat1, int32_t lon1, int32_t lat2, int32_t lon2){
+
+	uint32_t tens, rest;
+	uint32_t cosq, dlon;
+	int64_t dy, dx;
+
+	// cos(lat) by linear interpolation over 10 degree steps
+	tens = api_ltegps_diff(lat1, 0) / (10 * NMEA_DEGREE);
+	rest = api_ltegps_diff(lat1, 0) % (10 * NMEA_DEGREE);
+	if(tens >= 9){
+		cosq = 0;
+	}else{
+		cosq = ltegps_cos[tens] - (uint32_t)(((uint64_t)(ltegps_cos[tens] - ltegps_cos[tens + 1]) * rest) / (10 * NMEA_DEGREE));
+	}
+
+	dlon = api_ltegps_diff(lon1, lon2);
+	if(dlon > 180 * NMEA_DEGREE){
+		dlon = 360UL * NMEA_DEGREE - dlon;	// Across the antimeridian
+	}
+
+	dy = (int64_t)api_ltegps_diff(lat1, lat2) * 11132 / 10000;
+	dx = (int64_t)dlon * 11132 / 10000 * cosq / 32768;
+
+	return (uint64_t)(dy * dy + dx * dx);
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_hintsum
+ *  @brief        : Checksum of a last fix record.
+ *  @return       : checksum
+ */
+/*****************************************************************************/
+static uint32_t api_ltegps_hintsum(const Ltegps_Hint *hint){
+
+	const uint8_t *p = (const uint8_t*)hint;
+	uint32_t sum = 0x5A5A5A5A;
+	uint16_t i;
+
+	for(i = 0; i < offsetof(Ltegps_Hint, check); i++){
+		sum = (sum << 1 | sum >> 31) + p[i];
+	}
+
+	return sum;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_hintvalid
+ *  @brief        : Check the retained last fix record, which holds random
+ *  				data after power up.
+ *  @return       : 1 when usable, else 0
+ */
+/*****************************************************************************/
+static uint8_t api_ltegps_hintvalid(void){
+
+	return (ltegps_hint.magic == LTEGPS_HINT_MAGIC &&
+			ltegps_hint.check == api_ltegps_hintsum(&ltegps_hint) &&
+			api_ltegps_diff(ltegps_hint.lat, 0) <= 90 * NMEA_DEGREE &&
+			api_ltegps_diff(ltegps_hint.lon, 0) <= 180 * NMEA_DEGREE) ? 1 : 0;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_hintsave
+ *  @brief        : Keeps the fix in GPS as the last fix record.
+ */
+/*****************************************************************************/
+static void api_ltegps_hintsave(void){
+
+	memset(&ltegps_hint, 0, sizeof(ltegps_hint));
+	ltegps_hint.magic = LTEGPS_HINT_MAGIC;
+	ltegps_hint.lat   = GPS.latitude;
+	ltegps_hint.lon   = GPS.longitude;
+	ltegps_hint.alt   = GPS.altitude;
+	ltegps_hint.time  = GPS.UTC_time;
+	ltegps_hint.day   = GPS.day;
+	ltegps_hint.month = GPS.month;
+	ltegps_hint.year  = GPS.year;
+	ltegps_hint.tick  = ltegps_fix_tick;
+	ltegps_hint.check = api_ltegps_hintsum(&ltegps_hint);
+	ltegps_hint_fresh = 1;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_ltegps_diff
+ *  @brief        : Distance between two coordinates, without overflow.
+ *  @return       : |a - b| in 1e-7 degree
+ */
+/*****************************************************************************/
+static uint32_t api_ltegps_diff(int32_t a, int32_t b){
+
+	return (a > b) ? (uint32_t)a - (uint32_t)b : (uint32_t)b - (uint32_t)a;
+}
@@ -16,55 +16,154 @@
 #include "stdint.h"
 #include "string.h"
 #include "stdlib.h"
+#include "stddef.h"
 #include "stm32l476xx.h"
+#include "main.h"
 #include "api_wifi.h"
+#include "at_cmd.h"
 #include "uart.h"
+#include "power.h"
 /******************** DEFINE ENUMS and STRUCT ********************************/
 
 
 
 /******************** DEFINE GLOBAL VARIABLES  *******************************/
-uint8_t strAP_idx = 0;
+// Known APs, add entries here (SSID matched exactly)
+static const Wifi_Known wifi_known[] = {
+	{ "NETGEAR35 - 5G", "Doe" },
+	{ "Team_a_live",    "PassWord" },
+	{ "Trans 5G",       "2232portal" },
+};
 
-WiFi_Struct AP_1 = { "NETGEAR35 - 5G", "Doe" , RSSI_DEFAULT };
+#define WIFI_KNOWN_COUNT (sizeof(wifi_known) / sizeof(wifi_known[0]))
 
-WiFi_Struct AP_2 = { "Team_a_live", "PassWord", RSSI_DEFAULT };
+// Scan results, filled from the RX interrupt while the scan runs
+static Wifi_Scan wifi_scan;
 
-WiFi_Struct AP_3 = { "Trans 5G", "2232portal", RSSI_DEFAULT };
+// Link state survives between connect calls, power up starts from OFF
+static Wifi_Link wifi_link = { WIFI_LINK_OFF, 0, 0 };
+
+// Last AP joined, checked with api_wifi_cachevalid before use
+static Wifi_Cache wifi_cache SECTION_RETAINED;
+
+// Age of the scan results, lost on reset like the results themselves
+static uint32_t wifi_scan_tick  = 0;
+static uint8_t  wifi_scan_valid = 0;
+
+static char wifi_cmd[WIFI_CMD_MAX];	// Built command being sent
+
+static uint8_t wifi_sock = WIFI_SOCK_NONE;	// Module CID of the open socket
+
+// Socket of the module as a byte stream for the upload clients
+const Transport wifi_transport = {
+	api_wifi_sockopen,
+	api_wifi_socksend,
+	api_wifi_sockrecv,
+	api_wifi_sockclose,
+};
+
+// Final result codes of an AT command, OK first
+static const Uart_Pattern Resp_WIFI_Final[] = {
+	{ Resp_WIFI_OK,      sizeof(Resp_WIFI_OK) - 1 },
+	{ Resp_WIFI_ERROR,   sizeof(Resp_WIFI_ERROR) - 1 },
+};
+
+// Ping success or failure
+static const Uart_Pattern Resp_WIFI_PingFinal[] = {
+	{ Resp_WIFI_SUCCESS, sizeof(Resp_WIFI_SUCCESS) - 1 },
+	{ Resp_WIFI_ERROR,   sizeof(Resp_WIFI_ERROR) - 1 },
+};
+
+// Received data header or failure
+static const Uart_Pattern Resp_WIFI_RecvStart[] = {
+	{ Resp_WIFI_Recv,    sizeof(Resp_WIFI_Recv) - 1 },
+	{ Resp_WIFI_ERROR,   sizeof(Resp_WIFI_ERROR) - 1 },
+};
+
+// Separator between the length and the data
+static const Uart_Pattern Resp_WIFI_RecvSep[] = {
+	{ ",",               1 },
+};
 
-WiFi_Struct* AP_List_Known[3] = { &AP_1, &AP_2, &AP_3 };
 /******************** FUNCTION DECLARATION************************************/
 
+static char api_wifi_final(uint16_t test_cnt);
+static char api_wifi_linkcheck(void);
+static uint8_t api_wifi_scanfresh(void);
+static void api_wifi_scanstart(void);
+static void api_wifi_scanhook(void *ctx, const char *data, uint16_t size);
+static void api_wifi_scanfield(Wifi_Scan *scan);
+static void api_wifi_scanline(Wifi_Scan *scan);
+static void api_wifi_canddrop(void);
+static uint8_t api_wifi_ismac(const char *str);
+static uint8_t api_wifi_joincmd(uint8_t targeted);
+static uint32_t api_wifi_cachesum(const Wifi_Cache *cache);
+static uint8_t api_wifi_cachevalid(void);
+static void api_wifi_cachesave(void);
+static void api_wifi_cachedrop(void);
+static uint8_t api_wifi_ipscan(const char *str, uint16_t size);
+static uint8_t api_wifi_resolve(const char *host, char *ip);
+static void api_wifi_sockdrop(void);
+static void api_wifi_sockpad(uint16_t size);
+
 /******************** WI-FI APPLICATION FUNCTIONS START **********************/
 /*****************************************************************************/
 /*! @Function Name: api_wifi_connect
- *  @brief        : High level function to issue command sequence to allow
- *  				ping to google.com
+ *  @brief        : High level function to bring the link up so that ping to
+ *  				google.com works. Only the steps the link state needs
+ *  				are sent, an up link returns at once.
  *  @return       : pass or fail
  */
 /*****************************************************************************/
 char api_wifi_connect(void){
 
-	HAL_Delay(20);
-	if( api_wifi_echodisable() ){
-		return FAIL;
-	}
+	if(wifi_link.state == WIFI_LINK_JOINED){
 
-	HAL_Delay(20);
-	if( api_wifi_station() ){
-		return FAIL;
+		// Used recently, nothing to send
+		if(HAL_GetTick() - wifi_link.last_ok < WIFI_LINK_TTL){
+			return PASS;
+		}
+
+		if( api_wifi_linkcheck() == PASS ){
+			return PASS;
+		}
 	}
 
-	HAL_Delay(20);
-	if( api_wifi_scan() ){
-		return FAIL;
+	if(wifi_link.state == WIFI_LINK_OFF){
+
+		power_sleep(UART_DELAY);
+		if( api_wifi_echodisable() ){
+			return FAIL;
+		}
+
+		power_sleep(UART_DELAY);
+		if( api_wifi_station() ){
+			return FAIL;
+		}
+
+		wifi_link.state = WIFI_LINK_READY;
 	}
 
-	HAL_Delay(20);
-	if( api_wifi_known() ){
-		return FAIL;
+	// Cached AP first, a full scan only when that fails
+	if( api_wifi_join() ){
+
+		if( !api_wifi_scanfresh() ){
+			power_sleep(UART_DELAY);
+			if( api_wifi_scan() ){
+				return FAIL;
+			}
+		}
+
+		power_sleep(UART_DELAY);
+		if( api_wifi_known() ){
+			return FAIL;
+		}
 	}
 
+	wifi_link.state = WIFI_LINK_JOINED;
+	wifi_link.joins++;
+	api_wifi_linkok();
+
 	return PASS;
 }
 
@@ -76,21 +175,163 @@ char api_wifi_connect(void){
 /*****************************************************************************/
 char api_wifi_ping(void){
 
-	HAL_Delay(20);
+	uint8_t hit;
+
+	power_sleep(UART_DELAY);
 	LOG_BOX("SEND: Ping to www.google.com");
-	uart_tx(AT_ping, strlen(AT_ping), WIFI_UART);
+	uart_tx(&uart_wifi, AT_ping, strlen(AT_ping));
 
-	if( uart_rx_check(Resp_WIFI_SUCCESS, strlen(Resp_WIFI_SUCCESS), 10 * UART_1S_TIMEOUT) ){
+	hit = uart_rx_wait(&uart_wifi, Resp_WIFI_PingFinal, 2, 10 * UART_1S_TIMEOUT, NULL);
+	if( hit != 0 ){
 		LOG("ERROR: Packets returned unsuccessfully.\r\n");
-		uart_rx_print();
+		uart_rx_print(&uart_wifi);
+		api_wifi_linkdown((hit == UART_NO_MATCH) ? WIFI_LINK_OFF : WIFI_LINK_READY);
 		return FAIL;
 	}
 
-	uart_rx_print();
+	uart_rx_print(&uart_wifi);
+	api_wifi_linkok();
 	return PASS;
 
 }
 
+/*****************************************************************************/
+/*! @Function Name: api_wifi_task
+ *  @brief        : Scheduler task version of api_wifi_connect followed by
+ *  				api_wifi_ping. Yields while the module answers so other
+ *  				ports can run.
+ *  @return       : RR_RUNNING, RR_DONE or RR_FAILED
+ */
+/*****************************************************************************/
+char api_wifi_task(Rr_Task *task){
+
+	RR_BEGIN(task);
+
+	LOG_BOX("\r\nBeginning Wi-Fi connection sequence.\r\n");
+
+	// Module setup, once after power up or a silent module
+	if(wifi_link.state == WIFI_LINK_OFF){
+
+		RR_CMD(task, AT_echodisable, strlen(AT_echodisable), Resp_WIFI_Final, 2, RR_CMD_TIMEOUT);
+		if(task->hit){
+			RR_EXIT(task);
+		}
+
+		RR_SLEEP(task, UART_DELAY);
+		RR_CMD(task, AT_station, strlen(AT_station), Resp_WIFI_Final, 2, RR_CMD_TIMEOUT);
+		if(task->hit){
+			RR_EXIT(task);
+		}
+
+		wifi_link.state = WIFI_LINK_READY;
+	}
+
+	// Join, once after setup or a lost link. Cached AP first, no scan
+	if(wifi_link.state == WIFI_LINK_READY && api_wifi_cachevalid() && api_wifi_joincmd(1)){
+		api_wifi_cachedrop();
+	}
+
+	if(wifi_link.state == WIFI_LINK_READY && api_wifi_cachevalid()){
+
+		RR_SLEEP(task, UART_DELAY);
+		RR_CMD(task, wifi_cmd, strlen(wifi_cmd), Resp_WIFI_Final, 2, 6 * RR_CMD_TIMEOUT);
+		if(task->hit){
+			api_wifi_cachedrop();
+		}else{
+			wifi_link.state = WIFI_LINK_JOINED;
+			wifi_link.joins++;
+		}
+	}
+
+	// Strongest known AP, scanning only when the last results expired
+	if(wifi_link.state == WIFI_LINK_READY){
+
+		if( !api_wifi_scanfresh() ){
+
+			RR_SLEEP(task, UART_DELAY);
+			uart_tx(task->port, AT_scan, strlen(AT_scan));
+			api_wifi_scanstart();	// Results are parsed as they arrive
+			RR_WAIT_RESP(task, Resp_WIFI_Final, 2, 20 * RR_CMD_TIMEOUT);
+			if(task->hit){
+				uart_rx_hook(&uart_wifi, NULL, NULL);
+				RR_EXIT(task);
+			}
+
+			if( api_wifi_scanparse() ){
+				LOG("ERROR: Known AP(s) not found.\r\n");
+				RR_EXIT(task);
+			}
+		}
+
+		if( api_wifi_joincmd(0) ){
+			api_wifi_canddrop();
+			RR_EXIT(task);
+		}
+
+		RR_SLEEP(task, UART_DELAY);
+		RR_CMD(task, wifi_cmd, strlen(wifi_cmd), Resp_WIFI_Final, 2, 6 * RR_CMD_TIMEOUT);
+		if(task->hit){
+			api_wifi_canddrop();	// Next cycle tries the next candidate
+			RR_EXIT(task);
+		}
+
+		api_wifi_cachesave();
+		wifi_link.state = WIFI_LINK_JOINED;
+		wifi_link.joins++;
+	}
+
+	// The ping also tells if a joined link is still up
+	RR_SLEEP(task, UART_DELAY);
+	RR_CMD(task, AT_ping, strlen(AT_ping), Resp_WIFI_PingFinal, 2, 10 * RR_CMD_TIMEOUT);
+	if(task->hit){
+		LOG("ERROR: Packets returned unsuccessfully.\r\n");
+		api_wifi_linkdown((task->hit == UART_NO_MATCH) ? WIFI_LINK_OFF : WIFI_LINK_READY);
+		RR_EXIT(task);
+	}
+
+	api_wifi_linkok();
+
+	LOG_BOX("\r\nSUCCESS: Wi-Fi ping successful.\r\n");
+
+	RR_END(task);
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_linkstate
+ *  @brief        : Current link state.
+ *  @return       : WIFI_LINK_OFF, WIFI_LINK_READY or WIFI_LINK_JOINED
+ */
+/*****************************************************************************/
+uint8_t api_wifi_linkstate(void){
+
+	return wifi_link.state;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_linkok
+ *  @brief        : Marks a good exchange over the link (upload, ping), which
+ *  				saves the liveness probe for WIFI_LINK_TTL.
+ */
+/*****************************************************************************/
+void api_wifi_linkok(void){
+
+	wifi_link.last_ok = HAL_GetTick();
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_linkdown
+ *  @brief        : Lowers the link state after a failure, the next connect
+ *  				repeats the steps from there.
+ *  @param        : WIFI_LINK_OFF or WIFI_LINK_READY
+ */
+/*****************************************************************************/
+void api_wifi_linkdown(uint8_t state){
+
+	if(state < wifi_link.state){
+		wifi_link.state = state;
+	}
+}
+
 /******************** WI-FI APPLICATION FUNCTIONS END ************************/
 
 /******************** WI-FI API START ****************************************/
@@ -105,15 +346,14 @@ char api_wifi_ping(void){
 char api_wifi_station(void){
 
 	LOG_BOX("SEND: Setting to station mode");
-	uart_tx(AT_station, strlen(AT_station), WIFI_UART);
+	uart_tx(&uart_wifi, AT_station, strlen(AT_station));
 
-	if( uart_rx_check(Resp_WIFI_OK, strlen(Resp_WIFI_OK), UART_1S_TIMEOUT) ){
-		LOG("ERROR: No response.\r\n");
-		uart_rx_print();
+	if( api_wifi_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_wifi);
 		return FAIL;
 	}
 
-	uart_rx_print();
+	uart_rx_print(&uart_wifi);
 	return PASS;
 }
 
@@ -128,25 +368,24 @@ char api_wifi_station(void){
 char api_wifi_scan(void){
 
 	LOG_BOX("SEND: Scanning nearby APs");
-	uart_tx(AT_scan, strlen(AT_scan), WIFI_UART);
-
-	HAL_Delay(3000);
+	uart_tx(&uart_wifi, AT_scan, strlen(AT_scan));
+	api_wifi_scanstart();	// Results are parsed as they arrive
 
-	if( uart_rx_check(Resp_WIFI_OK, strlen(Resp_WIFI_OK), 20 * UART_1S_TIMEOUT) ){
-		LOG("ERROR: No response.\r\n");
-		uart_rx_print();
+	if( api_wifi_final(20 * UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_wifi);
+		uart_rx_hook(&uart_wifi, NULL, NULL);
 		return FAIL;
 	}
 
-	uart_rx_print();
+	uart_rx_print(&uart_wifi);
 
 	if( api_wifi_scanparse() ){
 		LOG("ERROR: Known AP(s) not found.\r\n");
-		uart_rx_print();
+		uart_rx_print(&uart_wifi);
 		return FAIL;
 	}else{
 		LOG("Known AP(s) found.\r\n");
-		uart_rx_print();
+		uart_rx_print(&uart_wifi);
 		return PASS;
 	}
 
@@ -162,54 +401,18 @@ char api_wifi_scan(void){
 char api_wifi_scanparse(void)
 {
 
-	char Status = FAIL;
-	char *str = NULL;
-	const char s[2] = ",";
-	char *token;
-	uint8_t i = 0;
-
-	str = rx_buff;
-
-	token = strtok(str, s);
+	uart_rx_hook(&uart_wifi, NULL, NULL);	// Takes in the last bytes, then stops
 
-	// get RSSI of known AP
-	while(token != NULL) {
+	api_wifi_scanhook(&wifi_scan, "\n", 1);	// Ends a last line without newline
 
-		// if token is an SSID
-		if(*token == '\"') {
-
-			// check if SSID is in known AP list
-			for(i = 0; i < AP_KNOWN_COUNT; i++) {
-
-				// nonzero if SSID match
-				if(strstr(token, AP_List_Known[i]->SSID)) {
-
-					// go to RSSI value
-					while (*token != '-') {
-						token = strtok(NULL, s);
-					}
-					// store RSSI value
-					token++;
-					AP_List_Known[i]->RSSI = atoi(token);
-					Status = PASS;	// Known AP found
-				}
-			}
-		}
-
-		// move to next token
-		token = strtok(NULL, s);
+	if(wifi_scan.count == 0) {
+		return FAIL;
 	}
 
-    // get index of strongest AP
-    for (i = 1; i < AP_KNOWN_COUNT; i++) {
-
-        if (AP_List_Known[strAP_idx]->RSSI > AP_List_Known[i]->RSSI) {
-            strAP_idx = i;
-        }
-
-    }
+	wifi_scan_tick  = HAL_GetTick();
+	wifi_scan_valid = 1;
 
-	return Status;
+	return PASS;
 }
 
 
@@ -222,16 +425,57 @@ char api_wifi_scanparse(void)
 /*****************************************************************************/
 char api_wifi_known(void){
 
-	LOG_BOX("SEND: Connecting to known AP");
-	uart_tx(AT_connect, strlen(AT_connect), WIFI_UART);
+	// Candidates strongest first, a failed one is dropped
+	while(wifi_scan.count){
+
+		LOG_BOX("SEND: Connecting to known AP");
+		if( api_wifi_joincmd(0) ){
+			api_wifi_canddrop();
+			continue;
+		}
+		uart_tx(&uart_wifi, wifi_cmd, strlen(wifi_cmd));
+
+		if( api_wifi_final(6 * UART_1S_TIMEOUT) == PASS ){
+			uart_rx_print(&uart_wifi);
+			api_wifi_cachesave();
+			return PASS;
+		}
 
-	if( uart_rx_check(Resp_WIFI_OK, strlen(Resp_WIFI_OK), 6 * UART_1S_TIMEOUT) ){
 		LOG("ERROR: Wi-Fi connection may already be established.\r\n");
-		uart_rx_print();
+		uart_rx_print(&uart_wifi);
+		api_wifi_canddrop();
+	}
+
+	return FAIL;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_join
+ *  @brief        : Targeted join of the cached AP (BSSID and channel given),
+ *  				no scan needed. Drops the cache on failure.
+ *  @return       : pass or fail (no cache or join failed)
+ */
+/*****************************************************************************/
+char api_wifi_join(void){
+
+	if( !api_wifi_cachevalid() ){
 		return FAIL;
 	}
 
-	uart_rx_print();
+	LOG_BOX("SEND: Joining cached AP");
+	if( api_wifi_joincmd(1) ){
+		api_wifi_cachedrop();
+		return FAIL;
+	}
+	uart_tx(&uart_wifi, wifi_cmd, strlen(wifi_cmd));
+
+	if( api_wifi_final(6 * UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_wifi);
+		api_wifi_cachedrop();
+		return FAIL;
+	}
+
+	uart_rx_print(&uart_wifi);
 	return PASS;
 }
 
@@ -244,15 +488,14 @@ char api_wifi_known(void){
 char api_wifi_echodisable(void){
 
 	LOG_BOX("SEND: Disabling echo");
-	uart_tx(AT_echodisable, strlen(AT_echodisable), WIFI_UART);
+	uart_tx(&uart_wifi, AT_echodisable, strlen(AT_echodisable));
 
-	if( uart_rx_check(Resp_WIFI_OK, strlen(Resp_WIFI_OK), UART_1S_TIMEOUT) ){
-		LOG("ERROR: No response.\r\n");
-		uart_rx_print();
+	if( api_wifi_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_wifi);
 		return FAIL;
 	}
 
-	uart_rx_print();
+	uart_rx_print(&uart_wifi);
 	return PASS;
 }
 
@@ -265,15 +508,691 @@ char api_wifi_echodisable(void){
 char api_wifi_check(void){
 
 	LOG_BOX("SEND: Checking response");
-	uart_tx(AT_check, strlen(AT_check), WIFI_UART);
+	uart_tx(&uart_wifi, AT_check, strlen(AT_check));
 
-	if( uart_rx_check(Resp_WIFI_OK, strlen(Resp_WIFI_OK), UART_1S_TIMEOUT) ){
-		LOG("ERROR: No response.\r\n");
-		uart_rx_print();
+	if( api_wifi_final(UART_1S_TIMEOUT) ){
+		uart_rx_print(&uart_wifi);
 		return FAIL;
 	}
 
-	uart_rx_print();
+	uart_rx_print(&uart_wifi);
 	return PASS;
 }
 /******************** WI-FI API END ******************************************/
+
+/******************** WI-FI SOCKET START *************************************/
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_sockopen
+ *  @brief        : Opens the module socket to host, resolving the name
+ *  				first unless it is an IPv4 address. An open socket is
+ *  				closed first.
+ *  @param        : Host name or IP, port, 1 for TLS
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+uint8_t api_wifi_sockopen(const char *host, uint16_t port, uint8_t tls){
+
+	char ip[16];
+	uint16_t i;
+	uint8_t cid = 0;
+	At_Cmd cmd;
+
+	api_wifi_sockclose();
+
+	if( api_wifi_resolve(host, ip) ){
+		return FAIL;
+	}
+
+	LOG_BOX("SEND: Opening socket");
+	at_cmd_start(&cmd, wifi_cmd, sizeof(wifi_cmd), tls ? AT_tlsopen : AT_sockopen);
+	at_cmd_raw(&cmd, ip);
+	at_cmd_uint(&cmd, port);
+	if( at_cmd_end(&cmd) ){
+		return FAIL;
+	}
+
+	uart_tx(&uart_wifi, wifi_cmd, strlen(wifi_cmd));
+
+	if( api_wifi_final(WIFI_SOCK_TIMEOUT / UART_DELAY) ){
+		uart_rx_print(&uart_wifi);
+		return FAIL;
+	}
+
+	uart_rx_print(&uart_wifi);
+
+	// CID follows the colon of the reply
+	i = uart_rx_find(&uart_wifi, ":", 1);
+	if(i == 0){
+		return FAIL;
+	}
+
+	for(; uart_wifi.rx_buff[i] >= '0' && uart_wifi.rx_buff[i] <= '9'; i++){
+		cid = cid * 10 + (uart_wifi.rx_buff[i] - '0');
+	}
+
+	wifi_sock = cid;
+	api_wifi_linkok();
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_socksend
+ *  @brief        : Sends data over the open socket, WIFI_SOCK_CHUNK bytes per
+ *  				command. The data follows the command line directly.
+ *  @param        : Data, size
+ *  @return       : pass or fail (socket is dropped)
+ */
+/*****************************************************************************/
+uint8_t api_wifi_socksend(const uint8_t *data, uint16_t size){
+
+	uint16_t n;
+	At_Cmd cmd;
+
+	if(wifi_sock == WIFI_SOCK_NONE){
+		return FAIL;
+	}
+
+	while(size){
+
+		n = (size < WIFI_SOCK_CHUNK) ? size : WIFI_SOCK_CHUNK;
+
+		at_cmd_start(&cmd, wifi_cmd, sizeof(wifi_cmd), AT_socksend);
+		at_cmd_uint(&cmd, wifi_sock);
+		at_cmd_uint(&cmd, n);
+		at_cmd_end(&cmd);
+
+		if( uart_tx(&uart_wifi, wifi_cmd, strlen(wifi_cmd)) ){
+			LOG("ERROR: Socket send not queued.\r\n");
+			api_wifi_sockdrop();
+			return FAIL;
+		}
+
+		// The module now takes the next n bytes as data, whatever they are
+		while( uart_tx_busy(&uart_wifi) == TX_BUSY );
+		if( uart_tx_submit(&uart_wifi, (const char*)data, n, NULL, NULL, NULL) ){
+			LOG("ERROR: Socket send not queued.\r\n");
+			api_wifi_sockpad(n);	// Module takes commands again after n bytes
+			api_wifi_sockclose();
+			return FAIL;
+		}
+
+		if( api_wifi_final(WIFI_SOCK_TIMEOUT / UART_DELAY) ){
+			LOG("ERROR: Socket send failed.\r\n");
+			uart_rx_print(&uart_wifi);
+			api_wifi_sockdrop();
+			return FAIL;
+		}
+
+		data += n;
+		size -= n;
+	}
+
+	api_wifi_linkok();
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_sockrecv
+ *  @brief        : Reads data from the open socket. The module is polled
+ *  				every WIFI_SOCK_POLL ms until data is there or timeout
+ *  				ms pass. The data is taken by length, so it may hold
+ *  				any bytes.
+ *  @param        : Buffer, size, timeout in ms
+ *  @return       : bytes read, 0 on timeout or TRANSPORT_CLOSED
+ */
+/*****************************************************************************/
+int16_t api_wifi_sockrecv(uint8_t *data, uint16_t size, uint32_t timeout){
+
+	uint32_t start = HAL_GetTick();
+	uint16_t head, sep, n, i;
+	At_Cmd cmd;
+
+	if(wifi_sock == WIFI_SOCK_NONE){
+		return TRANSPORT_CLOSED;
+	}
+
+	if(size > WIFI_SOCK_CHUNK){
+		size = WIFI_SOCK_CHUNK;
+	}
+
+	while(1){
+
+		at_cmd_start(&cmd, wifi_cmd, sizeof(wifi_cmd), AT_sockrecv);
+		at_cmd_uint(&cmd, wifi_sock);
+		at_cmd_uint(&cmd, size);
+		at_cmd_end(&cmd);
+
+		uart_tx(&uart_wifi, wifi_cmd, strlen(wifi_cmd));
+
+		if( uart_rx_wait(&uart_wifi, Resp_WIFI_RecvStart, 2, WIFI_SOCK_TIMEOUT / UART_DELAY, &head) != 0 ||
+			uart_rx_wait(&uart_wifi, Resp_WIFI_RecvSep, 1, UART_1S_TIMEOUT, &sep) != 0 ){
+			LOG("ERROR: Socket closed.\r\n");
+			uart_rx_print(&uart_wifi);
+			api_wifi_sockdrop();
+			return TRANSPORT_CLOSED;
+		}
+
+		for(n = 0, i = head; i < sep - 1; i++){
+			n = n * 10 + (uart_wifi.rx_buff[i] - '0');
+		}
+
+		if(n > size){
+			api_wifi_sockdrop();
+			return TRANSPORT_CLOSED;
+		}
+
+		// Data and the final result, counted since OK may be in the data
+		uart_rx_count(&uart_wifi, sep + n + sizeof(Resp_WIFI_RecvEnd) - 1);
+		if( power_wait(&uart_wifi.match_hit, UART_NO_MATCH, WIFI_SOCK_TIMEOUT) ){
+			api_wifi_sockdrop();
+			return TRANSPORT_CLOSED;
+		}
+
+		if(n){
+			memcpy(data, &uart_wifi.rx_buff[sep], n);
+			api_wifi_linkok();
+			return n;
+		}
+
+		if(HAL_GetTick() - start >= timeout){
+			return 0;
+		}
+
+		power_sleep(WIFI_SOCK_POLL);
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_sockclose
+ *  @brief        : Closes the open socket, if any.
+ */
+/*****************************************************************************/
+void api_wifi_sockclose(void){
+
+	At_Cmd cmd;
+
+	if(wifi_sock == WIFI_SOCK_NONE){
+		return;
+	}
+
+	LOG_BOX("SEND: Closing socket");
+	at_cmd_start(&cmd, wifi_cmd, sizeof(wifi_cmd), AT_sockclose);
+	at_cmd_uint(&cmd, wifi_sock);
+	at_cmd_end(&cmd);
+
+	uart_tx(&uart_wifi, wifi_cmd, strlen(wifi_cmd));
+	api_wifi_final(UART_1S_TIMEOUT);	// Closed either way
+	uart_rx_print(&uart_wifi);
+
+	wifi_sock = WIFI_SOCK_NONE;
+}
+
+/******************** WI-FI SOCKET END ***************************************/
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_linkcheck
+ *  @brief        : Liveness probe of a joined link, a single ping. No answer
+ *  				means the module itself has to be set up again, an
+ *  				error that the AP has to be joined again.
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+static char api_wifi_linkcheck(void){
+
+	LOG_BOX("SEND: Checking Wi-Fi link");
+	uart_tx(&uart_wifi, AT_linkcheck, strlen(AT_linkcheck));
+
+	switch( uart_rx_wait(&uart_wifi, Resp_WIFI_PingFinal, 2, 3 * UART_1S_TIMEOUT, NULL) ){
+
+	case 0:
+		api_wifi_linkok();
+		return PASS;
+
+	case UART_NO_MATCH:
+		LOG("ERROR: No response.\r\n");
+		api_wifi_linkdown(WIFI_LINK_OFF);
+		return FAIL;
+
+	default:
+		LOG("ERROR: Wi-Fi link lost.\r\n");
+		api_wifi_linkdown(WIFI_LINK_READY);
+		return FAIL;
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_final
+ *  @brief        : Waits for the final result code of the last command. An
+ *  				ERROR ends the wait as soon as it arrives.
+ *  @param        : timeout in UART_DELAY units
+ *  @return       : pass on OK, fail on error response or timeout
+ */
+/*****************************************************************************/
+static char api_wifi_final(uint16_t test_cnt){
+
+	switch( uart_rx_wait(&uart_wifi, Resp_WIFI_Final, 2, test_cnt, NULL) ){
+
+	case 0:
+		return PASS;
+
+	case UART_NO_MATCH:
+		LOG("ERROR: No response.\r\n");
+		return FAIL;
+
+	default:
+		LOG("ERROR: Command rejected.\r\n");
+		return FAIL;
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_scanfresh
+ *  @brief        : Check if the candidates of the last scan are still
+ *  				within WIFI_SCAN_TTL.
+ *  @return       : 1 when fresh, else 0
+ */
+/*****************************************************************************/
+static uint8_t api_wifi_scanfresh(void){
+
+	return (wifi_scan_valid && wifi_scan.count && HAL_GetTick() - wifi_scan_tick < WIFI_SCAN_TTL) ? 1 : 0;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_joincmd
+ *  @brief        : Builds the join command in wifi_cmd. A targeted join
+ *  				adds the BSSID and channel of the cached AP, else the
+ *  				strongest candidate of the last scan is used.
+ *  @param        : 1 for the cached AP, 0 for the strongest
+ *  @return       : pass, or fail when the SSID and passphrase do not fit
+ */
+/*****************************************************************************/
+static uint8_t api_wifi_joincmd(uint8_t targeted){
+
+	const Wifi_Known *ap = &wifi_known[targeted ? wifi_cache.ap : wifi_scan.cand[0].known];
+	At_Cmd cmd;
+
+	at_cmd_start(&cmd, wifi_cmd, sizeof(wifi_cmd), AT_connect);
+	at_cmd_uint(&cmd, 1);
+	at_cmd_str(&cmd, ap->ssid);
+	at_cmd_str(&cmd, ap->password);
+
+	if(targeted){
+		at_cmd_str(&cmd, wifi_cache.bssid);
+		at_cmd_uint(&cmd, wifi_cache.channel);
+	}
+
+	return at_cmd_end(&cmd);
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_cachesum
+ *  @brief        : Checksum of the cache fields before check
+ */
+/*****************************************************************************/
+static uint32_t api_wifi_cachesum(const Wifi_Cache *cache){
+
+	const uint8_t *p = (const uint8_t*)cache;
+	uint32_t sum = 0x5A5A5A5A;
+	uint16_t i;
+
+	for(i = 0; i < offsetof(Wifi_Cache, check); i++){
+		sum = (sum << 1 | sum >> 31) + p[i];	// Rotate and add, catches swapped bytes
+	}
+
+	return sum;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_cachevalid
+ *  @brief        : Check the retained cache, which holds random data after
+ *  				power up.
+ *  @return       : 1 when a targeted join can be tried, else 0
+ */
+/*****************************************************************************/
+static uint8_t api_wifi_cachevalid(void){
+
+	return (wifi_cache.magic == WIFI_CACHE_MAGIC &&
+			wifi_cache.check == api_wifi_cachesum(&wifi_cache) &&
+			wifi_cache.ap < WIFI_KNOWN_COUNT &&
+			wifi_cache.channel != 0 &&
+			api_wifi_ismac(wifi_cache.bssid) &&
+			wifi_cache.bssid[17] == '\0') ? 1 : 0;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_cachesave
+ *  @brief        : Stores the candidate just joined. APs without BSSID or
+ *  				channel in the scan are not cached.
+ */
+/*****************************************************************************/
+static void api_wifi_cachesave(void){
+
+	Wifi_Cand *ap = &wifi_scan.cand[0];
+
+	if(wifi_scan.count == 0 || ap->bssid[0] == '\0' || ap->channel == 0){
+		wifi_cache.magic = 0;
+		return;
+	}
+
+	memset(&wifi_cache, 0, sizeof(wifi_cache));
+	wifi_cache.magic   = WIFI_CACHE_MAGIC;
+	wifi_cache.ap      = ap->known;
+	wifi_cache.channel = ap->channel;
+	wifi_cache.rssi    = ap->rssi;
+	memcpy(wifi_cache.bssid, ap->bssid, sizeof(wifi_cache.bssid));
+	wifi_cache.check   = api_wifi_cachesum(&wifi_cache);
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_cachedrop
+ *  @brief        : Forgets the cached AP after a failed targeted join. The
+ *  				scan results are likely stale too.
+ */
+/*****************************************************************************/
+static void api_wifi_cachedrop(void){
+
+	wifi_cache.magic = 0;
+	wifi_scan_valid  = 0;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_scanstart
+ *  @brief        : Clears the scan results and hooks the parser to the
+ *  				Wi-Fi port. Called right after the scan command is sent.
+ */
+/*****************************************************************************/
+static void api_wifi_scanstart(void){
+
+	memset(&wifi_scan, 0, sizeof(wifi_scan));
+	wifi_scan_valid = 0;
+
+	uart_rx_hook(&uart_wifi, api_wifi_scanhook, &wifi_scan);
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_scanhook
+ *  @brief        : Scan parser, runs in the RX interrupt on each received
+ *  				byte range. Fields are split at commas outside quotes,
+ *  				each line is judged at its newline. rx_buff is only read.
+ */
+/*****************************************************************************/
+static void api_wifi_scanhook(void *ctx, const char *data, uint16_t size){
+
+	Wifi_Scan *scan = (Wifi_Scan*)ctx;
+	uint16_t i;
+	char c;
+
+	for(i = 0; i < size; i++){
+
+		c = data[i];
+
+		if(c == '\n'){
+			scan->quoted = 0;	// Quotes never span lines
+			api_wifi_scanfield(scan);
+			api_wifi_scanline(scan);
+		}else if(c == '\"'){
+			scan->quoted ^= 1;
+			scan->wasquoted = 1;
+		}else if(c == ',' && !scan->quoted){
+			api_wifi_scanfield(scan);
+		}else if(c != '\r' || scan->quoted){
+			if(scan->len <= WIFI_SSID_MAX){
+				scan->field[scan->len++] = c;
+			}
+		}
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_scanfield
+ *  @brief        : Sorts a finished field of the line. A MAC address is the
+ *  				BSSID, the first quoted field the SSID, a negative number
+ *  				the RSSI and the last plain number before it the channel.
+ */
+/*****************************************************************************/
+static void api_wifi_scanfield(Wifi_Scan *scan){
+
+	uint8_t i, digits;
+	uint16_t value = 0;
+	char *f = scan->field;
+
+	scan->field[(scan->len <= WIFI_SSID_MAX) ? scan->len : WIFI_SSID_MAX + 1] = '\0';
+
+	// Numbers, with the sign for RSSI
+	for(i = (f[0] == '-') ? 1 : 0, digits = 0; i < scan->len && f[i] >= '0' && f[i] <= '9'; i++, digits++){
+		value = value * 10 + (f[i] - '0');
+	}
+
+	if(scan->len == 17 && api_wifi_ismac(f)){
+		memcpy(scan->line.bssid, f, 18);
+
+	}else if(scan->wasquoted && !scan->ssid){
+
+		scan->ssid = 1;
+		scan->line.known = WIFI_KNOWN_NONE;
+
+		for(i = 0; i < WIFI_KNOWN_COUNT; i++){
+			if(scan->len <= WIFI_SSID_MAX && strcmp(f, wifi_known[i].ssid) == 0){
+				scan->line.known = i;	// Exact match only
+				break;
+			}
+		}
+
+	}else if(scan->ssid && digits && i == scan->len && scan->line.rssi == 0){
+
+		if(f[0] == '-'){
+			scan->line.rssi = (value > 0xFF || value == 0) ? 0xFF : value;
+		}else{
+			scan->line.channel = (value > 0xFF) ? 0 : value;
+		}
+	}
+
+	scan->len       = 0;
+	scan->wasquoted = 0;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_scanline
+ *  @brief        : Ends a line. A known AP with an RSSI is inserted into the
+ *  				candidate list by RSSI, the weakest falls off a full list.
+ *  				The same BSSID is kept once.
+ */
+/*****************************************************************************/
+static void api_wifi_scanline(Wifi_Scan *scan){
+
+	uint8_t i, pos;
+
+	if(scan->ssid && scan->line.known != WIFI_KNOWN_NONE && scan->line.rssi){
+
+		// Drop a weaker report of the same AP
+		for(i = 0; i < scan->count; i++){
+			if(scan->line.bssid[0] && strcmp(scan->cand[i].bssid, scan->line.bssid) == 0){
+				if(scan->cand[i].rssi <= scan->line.rssi){
+					break;
+				}
+				memmove(&scan->cand[i], &scan->cand[i + 1], (scan->count - i - 1) * sizeof(Wifi_Cand));
+				scan->count--;
+			}
+		}
+
+		if(i == scan->count){
+
+			for(pos = 0; pos < scan->count && scan->cand[pos].rssi <= scan->line.rssi; pos++);
+
+			if(pos < WIFI_CAND_MAX){
+				if(scan->count == WIFI_CAND_MAX){
+					scan->count--;
+				}
+				memmove(&scan->cand[pos + 1], &scan->cand[pos], (scan->count - pos) * sizeof(Wifi_Cand));
+				scan->cand[pos] = scan->line;
+				scan->count++;
+			}
+		}
+	}
+
+	memset(&scan->line, 0, sizeof(scan->line));
+	scan->ssid = 0;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_canddrop
+ *  @brief        : Removes the strongest candidate after its join failed.
+ *  				With none left the next join scans again.
+ */
+/*****************************************************************************/
+static void api_wifi_canddrop(void){
+
+	if(wifi_scan.count == 0){
+		return;
+	}
+
+	wifi_scan.count--;
+	memmove(&wifi_scan.cand[0], &wifi_scan.cand[1], wifi_scan.count * sizeof(Wifi_Cand));
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_ismac
+ *  @brief        : Check for a MAC address, xx:xx:xx:xx:xx:xx
+ *  @return       : 1 when str starts with one, else 0
+ */
+/*****************************************************************************/
+static uint8_t api_wifi_ismac(const char *str){
+
+	uint8_t i;
+	char c;
+
+	for(i = 0; i < 17; i++){
+		c = str[i];
+		if(i % 3 == 2){
+			if(c != ':'){
+				return 0;
+			}
+		}else if(!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'))){
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_ipscan
+ *  @brief        : Check for an IPv4 address, ddd.ddd.ddd.ddd
+ *  @return       : its length when str starts with one, else 0
+ */
+/*****************************************************************************/
+static uint8_t api_wifi_ipscan(const char *str, uint16_t size){
+
+	uint8_t i = 0, part, digits;
+
+	for(part = 0; part < 4; part++){
+
+		if(part){
+			if(i >= size || str[i] != '.'){
+				return 0;
+			}
+			i++;
+		}
+
+		for(digits = 0; i < size && digits < 3 && str[i] >= '0' && str[i] <= '9'; digits++){
+			i++;
+		}
+
+		if(digits == 0){
+			return 0;
+		}
+	}
+
+	return i;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_resolve
+ *  @brief        : Resolves host with the module DNS lookup, an IPv4 address
+ *  				is copied as is.
+ *  @param        : Host name or IP, ip receives the address (16 bytes)
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+static uint8_t api_wifi_resolve(const char *host, char *ip){
+
+	uint16_t i, n = strlen(host);
+	char *buff = uart_wifi.rx_buff;
+	At_Cmd cmd;
+
+	if(n < 16 && api_wifi_ipscan(host, n) == n){
+		memcpy(ip, host, n + 1);
+		return PASS;
+	}
+
+	LOG_BOX("SEND: Resolving host");
+	at_cmd_start(&cmd, wifi_cmd, sizeof(wifi_cmd), AT_dnslookup);
+	at_cmd_str(&cmd, host);
+	if( at_cmd_end(&cmd) ){
+		return FAIL;
+	}
+
+	uart_tx(&uart_wifi, wifi_cmd, strlen(wifi_cmd));
+
+	if( api_wifi_final(WIFI_SOCK_TIMEOUT / UART_DELAY) ){
+		uart_rx_print(&uart_wifi);
+		return FAIL;
+	}
+
+	uart_rx_print(&uart_wifi);
+
+	// First address in the reply
+	for(i = 0; i < uart_wifi.rx_idx; i++){
+
+		if(i && ((buff[i - 1] >= '0' && buff[i - 1] <= '9') || buff[i - 1] == '.')){
+			continue;
+		}
+
+		n = api_wifi_ipscan(&buff[i], uart_wifi.rx_idx - i);
+		if(n){
+			memcpy(ip, &buff[i], n);
+			ip[n] = '\0';
+			return PASS;
+		}
+	}
+
+	return FAIL;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_sockdrop
+ *  @brief        : Forgets a socket the module reported as failed.
+ */
+/*****************************************************************************/
+static void api_wifi_sockdrop(void){
+
+	wifi_sock = WIFI_SOCK_NONE;
+}
+
+/*****************************************************************************/
+/*! @Function Name: api_wifi_sockpad
+ *  @brief        : Sends size filler bytes in place of a payload that could
+ *  				not be queued, so the module ends the send command and
+ *  				does not take the next command as data. The socket must
+ *  				be closed after it.
+ *  @param        : Payload size announced in the send command
+ */
+/*****************************************************************************/
+static void api_wifi_sockpad(uint16_t size){
+
+	static const char pad[64] = { 0 };
+	uint16_t n;
+
+	while(size){
+
+		n = (size < sizeof(pad)) ? size : sizeof(pad);
+
+		while( uart_tx_busy(&uart_wifi) == TX_BUSY );
+		if( uart_tx_submit(&uart_wifi, pad, n, NULL, NULL, NULL) == PASS ){
+			size -= n;
+		}
+	}
+
+	api_wifi_final(WIFI_SOCK_TIMEOUT / UART_DELAY);
+}
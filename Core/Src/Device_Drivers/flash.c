@@ -0,0 +1,195 @@
+/*****************************************************************************/
+/*!
+ * @project    EcoSense
+ * @file       flash.c
+ * @author     Long Tran
+ * @version    0.0.1
+ * @brief	   Flash record storage
+ * @date       28/July/2021
+ * @bug        NA
+
+ * @note       Programming is done a double word at a time, the tail of a
+ * 			   record is padded with 0xFF.
+ */
+/*****************************************************************************/
+
+/******************** INCLUDE FILES ******************************************/
+#include "stdint.h"
+#include "string.h"
+#include "flash.h"
+#include "uart.h"
+#include "stm32l4xx_hal.h"
+
+/******************** DEFINE MACROS ******************************************/
+
+#define FLASH_SR_ERRORS (FLASH_SR_OPERR | FLASH_SR_PROGERR | FLASH_SR_WRPERR | FLASH_SR_PGAERR | \
+						 FLASH_SR_SIZERR | FLASH_SR_PGSERR | FLASH_SR_MISERR | FLASH_SR_FASTERR)
+
+/******************** EXTERN VARIABLES ***************************************/
+
+extern uint8_t _snvdata[];	// NVDATA region start, from the linker script
+
+/******************** STATIC FUNCTION DECLARATION*****************************/
+
+static uint32_t flash_nv_addr(uint8_t page);
+static void flash_unlock(void);
+static void flash_lock(void);
+static uint8_t flash_done(void);
+
+/******************** FUNCTION DECLARATION************************************/
+
+/*****************************************************************************/
+/*! @fn       flash_nv_read
+ *  @brief    Copies a record out of its NVDATA page.
+ *  @param    Page, record, record size (page size max)
+ */
+/*****************************************************************************/
+void flash_nv_read(uint8_t page, void *data, uint32_t size){
+
+	memcpy(data, (const void*)flash_nv_addr(page), size);
+}
+
+/*****************************************************************************/
+/*! @fn       flash_nv_write
+ *  @brief    Erases a NVDATA page and programs a record into it. Skipped
+ *  		  when the page already holds the same bytes, to save erase
+ *  		  cycles.
+ *  @param    Page, record, record size (page size max)
+ *  @return   pass or fail
+ */
+/*****************************************************************************/
+uint8_t flash_nv_write(uint8_t page, const void *data, uint32_t size){
+
+	uint32_t addr = flash_nv_addr(page);
+	const uint8_t *src = (const uint8_t*)data;
+	uint32_t word[2];
+	uint32_t i, n;
+
+	if(page >= FLASH_NV_COUNT || size > FLASH_PAGE_SIZE){
+		return FAIL;
+	}
+
+	if(memcmp((const void*)addr, data, size) == 0){
+		return PASS;
+	}
+
+	if( flash_nv_erase(page) ){
+		return FAIL;
+	}
+
+	flash_unlock();
+	FLASH->CR |= FLASH_CR_PG;
+
+	for(i = 0; i < size; i += 8){
+
+		n = (size - i < 8) ? size - i : 8;
+		word[0] = word[1] = 0xFFFFFFFF;
+		memcpy(word, &src[i], n);
+
+		*(volatile uint32_t*)(addr + i)     = word[0];
+		*(volatile uint32_t*)(addr + i + 4) = word[1];
+
+		if( flash_done() ){
+			break;
+		}
+	}
+
+	FLASH->CR &= ~FLASH_CR_PG;
+	flash_lock();
+
+	return (i >= size && memcmp((const void*)addr, data, size) == 0) ? PASS : FAIL;
+}
+
+/*****************************************************************************/
+/*! @fn       flash_nv_erase
+ *  @brief    Erases a NVDATA page, dropping its record.
+ *  @return   pass or fail
+ */
+/*****************************************************************************/
+uint8_t flash_nv_erase(uint8_t page){
+
+	uint32_t offset;
+	uint8_t Status;
+
+	if(page >= FLASH_NV_COUNT){
+		return FAIL;
+	}
+
+	offset = flash_nv_addr(page) - FLASH_BASE;
+
+	flash_unlock();
+
+	FLASH->CR = (FLASH->CR & ~(FLASH_CR_PNB | FLASH_CR_BKER)) | FLASH_CR_PER |
+				(((offset % FLASH_BANK_SIZE) / FLASH_PAGE_SIZE) << FLASH_CR_PNB_Pos) |
+				((offset >= FLASH_BANK_SIZE) ? FLASH_CR_BKER : 0);
+	FLASH->CR |= FLASH_CR_STRT;
+
+	Status = flash_done();
+
+	FLASH->CR &= ~(FLASH_CR_PER | FLASH_CR_PNB | FLASH_CR_BKER);
+
+	// Stale data cache lines of the page would read back the old record
+	FLASH->ACR &= ~FLASH_ACR_DCEN;
+	FLASH->ACR |= FLASH_ACR_DCRST;
+	FLASH->ACR &= ~FLASH_ACR_DCRST;
+	FLASH->ACR |= FLASH_ACR_DCEN;
+
+	flash_lock();
+
+	return Status;
+}
+
+/*****************************************************************************/
+/*! @Function Name: flash_nv_addr
+ *  @brief        : Address of a NVDATA page.
+ */
+/*****************************************************************************/
+static uint32_t flash_nv_addr(uint8_t page){
+
+	return (uint32_t)_snvdata + (uint32_t)page * FLASH_PAGE_SIZE;
+}
+
+/*****************************************************************************/
+/*! @Function Name: flash_unlock
+ *  @brief        : Unlocks FLASH->CR and clears old error flags.
+ */
+/*****************************************************************************/
+static void flash_unlock(void){
+
+	while(FLASH->SR & FLASH_SR_BSY);
+
+	if(FLASH->CR & FLASH_CR_LOCK){
+		FLASH->KEYR = FLASH_KEY1;
+		FLASH->KEYR = FLASH_KEY2;
+	}
+
+	FLASH->SR = FLASH_SR_ERRORS | FLASH_SR_EOP;
+}
+
+/*****************************************************************************/
+/*! @Function Name: flash_lock
+ *  @brief        : Locks FLASH->CR again.
+ */
+/*****************************************************************************/
+static void flash_lock(void){
+
+	FLASH->CR |= FLASH_CR_LOCK;
+}
+
+/*****************************************************************************/
+/*! @Function Name: flash_done
+ *  @brief        : Waits for the running operation to end.
+ *  @return       : pass, or fail on an error flag
+ */
+/*****************************************************************************/
+static uint8_t flash_done(void){
+
+	while(FLASH->SR & FLASH_SR_BSY);
+
+	if(FLASH->SR & FLASH_SR_ERRORS){
+		FLASH->SR = FLASH_SR_ERRORS;
+		return FAIL;
+	}
+
+	return PASS;
+}
@@ -0,0 +1,346 @@
+/*****************************************************************************/
+/*!
+ * @project    EcoSense
+ * @file       power.c
+ * @author     Long Tran
+ * @version    0.0.1
+ * @brief	   Low power wait handler
+ * @date       28/July/2021
+ * @bug        NA
+
+ * @note       SysTick is suspended while the core sleeps and uwTick is
+ * 			   advanced by the time measured on the wake timer, so
+ * 			   HAL_GetTick stays valid across sleeps.
+ */
+/*****************************************************************************/
+
+/******************** INCLUDE FILES ******************************************/
+#include "stdint.h"
+#include "power.h"
+#include "uart.h"
+#include "stm32l4xx_hal.h"
+
+/******************** STATIC FUNCTION DECLARATION*****************************/
+
+static uint32_t power_lptim_count(void);
+static uint32_t power_tick_add(uint32_t ticks);
+static uint32_t power_stop_enter(uint32_t ms, uint8_t stop2);
+
+/******************** STATIC VARIABLES ***************************************/
+
+static uint32_t power_tick_frac = 0;	// Slept time below 1 ms not yet in uwTick, POWER_TIM_HZ ticks
+
+/******************** EXTERN FUNCTION ****************************************/
+
+extern void SystemClock_Config(void);
+
+/******************** FUNCTION DECLARATION************************************/
+
+/*****************************************************************************/
+/*! @fn       power_init
+ *  @brief    Sets up the TIM7 (sleep) and LPTIM1 (Stop 2) wake timers.
+ *  		  Called once after SystemClock_Config.
+ */
+/*****************************************************************************/
+void power_init(void){
+
+	// TIM7: one pulse, 0.1 ms tick, only counter overflow raises update
+	RCC->APB1ENR1 |= RCC_APB1ENR1_TIM7EN;
+	TIM7->CR1  = TIM_CR1_OPM | TIM_CR1_URS;
+	TIM7->PSC  = SystemCoreClock / POWER_TIM_HZ - 1;
+	TIM7->EGR  = TIM_EGR_UG;	// Load prescaler
+	TIM7->SR   = 0;
+	TIM7->DIER = TIM_DIER_UIE;
+
+	HAL_NVIC_SetPriority(TIM7_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(TIM7_IRQn);
+
+	// LPTIM1: LSI / 32 = 1 kHz, runs in Stop 2
+	RCC->CSR |= RCC_CSR_LSION;
+	while(!(RCC->CSR & RCC_CSR_LSIRDY));	// Wait until LSI is stable
+
+	RCC->CCIPR = (RCC->CCIPR & ~RCC_CCIPR_LPTIM1SEL) | (1U << RCC_CCIPR_LPTIM1SEL_Pos);
+	RCC->APB1ENR1 |= RCC_APB1ENR1_LPTIM1EN;
+
+	LPTIM1->CR   = 0;	// CFGR and IER are written with the timer disabled
+	LPTIM1->CFGR = 5U << LPTIM_CFGR_PRESC_Pos;
+	LPTIM1->IER  = LPTIM_IER_ARRMIE;
+
+	EXTI->IMR2 |= EXTI_IMR2_IM32;	// LPTIM1 wakeup line
+	RCC->CFGR  |= RCC_CFGR_STOPWUCK;	// Wake from Stop on HSI16, the PLL source
+
+	HAL_NVIC_SetPriority(LPTIM1_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(LPTIM1_IRQn);
+}
+
+/*****************************************************************************/
+/*! @fn       power_wait
+ *  @brief    Sleeps until *event no longer equals idle or timeout ms pass.
+ *  		  *event must be changed from interrupt context (UART, DMA).
+ *  		  Interrupts are masked around WFI so an event raised just
+ *  		  before sleeping still wakes the core, then run on unmask.
+ *  @param    Event to wait on, its idle value, timeout in ms
+ *  @return   pass when the event fired, fail on timeout
+ */
+/*****************************************************************************/
+uint8_t power_wait(volatile uint8_t *event, uint8_t idle, uint32_t timeout){
+
+	uint32_t primask;
+	uint32_t chunk;
+	uint32_t slept;
+
+	while(1){
+
+		if(*event != idle){
+			return PASS;
+		}
+
+		if(timeout == 0){
+			return FAIL;
+		}
+
+		chunk = (timeout > POWER_TIM_MAX_MS) ? POWER_TIM_MAX_MS : timeout;
+
+		primask = __get_PRIMASK();
+		__disable_irq();
+
+		if(*event != idle){		// Event fired before interrupts were masked
+			__set_PRIMASK(primask);
+			return PASS;
+		}
+
+		HAL_SuspendTick();
+
+		TIM7->CNT = 0;
+		TIM7->ARR = chunk * (POWER_TIM_HZ / 1000) - 1;
+		TIM7->SR  = 0;
+		TIM7->CR1 |= TIM_CR1_CEN;
+
+		SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;	// Sleep mode, DMA keeps running
+		__DSB();
+		__WFI();
+
+		TIM7->CR1 &= ~TIM_CR1_CEN;
+
+		if(TIM7->SR & TIM_SR_UIF){
+			slept = power_tick_add(chunk * (POWER_TIM_HZ / 1000));
+		}else{
+			slept = power_tick_add(TIM7->CNT);	// Woken early, the part below 1 ms is carried
+		}
+
+		TIM7->SR = 0;
+		NVIC_ClearPendingIRQ(TIM7_IRQn);
+
+		HAL_ResumeTick();
+
+		__set_PRIMASK(primask);	// Pending UART/DMA interrupts run here
+
+		timeout -= (slept < timeout) ? slept : timeout;
+	}
+}
+
+/*****************************************************************************/
+/*! @fn       power_sleep
+ *  @brief    Sleep mode replacement for HAL_Delay. Peripherals and DMA
+ *  		  keep running.
+ *  @param    Time in ms
+ */
+/*****************************************************************************/
+void power_sleep(uint32_t ms){
+
+	uint8_t never = 0;
+
+	power_wait(&never, 0, ms);
+}
+
+/*****************************************************************************/
+/*! @fn       power_stop
+ *  @brief    Enters Stop 2 for ms and restores the system clock on wake.
+ *  		  UART reception stops, only use between command sequences.
+ *  		  Falls back to Sleep mode while a UART transmit is running.
+ *  @param    Time in ms
+ */
+/*****************************************************************************/
+void power_stop(uint32_t ms){
+
+	uint32_t slept;
+
+	if( uart_tx_busy(&uart_wifi) || uart_tx_busy(&uart_camera) || uart_tx_busy(&uart_ltegps) ){
+		power_sleep(ms);
+		return;
+	}
+
+	while(ms){
+		slept = power_stop_enter(ms, 1);
+		ms -= (slept < ms) ? slept : ms;
+	}
+}
+
+/*****************************************************************************/
+/*! @fn       power_stop_wait
+ *  @brief    Waits in Stop 1 until *event no longer equals idle or timeout
+ *  		  ms pass. Meant for a port armed with uart_wake: its start bit
+ *  		  wakes the core, which then stays in Sleep mode for
+ *  		  POWER_RX_MS so DMA can take in the rest of the message before
+ *  		  stopping again. Falls back to power_wait while a UART transmit
+ *  		  is running.
+ *  @param    Event to wait on, its idle value, timeout in ms
+ *  @return   pass when the event fired, fail on timeout
+ */
+/*****************************************************************************/
+uint8_t power_stop_wait(volatile uint8_t *event, uint8_t idle, uint32_t timeout){
+
+	uint32_t slept, start;
+
+	if( uart_tx_busy(&uart_wifi) || uart_tx_busy(&uart_camera) || uart_tx_busy(&uart_ltegps) ){
+		return power_wait(event, idle, timeout);
+	}
+
+	while(1){
+
+		if(*event != idle){
+			return PASS;
+		}
+
+		if(timeout == 0){
+			return FAIL;
+		}
+
+		slept = power_stop_enter(timeout, 0);
+		timeout -= (slept < timeout) ? slept : timeout;
+
+		if(*event == idle && timeout){
+
+			// Woken by a port, stay awake while the message comes in
+			start = HAL_GetTick();
+			power_wait(event, idle, (timeout < POWER_RX_MS) ? timeout : POWER_RX_MS);
+			slept = HAL_GetTick() - start;
+			timeout -= (slept < timeout) ? slept : timeout;
+		}
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: power_tim_isr
+ *  @brief        : Handles TIM7 wake timer interrupt request. The wait
+ *  				functions clear the flag themselves, this only catches a
+ *  				timeout that expired outside of them.
+ */
+/*****************************************************************************/
+void power_tim_isr(void){
+
+	TIM7->SR = 0;
+}
+
+/*****************************************************************************/
+/*! @Function Name: power_lptim_isr
+ *  @brief        : Handles LPTIM1 wake timer interrupt request
+ */
+/*****************************************************************************/
+void power_lptim_isr(void){
+
+	LPTIM1->ICR = LPTIM_ICR_ARRMCF;
+}
+
+/*****************************************************************************/
+/*! @Function Name: power_lptim_count
+ *  @brief        : Reads LPTIM1 counter. The counter runs on LSI, so it is
+ *  				read until two consecutive reads agree.
+ *  @return		  : counter value in ms
+ */
+/*****************************************************************************/
+static uint32_t power_lptim_count(void){
+
+	uint32_t a, b;
+
+	do{
+		a = LPTIM1->CNT;
+		b = LPTIM1->CNT;
+	}while(a != b);
+
+	return a;
+}
+
+/*****************************************************************************/
+/*! @Function Name: power_stop_enter
+ *  @brief        : Enters Stop 1 or Stop 2 once for up to ms, woken by
+ *  				LPTIM1 or any enabled wakeup source, and restores the
+ *  				system clock. SystemClock_Config puts every port back on
+ *  				its bus clock, so the kernel clock selection is restored
+ *  				after it for the ports uart_wake left on HSI16.
+ *  @param		  : Time in ms, 1 for Stop 2 or 0 for Stop 1
+ *  @return		  : time slept in ms
+ */
+/*****************************************************************************/
+static uint32_t power_stop_enter(uint32_t ms, uint8_t stop2){
+
+	uint32_t primask;
+	uint32_t chunk;
+	uint32_t slept;
+	uint32_t ccipr;
+
+	chunk = (ms > POWER_LPTIM_MAX_MS) ? POWER_LPTIM_MAX_MS : ms;
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+
+	HAL_SuspendTick();
+
+	ccipr = RCC->CCIPR;
+
+	LPTIM1->CR  = LPTIM_CR_ENABLE;	// ARR is written with the timer enabled
+	LPTIM1->ICR = LPTIM_ICR_ARRMCF | LPTIM_ICR_ARROKCF;
+	LPTIM1->ARR = chunk;
+	while(!(LPTIM1->ISR & LPTIM_ISR_ARROK));	// Wait until ARR is loaded
+	LPTIM1->ICR = LPTIM_ICR_ARROKCF;
+	LPTIM1->CR |= LPTIM_CR_SNGSTRT;
+
+	if(stop2){
+		HAL_PWREx_EnterSTOP2Mode(PWR_STOPENTRY_WFI);
+	}else{
+		HAL_PWREx_EnterSTOP1Mode(PWR_STOPENTRY_WFI);
+	}
+
+	if(LPTIM1->ISR & LPTIM_ISR_ARRM){
+		slept = chunk * (POWER_TIM_HZ / 1000);
+	}else{
+		// Woken early by another source, half a count for the part it cannot see
+		slept = power_lptim_count() * (POWER_TIM_HZ / 1000) + POWER_TIM_HZ / 2000;
+	}
+
+	LPTIM1->ICR = LPTIM_ICR_ARRMCF;
+	LPTIM1->CR  = 0;
+	NVIC_ClearPendingIRQ(LPTIM1_IRQn);
+
+	SystemClock_Config();	// PLL is off after Stop
+	RCC->CCIPR = ccipr;		// Keep HSI16 on armed ports, BRR was set for it
+
+	slept = power_tick_add(slept);
+	HAL_ResumeTick();
+
+	__set_PRIMASK(primask);	// A pending wakeup interrupt runs here
+
+	return slept;
+}
+
+/*****************************************************************************/
+/*! @Function Name: power_tick_add
+ *  @brief        : Adds slept time to uwTick. What is below 1 ms is carried
+ *  				to the next sleep, so short wakes do not lose time and a
+ *  				wait woken faster than 1 ms still runs out.
+ *  @param		  : Time slept in POWER_TIM_HZ ticks
+ *  @return		  : whole ms added to uwTick
+ */
+/*****************************************************************************/
+static uint32_t power_tick_add(uint32_t ticks){
+
+	uint32_t ms;
+
+	power_tick_frac += ticks;
+	ms = power_tick_frac / (POWER_TIM_HZ / 1000);
+	power_tick_frac -= ms * (POWER_TIM_HZ / 1000);
+
+	uwTick += ms;
+
+	return ms;
+}
@@ -3,7 +3,7 @@
  * @project    EcoSense
  * @file       uart.c
  * @author     Long Tran
- * @version    0.0.1
+ * @version    0.0.2
  * @brief	   UART handler
  * @date       28/July/2021
  * @bug        NA
@@ -15,56 +15,260 @@
 /******************** INCLUDE FILES ******************************************/
 #include "string.h"
 #include "uart.h"
+#include "power.h"
 #include "stdint.h"
 #include "stm32l4xx_hal.h"
+#include "main.h"
 
 /******************** GLOBAL VARIABLE ****************************************/
-/* Structure for UART TX transmission */
 
-/* Structure for UART Tx */
-typedef struct
-{
-	volatile uint16_t count;               // Data Count
-	volatile uint8_t  status;              // Buffer status
-	char*    ptr;                 // Buffer pointer
+/* Per-port receive buffers, written by circular DMA, cleared by uart_init */
+static char wifi_rx_buff[BUFF_MAX]   SECTION_SRAM2;
+static char camera_rx_buff[BUFF_MAX] SECTION_SRAM2;
+static char ltegps_rx_buff[BUFF_MAX] SECTION_SRAM2;
+
+/* USART1: DMA1 RX ch5 / TX ch4, USART3: DMA1 RX ch3 / TX ch2, UART4: DMA2 RX ch5 / TX ch3 */
+Uart_Port uart_wifi   = { .uart = WIFI_UART, .dma = DMA1, .dma_sel = DMA1_CSELR,
+						  .rx_dma = DMA1_Channel5, .rx_ch = 5, .rx_irq = DMA1_Channel5_IRQn,
+						  .rx_buff = wifi_rx_buff, .rx_size = BUFF_MAX,
+						  .tx_dma = DMA1_Channel4, .tx_ch = 4, .tx_irq = DMA1_Channel4_IRQn };
+Uart_Port uart_camera = { .uart = CAMERA_UART, .dma = DMA1, .dma_sel = DMA1_CSELR,
+						  .rx_dma = DMA1_Channel3, .rx_ch = 3, .rx_irq = DMA1_Channel3_IRQn,
+						  .rx_buff = camera_rx_buff, .rx_size = BUFF_MAX,
+						  .tx_dma = DMA1_Channel2, .tx_ch = 2, .tx_irq = DMA1_Channel2_IRQn };
+Uart_Port uart_ltegps = { .uart = LTEGPS_UART, .dma = DMA2, .dma_sel = DMA2_CSELR,
+						  .rx_dma = DMA2_Channel5, .rx_ch = 5, .rx_irq = DMA2_Channel5_IRQn,
+						  .rx_buff = ltegps_rx_buff, .rx_size = BUFF_MAX,
+						  .tx_dma = DMA2_Channel3, .tx_ch = 3, .tx_irq = DMA2_Channel3_IRQn };
+
+/* Set when a matcher latches or a transmit buffer completes on any port,
+ * cleared by the waiter */
+volatile uint8_t uart_event = 0;
+
+/******************** STATIC FUNCTION DECLARATION*****************************/
+
+static void uart_rx_dma_start(Uart_Port *port);
+static void uart_rx_update(Uart_Port *port);
+static void uart_tx_dma_start(Uart_Port *port);
+static void uart_dma_select(Uart_Port *port, uint8_t ch);
+static uint8_t uart_clock_pos(Uart_Port *port);
+static uint32_t uart_clock(Uart_Port *port);
+static uint8_t uart_match_init(Uart_Match *m, const char *needle, uint8_t size);
+static uint8_t uart_match_step(Uart_Match *m, char c);
+static void uart_match_feed(Uart_Port *port, uint16_t from, uint16_t to);
+
+/******************** FUNCTION DECLARATION************************************/
+
+/*****************************************************************************/
+/*! @fn       uart_init
+ *  @brief    Starts circular RX DMA, IDLE-line detection and the TX DMA
+ *  		  queue on every module port. Called once after the MX_*_Init
+ *  		  functions.
+ */
+/*****************************************************************************/
+void uart_init(void){
 
-}Tx_Struct;
+	Uart_Port *ports[] = { &uart_wifi, &uart_camera, &uart_ltegps };
+	uint8_t i;
 
-Tx_Struct uart_t;
+	RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN | RCC_AHB1ENR_DMA2EN;
 
-/******************** FUNCTION DECLARATION************************************/
+	for(i = 0; i < sizeof(ports) / sizeof(ports[0]); i++){
+
+		Uart_Port *port = ports[i];
+
+		// Route the USART RX/TX requests to the channels
+		uart_dma_select(port, port->rx_ch);
+		uart_dma_select(port, port->tx_ch);
+
+		// Peripheral to memory, memory increment, circular, HT/TC interrupts
+		port->rx_dma->CCR   = 0;
+		port->rx_dma->CPAR  = (uint32_t)&port->uart->RDR;
+		port->rx_dma->CMAR  = (uint32_t)port->rx_buff;
+		port->rx_dma->CCR   = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_HTIE | DMA_CCR_TCIE;
+
+		// Memory to peripheral, memory increment, TC/TE interrupts
+		port->tx_dma->CCR   = 0;
+		port->tx_dma->CPAR  = (uint32_t)&port->uart->TDR;
+		port->tx_dma->CCR   = DMA_CCR_DIR | DMA_CCR_MINC | DMA_CCR_TCIE | DMA_CCR_TEIE;
+		port->tx_head       = 0;
+		port->tx_count      = 0;
+
+		HAL_NVIC_SetPriority(port->rx_irq, 0, 0);
+		HAL_NVIC_EnableIRQ(port->rx_irq);
+		HAL_NVIC_SetPriority(port->tx_irq, 0, 0);
+		HAL_NVIC_EnableIRQ(port->tx_irq);
+
+		port->uart->CR1 &= ~(USART_CR1_RXNEIE | USART_CR1_TXEIE);   // Bytes are moved by DMA
+		port->uart->CR3 |= USART_CR3_DMAR | USART_CR3_DMAT;          // Enable RX/TX DMA requests
+		port->uart->ICR  = USART_ICR_IDLECF | USART_ICR_ORECF;
+		port->uart->CR1 |= USART_CR1_IDLEIE;    // Enable IDLE interrupt
+
+		port->baud = (uart_clock(port) + port->uart->BRR / 2) / port->uart->BRR;
+
+		uart_rx_flush(port);	// SRAM2 is not zeroed at startup, start from a clean buffer
+	}
+}
 
 /*****************************************************************************/
 /*! @fn       uart_tx
- *  @brief    Sends data to the USART3 data buffer
- *  @param    Pointer to the data to be sent
+ *  @brief    Flushes the port receive buffer and queues a command for DMA
+ *  		  transmit. Returns without waiting for the bytes to go out.
+ *  @param    Port handle, pointer to the data to be sent, data length
+ *  @return   pass or fail (queue full)
  */
 /*****************************************************************************/
-void uart_tx(char* cmd, uint8_t cmd_length, USART_TypeDef *uart){
+uint8_t uart_tx(Uart_Port *port, const char* cmd, uint32_t cmd_length){
 
-	uart_rx_flush();	// Reset
+	uart_rx_flush(port);	// Reset
 
-	uart_t.ptr = cmd;			// Load new command
-	uart_t.count = cmd_length;  // and command length
-	uart->TDR = *uart_t.ptr & 0xFF; // Writing to TDR clears TX
+	return uart_tx_submit(port, cmd, cmd_length, NULL, NULL, NULL);
+}
 
-	uart->CR1 |= USART_CR1_TXEIE; // Initiate USART Tx interrupt
+/*****************************************************************************/
+/*! @fn       uart_tx_submit
+ *  @brief    Queues a buffer of any length for DMA transmit. The buffer must
+ *  		  stay valid until completion. On completion *status is set to
+ *  		  TX_FREE (or TX_ERROR) and done(ctx, status) is called from
+ *  		  interrupt context.
+ *  @param    Port handle, data, length, callback (or NULL), callback context,
+ *  		  status (or NULL)
+ *  @return   pass or fail (queue full)
+ */
+/*****************************************************************************/
+uint8_t uart_tx_submit(Uart_Port *port, const char* data, uint32_t length,
+					   Uart_TxDone done, void *ctx, volatile uint8_t *status){
 
+	uint32_t primask;
+	Tx_Struct *tx;
+
+	if(length == 0){
+		if(status){
+			*status = TX_FREE;
+		}
+		if(done){
+			done(ctx, TX_FREE);
+		}
+		return PASS;
+	}
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+
+	if(port->tx_count >= UART_TXQ_MAX){
+		__set_PRIMASK(primask);
+		return FAIL;
+	}
+
+	tx = &port->tx_q[(port->tx_head + port->tx_count) % UART_TXQ_MAX];
+	tx->ptr    = data;
+	tx->count  = length;
+	tx->block  = 0;
+	tx->done   = done;
+	tx->ctx    = ctx;
+	tx->status = status;
+
+	if(status){
+		*status = TX_BUSY;
+	}
+
+	port->tx_count++;
+
+	if(port->tx_count == 1){	// DMA idle, start this buffer
+		uart_tx_dma_start(port);
+	}
+
+	__set_PRIMASK(primask);
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @fn       uart_baud
+ *  @brief    Changes the port baud rate. Waits until queued transmits and
+ *  		  the last stop bit are out, then flushes the receive buffer.
+ *  @param    Port handle, baud rate
+ */
+/*****************************************************************************/
+void uart_baud(Uart_Port *port, uint32_t baud){
+
+	while( uart_tx_busy(port) == TX_BUSY );		// Wait until DMA queue is empty
+	while(!(port->uart->ISR & USART_ISR_TC));	// Wait until TC: transmission complete
+
+	port->baud = baud;
+
+	port->uart->CR1 &= ~USART_CR1_UE;
+	port->uart->BRR  = (uart_clock(port) + baud / 2) / baud;	// 16x oversampling
+	port->uart->CR1 |= USART_CR1_UE;
+
+	uart_rx_flush(port);
+}
+
+/*****************************************************************************/
+/*! @fn       uart_wake
+ *  @brief    Lets a received start bit wake the core from Stop 1. The port
+ *  		  kernel clock moves to HSI16, which the USART turns on by
+ *  		  itself while the core is stopped, so the byte is not lost.
+ *  		  Disabling moves the port back to its bus clock.
+ *  @param    Port handle, 1 to enable, 0 to disable
+ */
+/*****************************************************************************/
+void uart_wake(Uart_Port *port, uint8_t enable){
+
+	uint8_t pos = uart_clock_pos(port);
+	uint32_t line;
+
+	// EXTI wakeup lines 26..29 follow the CCIPR order USART1..UART4
+	line = 1U << (EXTI_IMR1_IM26_Pos + pos / 2);
+
+	while( uart_tx_busy(port) == TX_BUSY );		// Wait until DMA queue is empty
+	while(!(port->uart->ISR & USART_ISR_TC));	// Wait until TC: transmission complete
+
+	port->uart->CR1 &= ~USART_CR1_UE;	// WUS and BRR are written with the port disabled
+
+	RCC->CCIPR = (RCC->CCIPR & ~(3U << pos)) | ((enable ? 2U : 0U) << pos);	// HSI16 or PCLK
+	port->uart->BRR = (uart_clock(port) + port->baud / 2) / port->baud;
+
+	if(enable){
+		port->uart->CR3 = (port->uart->CR3 & ~USART_CR3_WUS) | USART_CR3_WUS_1;	// Wake on start bit
+		port->uart->CR3 |= USART_CR3_WUFIE;
+		port->uart->CR1 |= USART_CR1_UESM;
+		EXTI->IMR1 |= line;
+	}else{
+		port->uart->CR3 &= ~USART_CR3_WUFIE;
+		port->uart->CR1 &= ~USART_CR1_UESM;
+		EXTI->IMR1 &= ~line;
+	}
+
+	port->uart->CR1 |= USART_CR1_UE;
+}
+
+/*****************************************************************************/
+/*! @fn       uart_tx_busy
+ *  @brief    Check for queued or running transmit buffers on the port.
+ *  @return   TX_BUSY or TX_FREE
+ */
+/*****************************************************************************/
+uint8_t uart_tx_busy(Uart_Port *port){
+
+	return port->tx_count ? TX_BUSY : TX_FREE;
 }
 
 /*****************************************************************************/
 /*! @fn       uart_rx_print
- *  @brief    Print uart response buffer to PC for debug purposes.
+ *  @brief    Print port response buffer to PC for debug purposes.
  *  @return   ret -  0 for success and -1 for failure
  */
 /*****************************************************************************/
-char uart_rx_print(void){
+char uart_rx_print(Uart_Port *port){
 
 	uint16_t i;
 
-	for(i = 0; i < rx_idx; i++){
+	uart_rx_update(port);
+
+	for(i = 0; i < port->rx_idx; i++){
 		while(!(PC_UART->ISR & USART_ISR_TXE));	// Wait until hardware sets TXE
-		PC_UART->TDR = rx_buff[i] & 0xFF;		// Writing to TDR clears TXE flag
+		PC_UART->TDR = port->rx_buff[i] & 0xFF;	// Writing to TDR clears TXE flag
 	}
 
 	//while(! (PC_UART->ISR & USART_ISR_TC));	// Wait until TC: transmission complete
@@ -74,74 +278,192 @@ char uart_rx_print(void){
 
 /*****************************************************************************/
 /*! @fn       uart_rx_flush
- *  @brief    Resets uart receive buffer and index
+ *  @brief    Resets port receive buffer and restarts its DMA at index 0
  */
 /*****************************************************************************/
-void uart_rx_flush(void){
+void uart_rx_flush(Uart_Port *port){
 
-	uint16_t i;
+	port->rx_dma->CCR &= ~DMA_CCR_EN;	// Stop DMA while buffer is cleared
 
-	for(i = 0; i < rx_idx; i++){
-		rx_buff[i] = NULL;
-	}
+	// DMA may have wrapped, so the whole buffer is cleared
+	memset(port->rx_buff, 0, port->rx_size);
 
-	rx_idx = BUFF_RESET;
+	uart_rx_dma_start(port);
 }
 
 /*****************************************************************************/
-/*! @fn        uart_rx_check
- *   @brief    calls uart_rx_find until success or timeout
- *   @param    needle to scanned for in rx_buff, size of needle,
- *   		   times to call UART_Rx_Find
+/*! @fn        uart_rx_match
+ *   @brief    Arms the port matchers with a set of patterns. Bytes already
+ *   		   received since the last flush are scanned once, later bytes
+ *   		   are fed from the RX interrupts as they arrive. The first
+ *   		   pattern to complete is latched in match_hit/match_end.
+ *   @param    Port handle, patterns, number of patterns (UART_MATCH_SET max)
  *  @return    ret -  0 for success and 1 for failure
  */
 /*****************************************************************************/
-uint8_t uart_rx_check(char* needle, uint8_t needle_size, uint16_t test_cnt){
+uint8_t uart_rx_match(Uart_Port *port, const Uart_Pattern* patterns, uint8_t count){
+
+	uint32_t primask;
+	uint8_t i;
+
+	if(count == 0 || count > UART_MATCH_SET){
+		return FAIL;
+	}
+
+	primask = __get_PRIMASK();
+	__disable_irq();
 
-	while(test_cnt)
-	{
-		HAL_Delay(UART_DELAY);
+	port->match_count = 0;	// Keep ISR off the matchers while they change
+	port->match_hit   = UART_NO_MATCH;
+	port->match_end   = 0;
+	port->rx_need     = 0;
 
-		if( uart_rx_find(needle, needle_size) )
-		{
-			return PASS;
+	for(i = 0; i < count; i++){
+		if( uart_match_init(&port->match[i], patterns[i].str, patterns[i].size) ){
+			__set_PRIMASK(primask);
+			return FAIL;
 		}
+	}
+
+	port->match_count = count;
+	port->rx_scan = 0;		// Catch up on bytes that are already in
+	uart_rx_update(port);
+
+	__set_PRIMASK(primask);
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @fn        uart_rx_hook
+ *   @brief    Passes the bytes received since the last flush, and then
+ *   		   each new byte range as it arrives, to hook. The hook reads
+ *   		   rx_buff in place and must not change it. The next flush
+ *   		   (uart_tx) removes the hook.
+ *   @param    Port handle, hook (NULL to remove), hook context
+ */
+/*****************************************************************************/
+void uart_rx_hook(Uart_Port *port, Uart_RxHook hook, void *ctx){
+
+	uint32_t primask;
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+
+	port->rx_hook     = hook;
+	port->rx_hook_ctx = ctx;
+	port->rx_hook_pos = 0;		// Catch up on bytes that are already in
+	uart_rx_update(port);
+
+	__set_PRIMASK(primask);
+}
+
+/*****************************************************************************/
+/*! @fn        uart_rx_count
+ *   @brief    Arms the port to latch match_hit = 0 once count bytes have
+ *   		   been received since the last flush. Used for binary replies
+ *   		   of known length, where a pattern could also occur in the data.
+ *   @param    Port handle, byte count (rx_size max)
+ *  @return    ret -  0 for success and 1 for failure
+ */
+/*****************************************************************************/
+uint8_t uart_rx_count(Uart_Port *port, uint16_t count){
+
+	uint32_t primask;
+
+	if(count == 0 || count >= port->rx_size){	// Must not wrap
+		return FAIL;
+	}
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+
+	port->match_count = 0;
+	port->match_hit   = UART_NO_MATCH;
+	port->match_end   = 0;
+	port->rx_need     = count;
+	uart_rx_update(port);	// Bytes may already be in
+
+	__set_PRIMASK(primask);
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @fn        uart_rx_wait
+ *   @brief    Sleeps until any of the patterns arrives or test_cnt *
+ *   		   UART_DELAY ms pass. All patterns advance together on each
+ *   		   received byte, so e.g. OK and ERROR are told apart in one
+ *   		   pass and a failing command returns as soon as it fails.
+ *   @param    Port handle, patterns, number of patterns, timeout in
+ *   		   UART_DELAY units, end (optional) receives the rx_buff index
+ *   		   just past the match
+ *  @return    index of the matched pattern or UART_NO_MATCH on timeout
+ */
+/*****************************************************************************/
+uint8_t uart_rx_wait(Uart_Port *port, const Uart_Pattern* patterns, uint8_t count,
+					 uint16_t test_cnt, uint16_t *end){
+
+	if( uart_rx_match(port, patterns, count) ){
+		return UART_NO_MATCH;
+	}
+
+	// Core sleeps until the RX interrupts latch a match
+	if( power_wait(&port->match_hit, UART_NO_MATCH, (uint32_t)test_cnt * UART_DELAY) ){
+		return UART_NO_MATCH;
+	}
+
+	if(end){
+		*end = port->match_end;
+	}
+
+	return port->match_hit;
+}
+
+/*****************************************************************************/
+/*! @fn        uart_rx_check
+ *   @brief    Arms the port matcher and waits until needle arrives or
+ *   		   test_cnt * UART_DELAY ms pass.
+ *   @param    Port handle, needle to scanned for in rx_buff, size of needle,
+ *   		   timeout in UART_DELAY units
+ *  @return    ret -  0 for success and 1 for failure
+ */
+/*****************************************************************************/
+uint8_t uart_rx_check(Uart_Port *port, char* needle, uint8_t needle_size, uint16_t test_cnt){
 
-		test_cnt--;
+	Uart_Pattern pattern = { needle, needle_size };
 
+	if( uart_rx_wait(port, &pattern, 1, test_cnt, NULL) == UART_NO_MATCH ){
+		return FAIL;
 	}
 
-	return FAIL;
+	return PASS;
 
 }
 
 /*****************************************************************************/
 /*! @Function Name: uart_rx_find
- *  @brief        : This function finds needle inside rx_buffer.
+ *  @brief        : This function finds needle inside the port rx_buff.
  *  @return		  : index to end of needle, used for rx_idx
  *  				else 0
  */
 /*****************************************************************************/
-uint16_t uart_rx_find(char* needle, uint8_t needle_size){	// return index to end of needle, else 0
+uint16_t uart_rx_find(Uart_Port *port, char* needle, uint8_t needle_size){	// return index to end of needle, else 0
 
-	uint16_t i = 0;
-	uint16_t buff_idx = 0;
+	Uart_Match m;
+	uint16_t buff_idx;
 
-	while (buff_idx <= rx_idx) {
-
-		// check for complete needle
-		while (needle[i] == rx_buff[buff_idx] && i < needle_size) {
-			i++;
-			buff_idx++;
-		}
+	if( uart_match_init(&m, needle, needle_size) ){
+		return 0;
+	}
 
-		if (i == needle_size) {
-			return buff_idx; // needle found
-		}
+	uart_rx_update(port);
 
-		i = 0; // reset needle index
-		buff_idx++;
+	for(buff_idx = 0; buff_idx < port->rx_idx; buff_idx++){
 
+		if( uart_match_step(&m, port->rx_buff[buff_idx]) ){
+			return buff_idx + 1; // needle found
+		}
 	}
 
 	return 0; // needle not found
@@ -184,50 +506,330 @@ void LOG_BOX(char* message)
 
 /*****************************************************************************/
 /*! @Function Name: uart_isr
- *  @brief        : Handles generic USART global interrupt request
+ *  @brief        : Handles port USART global interrupt request (IDLE)
+ */
+/*****************************************************************************/
+void uart_isr(Uart_Port *port){
+
+	USART_TypeDef *uart = port->uart;
+
+	// if line went idle, a frame has ended
+	if( uart->ISR & USART_ISR_IDLE ){	// Check IDLE event
+		uart->ICR = USART_ICR_IDLECF;
+		uart_rx_update(port);
+		port->rx_frames++;
+	}
+
+	// overrun leaves reception stalled until cleared
+	if( uart->ISR & USART_ISR_ORE ){
+		uart->ICR = USART_ICR_ORECF;
+	}
+
+	// start bit woke the core from Stop 1 (uart_wake), DMA takes the byte
+	if( uart->ISR & USART_ISR_WUF ){
+		uart->ICR = USART_ICR_WUCF;
+	}
+
+}
+
+/*****************************************************************************/
+/*! @Function Name: uart_dma_rx_isr
+ *  @brief        : Handles port RX DMA half/full transfer interrupt request
  */
 /*****************************************************************************/
-void uart_isr(USART_TypeDef *uart){
+void uart_dma_rx_isr(Uart_Port *port){
+
+	uint8_t shift = (port->rx_ch - 1) * 4;
+
+	port->dma->IFCR = DMA_IFCR_CGIF1 << shift;	// Clear HT/TC/TE of channel
+	uart_rx_update(port);
+}
 
-	// if receive buffer ready to read
-	if( uart->ISR & USART_ISR_RXNE ){ // Check RXNE event
-		rx_buff[rx_idx] = uart->RDR;  // Reading RDR clears RXNE flag
-		rx_idx++;					  // Update buffer index
-		if(rx_idx >= BUFF_MAX){		  // Circular buffer
-			rx_idx = BUFF_RESET;
+/*****************************************************************************/
+/*! @Function Name: uart_dma_tx_isr
+ *  @brief        : Handles port TX DMA transfer complete interrupt request.
+ *  				Starts the next block of the active buffer or completes it
+ *  				and moves on to the next queued buffer.
+ */
+/*****************************************************************************/
+void uart_dma_tx_isr(Uart_Port *port){
+
+	uint8_t shift = (port->tx_ch - 1) * 4;
+	uint32_t flags = port->dma->ISR >> shift;
+	Tx_Struct *tx = &port->tx_q[port->tx_head];
+	uint8_t status = TX_FREE;
+
+	port->dma->IFCR = DMA_IFCR_CGIF1 << shift;	// Clear HT/TC/TE of channel
+	port->tx_dma->CCR &= ~DMA_CCR_EN;
+
+	if(port->tx_count == 0){
+		return;
+	}
+
+	if(flags & DMA_ISR_TEIF1){
+		status = TX_ERROR;
+	}else{
+		tx->ptr   += tx->block;
+		tx->count -= tx->block;
+
+		if(tx->count > 0){		// Next block of a long buffer
+			uart_tx_dma_start(port);
+			return;
 		}
 	}
 
-	// if ready to transfer
-	if( uart->ISR & USART_ISR_TC ){		// Check TXE event
-		if(uart_t.count > 0){				// Transmit next byte
-			uart_t.ptr++;
-			uart_t.count--;
-			uart->TDR = *uart_t.ptr & 0xFF; // Writing to TDR clears TC
-		}else{
-			uart->CR1 &= ~USART_CR1_TXEIE;	// Disable TXE interrupt
-			uart->ICR |= USART_ICR_TCCF;
+	// Buffer finished, release queue slot before notifying
+	port->tx_head = (port->tx_head + 1) % UART_TXQ_MAX;
+	port->tx_count--;
+
+	if(tx->status){
+		*tx->status = status;
+	}
+	if(tx->done){
+		tx->done(tx->ctx, status);
+	}
+	uart_event = 1;	// Wake the scheduler
+
+	if(port->tx_count > 0){
+		uart_tx_dma_start(port);
+	}
+}
+
+/******************** STATIC FUNCTIONS ***************************************/
+
+/*****************************************************************************/
+/*! @Function Name: uart_rx_dma_start
+ *  @brief        : (Re)arms the port RX DMA channel at buffer index 0.
+ */
+/*****************************************************************************/
+static void uart_rx_dma_start(Uart_Port *port){
+
+	port->rx_dma->CCR   &= ~DMA_CCR_EN;
+	port->dma->IFCR      = DMA_IFCR_CGIF1 << ((port->rx_ch - 1) * 4);
+	port->rx_dma->CNDTR  = port->rx_size;
+	port->rx_idx         = BUFF_RESET;
+	port->rx_frames      = 0;
+	port->rx_scan        = BUFF_RESET;
+	port->match_count    = 0;		// Responses to the next command re-arm
+	port->match_hit      = UART_NO_MATCH;
+	port->rx_need        = 0;
+	port->rx_hook        = NULL;	// Hooks re-arm like the matchers
+	port->rx_hook_pos    = BUFF_RESET;
+	port->uart->ICR      = USART_ICR_ORECF;
+	port->rx_dma->CCR   |= DMA_CCR_EN;
+}
+
+/*****************************************************************************/
+/*! @Function Name: uart_rx_update
+ *  @brief        : Derives the port write index from the DMA remaining count
+ *  				and feeds the new bytes to the armed matcher.
+ */
+/*****************************************************************************/
+static void uart_rx_update(Uart_Port *port){
+
+	uint32_t primask;
+	uint16_t idx;
+
+	primask = __get_PRIMASK();
+	__disable_irq();
+
+	idx = port->rx_size - (uint16_t)port->rx_dma->CNDTR;
+
+	if(idx >= port->rx_size){	// CNDTR reloads to rx_size on wrap
+		idx = BUFF_RESET;
+	}
+
+	if(idx < port->rx_scan){	// DMA wrapped since the last update
+		uart_match_feed(port, port->rx_scan, port->rx_size);
+		port->rx_scan = BUFF_RESET;
+	}
+	uart_match_feed(port, port->rx_scan, idx);
+	port->rx_scan = idx;
+
+	if(port->rx_hook != NULL){
+		if(idx < port->rx_hook_pos){	// Same wrap for the hook
+			port->rx_hook(port->rx_hook_ctx, port->rx_buff + port->rx_hook_pos, port->rx_size - port->rx_hook_pos);
+			port->rx_hook_pos = BUFF_RESET;
 		}
+		if(idx > port->rx_hook_pos){
+			port->rx_hook(port->rx_hook_ctx, port->rx_buff + port->rx_hook_pos, idx - port->rx_hook_pos);
+		}
+		port->rx_hook_pos = idx;
 	}
 
+	port->rx_idx = idx;
+
+	if(port->rx_need && idx >= port->rx_need && port->match_hit == UART_NO_MATCH){
+		port->match_end = port->rx_need;
+		port->match_hit = 0;
+		uart_event   = 1;	// Wake the scheduler
+	}
+
+	__set_PRIMASK(primask);
+}
+
+/*****************************************************************************/
+/*! @Function Name: uart_match_feed
+ *  @brief        : Advances all armed port matchers over rx_buff[from..to)
+ *  				and latches the first pattern to complete.
+ */
+/*****************************************************************************/
+static void uart_match_feed(Uart_Port *port, uint16_t from, uint16_t to){
+
+	uint8_t i;
+	char c;
+
+	if(port->match_count == 0 || port->match_hit != UART_NO_MATCH){
+		return;
+	}
+
+	for(; from < to; from++){
+
+		c = port->rx_buff[from];
+
+		for(i = 0; i < port->match_count; i++){
+
+			if( uart_match_step(&port->match[i], c) ){
+				port->match_end = from + 1;
+				port->match_hit = i;
+				uart_event = 1;	// Wake the scheduler
+				return;
+			}
+		}
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: uart_match_init
+ *  @brief        : Loads needle into matcher m and builds its KMP failure
+ *  				function.
+ *  @return       : pass or fail (empty or longer than UART_MATCH_MAX)
+ */
+/*****************************************************************************/
+static uint8_t uart_match_init(Uart_Match *m, const char *needle, uint8_t size){
+
+	uint8_t i, k = 0;
+
+	if(size == 0 || size > UART_MATCH_MAX){
+		return FAIL;
+	}
+
+	m->fail[0] = 0;
+
+	for(i = 1; i < size; i++){
+
+		while(k > 0 && needle[i] != needle[k]){
+			k = m->fail[k - 1];
+		}
+
+		if(needle[i] == needle[k]){
+			k++;
+		}
+
+		m->fail[i] = k;
+	}
+
+	m->size   = size;
+	m->state  = 0;
+	m->needle = needle;
+
+	return PASS;
 }
 
+/*****************************************************************************/
+/*! @Function Name: uart_match_step
+ *  @brief        : Advances matcher m by one received byte.
+ *  @return       : 1 when the byte completes the pattern, else 0
+ */
+/*****************************************************************************/
+static uint8_t uart_match_step(Uart_Match *m, char c){
 
+	while(m->state > 0 && c != m->needle[m->state]){
+		m->state = m->fail[m->state - 1];
+	}
 
+	if(c == m->needle[m->state]){
+		m->state++;
+	}
 
+	if(m->state == m->size){
+		m->state = m->fail[m->state - 1];
+		return 1;
+	}
 
+	return 0;
+}
 
+/*****************************************************************************/
+/*! @Function Name: uart_tx_dma_start
+ *  @brief        : Loads the next block (at most UART_DMA_MAX bytes) of the
+ *  				buffer at the queue head into the TX DMA channel.
+ */
+/*****************************************************************************/
+static void uart_tx_dma_start(Uart_Port *port){
 
+	Tx_Struct *tx = &port->tx_q[port->tx_head];
 
+	tx->block = (tx->count > UART_DMA_MAX) ? UART_DMA_MAX : (uint16_t)tx->count;
 
+	port->tx_dma->CCR   &= ~DMA_CCR_EN;
+	port->tx_dma->CMAR   = (uint32_t)tx->ptr;
+	port->tx_dma->CNDTR  = tx->block;
+	port->tx_dma->CCR   |= DMA_CCR_EN;
+}
 
+/*****************************************************************************/
+/*! @Function Name: uart_dma_select
+ *  @brief        : Routes the port USART request to DMA channel ch.
+ */
+/*****************************************************************************/
+static void uart_dma_select(Uart_Port *port, uint8_t ch){
 
+	uint8_t shift = (ch - 1) * 4;
 
+	port->dma_sel->CSELR = (port->dma_sel->CSELR & ~(0xFUL << shift)) | ((uint32_t)UART_DMA_REQ << shift);
+}
 
+/*****************************************************************************/
+/*! @Function Name: uart_clock_pos
+ *  @brief        : Position of the port kernel clock selection in CCIPR
+ */
+/*****************************************************************************/
+static uint8_t uart_clock_pos(Uart_Port *port){
+
+	if(port->uart == USART1){
+		return RCC_CCIPR_USART1SEL_Pos;
+	}else if(port->uart == USART2){
+		return RCC_CCIPR_USART2SEL_Pos;
+	}else if(port->uart == USART3){
+		return RCC_CCIPR_USART3SEL_Pos;
+	}
 
+	return RCC_CCIPR_UART4SEL_Pos;
+}
 
+/*****************************************************************************/
+/*! @Function Name: uart_clock
+ *  @brief        : Port kernel clock frequency. USART1 runs on PCLK2, the
+ *  				other ports on PCLK1 (SystemClock_Config), unless
+ *  				uart_wake moved the port to HSI16.
+ *  @return		  : clock in Hz
+ */
+/*****************************************************************************/
+static uint32_t uart_clock(Uart_Port *port){
 
+	switch((RCC->CCIPR >> uart_clock_pos(port)) & 3U){
 
+	case 1:
+		return HAL_RCC_GetSysClockFreq();
 
+	case 2:
+		return HSI_VALUE;
 
+	case 3:
+		return LSE_VALUE;
 
+	default:
+		return (port->uart == USART1) ? HAL_RCC_GetPCLK2Freq() : HAL_RCC_GetPCLK1Freq();
+	}
+}
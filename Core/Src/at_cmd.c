@@ -0,0 +1,170 @@
+/*****************************************************************************/
+/*!
+ * @project    EcoSense
+ * @file       at_cmd.c
+ * @author     Long Tran
+ * @version    0.0.1
+ * @brief	   AT command builder
+ * @date       28/July/2021
+ * @bug        NA
+
+ * @note       The buffer is kept NUL terminated after every call, room for
+ * 			   the terminator is reserved up front.
+ */
+/*****************************************************************************/
+
+/******************** INCLUDE FILES ******************************************/
+#include "stdint.h"
+#include "at_cmd.h"
+#include "uart.h"
+
+/******************** STATIC FUNCTION DECLARATION*****************************/
+
+static void at_cmd_put(At_Cmd *cmd, char c);
+static void at_cmd_puts(At_Cmd *cmd, const char *str);
+static void at_cmd_sep(At_Cmd *cmd);
+
+/******************** FUNCTION DECLARATION************************************/
+
+/*****************************************************************************/
+/*! @fn       at_cmd_start
+ *  @brief    Starts a command, ex. at_cmd_start(&cmd, buff, size, "AT+WNCN=")
+ *  @param    Command, buffer, buffer size, command prefix
+ */
+/*****************************************************************************/
+void at_cmd_start(At_Cmd *cmd, char *buff, uint16_t size, const char *prefix){
+
+	cmd->buff   = buff;
+	cmd->size   = size;
+	cmd->len    = 0;
+	cmd->params = 0;
+	cmd->error  = (size == 0) ? 1 : 0;
+
+	if(size){
+		buff[0] = '\0';
+	}
+
+	at_cmd_puts(cmd, prefix);
+}
+
+/*****************************************************************************/
+/*! @fn       at_cmd_uint
+ *  @brief    Adds a decimal parameter.
+ */
+/*****************************************************************************/
+void at_cmd_uint(At_Cmd *cmd, uint32_t value){
+
+	char digits[10];
+	uint8_t n = 0;
+
+	do{
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	}while(value);
+
+	at_cmd_sep(cmd);
+
+	while(n){
+		at_cmd_put(cmd, digits[--n]);
+	}
+}
+
+/*****************************************************************************/
+/*! @fn       at_cmd_str
+ *  @brief    Adds a quoted string parameter, escaped as needed.
+ */
+/*****************************************************************************/
+void at_cmd_str(At_Cmd *cmd, const char *str){
+
+	static const char hex[] = "0123456789ABCDEF";
+	uint8_t c;
+
+	at_cmd_sep(cmd);
+	at_cmd_put(cmd, '"');
+
+	while( (c = (uint8_t)*str++) != '\0' ){
+
+		if(c == '"' || c == '\\' || c < 0x20){
+			at_cmd_put(cmd, '\\');
+			at_cmd_put(cmd, hex[c >> 4]);
+			at_cmd_put(cmd, hex[c & 0x0F]);
+		}else{
+			at_cmd_put(cmd, c);
+		}
+	}
+
+	at_cmd_put(cmd, '"');
+}
+
+/*****************************************************************************/
+/*! @fn       at_cmd_raw
+ *  @brief    Adds a parameter as is, without quotes or escaping.
+ */
+/*****************************************************************************/
+void at_cmd_raw(At_Cmd *cmd, const char *str){
+
+	at_cmd_sep(cmd);
+	at_cmd_puts(cmd, str);
+}
+
+/*****************************************************************************/
+/*! @fn       at_cmd_end
+ *  @brief    Ends the command with CR LF.
+ *  @return   pass, or fail when the command did not fit (buffer left empty)
+ */
+/*****************************************************************************/
+uint8_t at_cmd_end(At_Cmd *cmd){
+
+	at_cmd_puts(cmd, "\r\n");
+
+	if(cmd->error){
+		cmd->len = 0;
+		if(cmd->size){
+			cmd->buff[0] = '\0';
+		}
+		return FAIL;
+	}
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: at_cmd_put
+ *  @brief        : Appends a character if it fits with the terminator,
+ *  				else marks the command bad.
+ */
+/*****************************************************************************/
+static void at_cmd_put(At_Cmd *cmd, char c){
+
+	if(cmd->error || cmd->len + 1 >= cmd->size){
+		cmd->error = 1;
+		return;
+	}
+
+	cmd->buff[cmd->len++] = c;
+	cmd->buff[cmd->len]   = '\0';
+}
+
+/*****************************************************************************/
+/*! @Function Name: at_cmd_puts
+ *  @brief        : Appends a string as is.
+ */
+/*****************************************************************************/
+static void at_cmd_puts(At_Cmd *cmd, const char *str){
+
+	while(*str){
+		at_cmd_put(cmd, *str++);
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: at_cmd_sep
+ *  @brief        : Comma before every parameter but the first.
+ */
+/*****************************************************************************/
+static void at_cmd_sep(At_Cmd *cmd){
+
+	if(cmd->params++){
+		at_cmd_put(cmd, ',');
+	}
+}
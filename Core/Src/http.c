@@ -0,0 +1,487 @@
+/*****************************************************************************/
+/*!
+ * @project    EcoSense
+ * @file       http.c
+ * @author     Long Tran
+ * @version    0.0.1
+ * @brief	   HTTP/1.1 upload client
+ * @date       28/July/2021
+ * @bug        NA
+
+ * @note       The response parser takes bytes in chunks of any size, only
+ * 			   one line is buffered at a time.
+ */
+/*****************************************************************************/
+
+/******************** INCLUDE FILES ******************************************/
+#include "stdint.h"
+#include "string.h"
+#include "http.h"
+#include "uart.h"
+
+/******************** STATIC FUNCTION DECLARATION*****************************/
+
+static uint8_t http_connect(Http_Client *http);
+static uint8_t http_head(Http_Client *http, const char *path, const char *type, uint32_t length);
+static uint8_t http_body(Http_Client *http, uint32_t length, Http_Producer body, void *ctx);
+static uint8_t http_response(Http_Client *http);
+static void http_feed(Http_Client *http, const uint8_t *data, uint16_t size);
+static void http_line(Http_Client *http);
+static uint8_t http_header(const char *line, const char *name);
+static uint8_t http_contains(const char *str, const char *word);
+static uint16_t http_append(Http_Client *http, uint16_t len, const char *str);
+
+/******************** FUNCTION DECLARATION************************************/
+
+/*****************************************************************************/
+/*! @fn       http_init
+ *  @brief    Sets up a client, no connection is made yet.
+ *  @param    Client, transport, server name or IP, port, 1 for HTTPS
+ */
+/*****************************************************************************/
+void http_init(Http_Client *http, const Transport *net, const char *host,
+			   uint16_t port, uint8_t tls){
+
+	memset(http, 0, sizeof(*http));
+	http->net  = net;
+	http->host = host;
+	http->port = port;
+	http->tls  = tls;
+}
+
+/*****************************************************************************/
+/*! @fn       http_post
+ *  @brief    POSTs a body to path and waits for the response. Connects
+ *  		  when needed; a kept connection the server dropped is
+ *  		  reopened once, before any body byte is pulled.
+ *  @param    Client, path, content type, body length (or HTTP_CHUNKED),
+ *  		  producer, producer context
+ *  @return   pass on a 2xx status, else fail (status in http->status,
+ *  		  0 when no response)
+ */
+/*****************************************************************************/
+uint8_t http_post(Http_Client *http, const char *path, const char *type,
+				  uint32_t length, Http_Producer body, void *ctx){
+
+	http->status = 0;
+
+	if( http_connect(http) ){
+		return FAIL;
+	}
+
+	if( http_head(http, path, type, length) ){
+
+		if(http->requests == 0){	// Fresh connection, nothing to retry
+			http_close(http);
+			return FAIL;
+		}
+
+		LOG("HTTP: Kept connection lost, reconnecting.\r\n");
+		http_close(http);
+
+		if( http_connect(http) || http_head(http, path, type, length) ){
+			http_close(http);
+			return FAIL;
+		}
+	}
+
+	http->requests++;
+
+	if( http_body(http, length, body, ctx) || http_response(http) ){
+		http_close(http);	// Stream position unknown, start over next time
+		return FAIL;
+	}
+
+	if( !http->keep ){
+		http_close(http);
+	}
+
+	return (http->status >= 200 && http->status < 300) ? PASS : FAIL;
+}
+
+/*****************************************************************************/
+/*! @fn       http_close
+ *  @brief    Closes the connection.
+ */
+/*****************************************************************************/
+void http_close(Http_Client *http){
+
+	if(http->open){
+		http->net->close();
+	}
+
+	http->open     = 0;
+	http->requests = 0;
+}
+
+/*****************************************************************************/
+/*! @Function Name: http_connect
+ *  @brief        : Opens the connection unless one is kept.
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+static uint8_t http_connect(Http_Client *http){
+
+	if(http->open){
+		return PASS;
+	}
+
+	if( http->net->open(http->host, http->port, http->tls) ){
+		LOG("HTTP: Connect failed.\r\n");
+		return FAIL;
+	}
+
+	http->open     = 1;
+	http->requests = 0;
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: http_head
+ *  @brief        : Sends the request line and headers.
+ *  @return       : pass or fail (too long or send failed)
+ */
+/*****************************************************************************/
+static uint8_t http_head(Http_Client *http, const char *path, const char *type, uint32_t length){
+
+	char digits[11];
+	uint8_t n = sizeof(digits) - 1;
+	uint16_t len = 0;
+
+	len = http_append(http, len, "POST ");
+	len = http_append(http, len, path);
+	len = http_append(http, len, " HTTP/1.1\r\nHost: ");
+	len = http_append(http, len, http->host);
+	len = http_append(http, len, "\r\nContent-Type: ");
+	len = http_append(http, len, type);
+
+	if(length == HTTP_CHUNKED){
+		len = http_append(http, len, "\r\nTransfer-Encoding: chunked");
+	}else{
+		digits[n] = '\0';
+		do{
+			digits[--n] = '0' + length % 10;
+			length /= 10;
+		}while(length);
+
+		len = http_append(http, len, "\r\nContent-Length: ");
+		len = http_append(http, len, &digits[n]);
+	}
+
+	len = http_append(http, len, "\r\nConnection: keep-alive\r\n\r\n");
+
+	if(len > sizeof(http->buff)){
+		LOG("HTTP: Request head too long.\r\n");
+		return FAIL;
+	}
+
+	return http->net->send(http->buff, len);
+}
+
+/*****************************************************************************/
+/*! @Function Name: http_body
+ *  @brief        : Pulls the body from the producer and sends it a chunk at
+ *  				a time. A body of known length must match it exactly.
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+static uint8_t http_body(Http_Client *http, uint32_t length, Http_Producer body, void *ctx){
+
+	static const char hex[] = "0123456789ABCDEF";
+	uint8_t *data = &http->buff[HTTP_FRAME];
+	uint32_t sent = 0;
+	uint16_t n, value;
+	uint8_t head;
+
+	while(1){
+
+		n = body(ctx, data, HTTP_CHUNK);
+
+		if(n > HTTP_CHUNK){
+			return FAIL;
+		}
+
+		if(length != HTTP_CHUNKED){
+
+			if(n == 0){
+				return (sent == length) ? PASS : FAIL;
+			}
+
+			if(n > length - sent){
+				LOG("HTTP: Body longer than its Content-Length.\r\n");
+				return FAIL;
+			}
+
+			if( http->net->send(data, n) ){
+				return FAIL;
+			}
+
+			sent += n;
+			continue;
+		}
+
+		if(n == 0){
+			return http->net->send((const uint8_t*)"0\r\n\r\n", 5);
+		}
+
+		// Size line in front of the data, CR LF after it
+		head = HTTP_FRAME - 2;
+		http->buff[HTTP_FRAME - 2] = '\r';
+		http->buff[HTTP_FRAME - 1] = '\n';
+		value = n;
+		do{
+			http->buff[--head] = hex[value & 0x0F];
+			value >>= 4;
+		}while(value);
+		data[n]     = '\r';
+		data[n + 1] = '\n';
+
+		if( http->net->send(&http->buff[head], HTTP_FRAME - head + n + 2) ){
+			return FAIL;
+		}
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: http_response
+ *  @brief        : Reads the response until it is complete. A body up to
+ *  				close ends with the connection.
+ *  @return       : pass or fail (timeout, lost connection, malformed)
+ */
+/*****************************************************************************/
+static uint8_t http_response(Http_Client *http){
+
+	int16_t n;
+
+	http->state    = HTTP_S_STATUS;
+	http->line_len = 0;
+
+	while(http->state != HTTP_S_DONE){
+
+		n = http->net->recv(http->buff, sizeof(http->buff), HTTP_TIMEOUT);
+
+		if(n == TRANSPORT_CLOSED && http->state == HTTP_S_EOF){
+			http->open = 0;		// Already closed by the server
+			return PASS;
+		}
+
+		if(n <= 0){
+			LOG("HTTP: No response.\r\n");
+			return FAIL;
+		}
+
+		http_feed(http, http->buff, (uint16_t)n);
+
+		if(http->state == HTTP_S_ERROR){
+			LOG("HTTP: Malformed response.\r\n");
+			return FAIL;
+		}
+	}
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: http_feed
+ *  @brief        : Response parser. Lines are collected for the line states,
+ *  				body bytes are counted off and dropped.
+ */
+/*****************************************************************************/
+static void http_feed(Http_Client *http, const uint8_t *data, uint16_t size){
+
+	uint16_t take;
+
+	while(size && http->state != HTTP_S_DONE && http->state != HTTP_S_ERROR){
+
+		switch(http->state){
+
+		case HTTP_S_BODY:
+		case HTTP_S_DATA:
+			take = (http->left < size) ? (uint16_t)http->left : size;
+			http->left -= take;
+			data += take;
+			size -= take;
+			if(http->left == 0){
+				http->state = (http->state == HTTP_S_BODY) ? HTTP_S_DONE : HTTP_S_DATAEND;
+			}
+			break;
+
+		case HTTP_S_EOF:
+			return;		// Everything up to close is body
+
+		default:
+			if(*data == '\n'){
+				http->line[http->line_len] = '\0';
+				http_line(http);
+				http->line_len = 0;
+			}else if(*data != '\r' && http->line_len < HTTP_LINE_MAX - 1){
+				http->line[http->line_len++] = *data;
+			}
+			data++;
+			size--;
+			break;
+		}
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: http_line
+ *  @brief        : Handles a complete status, header, chunk size or trailer
+ *  				line.
+ */
+/*****************************************************************************/
+static void http_line(Http_Client *http){
+
+	char *line = http->line;
+	uint32_t value = 0;
+	uint8_t i;
+
+	switch(http->state){
+
+	case HTTP_S_STATUS:
+		// HTTP/1.x NNN reason
+		if(strncmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ' ||
+		   line[9] < '1' || line[9] > '5' ||
+		   line[10] < '0' || line[10] > '9' || line[11] < '0' || line[11] > '9'){
+			http->state = HTTP_S_ERROR;
+			break;
+		}
+		http->status  = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+		http->keep    = (line[7] == '1') ? 1 : 0;
+		http->chunked = 0;
+		http->length  = 0;
+		http->left    = 0;
+		http->state   = HTTP_S_HEADER;
+		break;
+
+	case HTTP_S_HEADER:
+		if(line[0] != '\0'){
+
+			if( (i = http_header(line, "content-length")) ){
+				for(; line[i] >= '0' && line[i] <= '9'; i++){
+					value = value * 10 + (line[i] - '0');
+				}
+				http->left   = value;
+				http->length = 1;
+			}else if( (i = http_header(line, "transfer-encoding")) ){
+				http->chunked = http_contains(&line[i], "chunked");
+			}else if( (i = http_header(line, "connection")) ){
+				if( http_contains(&line[i], "close") ){
+					http->keep = 0;
+				}else if( http_contains(&line[i], "keep-alive") ){
+					http->keep = 1;
+				}
+			}
+			break;
+		}
+
+		// Blank line, the body framing is known now
+		if(http->status < 200){
+			http->state = HTTP_S_STATUS;	// 100 Continue, the real response follows
+		}else if(http->status == 204 || http->status == 304){
+			http->state = HTTP_S_DONE;
+		}else if(http->chunked){
+			http->state = HTTP_S_SIZE;
+		}else if(http->length){
+			http->state = (http->left) ? HTTP_S_BODY : HTTP_S_DONE;
+		}else{
+			http->state = HTTP_S_EOF;
+			http->keep  = 0;
+		}
+		break;
+
+	case HTTP_S_SIZE:
+		for(i = 0; line[i]; i++){
+			if(line[i] >= '0' && line[i] <= '9'){
+				value = (value << 4) | (line[i] - '0');
+			}else if((line[i] | 0x20) >= 'a' && (line[i] | 0x20) <= 'f'){
+				value = (value << 4) | ((line[i] | 0x20) - 'a' + 10);
+			}else{
+				break;	// Chunk extension
+			}
+		}
+		if(i == 0){
+			http->state = HTTP_S_ERROR;
+		}else{
+			http->left  = value;
+			http->state = (value) ? HTTP_S_DATA : HTTP_S_TRAILER;
+		}
+		break;
+
+	case HTTP_S_DATAEND:
+		http->state = (line[0] == '\0') ? HTTP_S_SIZE : HTTP_S_ERROR;
+		break;
+
+	case HTTP_S_TRAILER:
+		if(line[0] == '\0'){
+			http->state = HTTP_S_DONE;
+		}
+		break;
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: http_header
+ *  @brief        : Matches a header name, case is ignored.
+ *  @return       : index of the value (spaces skipped), 0 for another header
+ */
+/*****************************************************************************/
+static uint8_t http_header(const char *line, const char *name){
+
+	uint8_t i;
+
+	for(i = 0; name[i]; i++){
+		if((line[i] | 0x20) != name[i]){
+			return 0;
+		}
+	}
+
+	if(line[i++] != ':'){
+		return 0;
+	}
+
+	while(line[i] == ' ' || line[i] == '\t'){
+		i++;
+	}
+
+	return i;
+}
+
+/*****************************************************************************/
+/*! @Function Name: http_contains
+ *  @brief        : Looks for a lower case word in a header value, case is
+ *  				ignored.
+ *  @return       : 1 when found, else 0
+ */
+/*****************************************************************************/
+static uint8_t http_contains(const char *str, const char *word){
+
+	uint8_t i;
+
+	for(; *str; str++){
+		for(i = 0; word[i] && (str[i] | 0x20) == word[i]; i++);
+		if(word[i] == '\0'){
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*****************************************************************************/
+/*! @Function Name: http_append
+ *  @brief        : Appends a string to the request head in buff.
+ *  @return       : new length, over sizeof(buff) once it did not fit
+ */
+/*****************************************************************************/
+static uint16_t http_append(Http_Client *http, uint16_t len, const char *str){
+
+	uint16_t n = strlen(str);
+
+	if(len + n > sizeof(http->buff)){
+		return sizeof(http->buff) + 1;	// Stays over the size for the next parts
+	}
+
+	memcpy(&http->buff[len], str, n);
+	return len + n;
+}
@@ -0,0 +1,814 @@
+/*****************************************************************************/
+/*!
+ * @project    EcoSense
+ * @file       jpeg.c
+ * @author     Long Tran
+ * @version    0.0.1
+ * @brief	   Streaming JPEG marker scanner
+ * @date       28/July/2021
+ * @bug        NA
+
+ * @note       Only the marker structure is checked, entropy coded data is
+ * 			   skipped apart from 0xFF stuffing and restart markers, unless
+ * 			   a DC decoder is attached. That one walks the Huffman codes
+ * 			   bit by bit, so it needs no buffer and accepts any chunking.
+ */
+/*****************************************************************************/
+
+/******************** INCLUDE FILES ******************************************/
+#include "stdint.h"
+#include "string.h"
+#include "jpeg.h"
+
+/******************** DEFINE MACROS ******************************************/
+
+/* Parser states */
+#define JPEG_S_SOI0      0		// Expect 0xFF of SOI
+#define JPEG_S_SOI1      1		// Expect 0xD8 of SOI
+#define JPEG_S_MARK0     2		// Expect 0xFF of the next marker
+#define JPEG_S_MARK1     3		// Expect marker code (0xFF fill allowed)
+#define JPEG_S_LEN0      4		// Segment length high byte
+#define JPEG_S_LEN1      5		// Segment length low byte
+#define JPEG_S_SEG       6		// Segment payload
+#define JPEG_S_DATA      7		// Entropy coded data
+#define JPEG_S_DATA_FF   8		// 0xFF inside entropy coded data
+#define JPEG_S_DONE      9		// EOI seen
+#define JPEG_S_ERROR     10
+
+/* DC decoder states */
+#define JPEG_DC_IDLE     0		// Tables and headers not complete
+#define JPEG_DC_HUFF     1		// Reading a Huffman code
+#define JPEG_DC_BITS     2		// Reading coefficient bits
+#define JPEG_DC_DONE     3		// All MCUs decoded
+#define JPEG_DC_OFF      4		// Image not supported or corrupt
+
+/******************** STATIC FUNCTION DECLARATION*****************************/
+
+static void jpeg_index(Jpeg_Scan *scan, uint8_t marker);
+static void jpeg_marker(Jpeg_Scan *scan, uint8_t marker);
+static void jpeg_segment(Jpeg_Scan *scan, uint8_t c);
+static void jpeg_fail(Jpeg_Scan *scan, uint8_t error);
+static uint8_t jpeg_is_sof(uint8_t marker);
+static void jpeg_dc_segment(Jpeg_Scan *scan, uint8_t c);
+static void jpeg_dc_dht(Jpeg_Dc *dc, uint8_t c);
+static void jpeg_dc_sos(Jpeg_Scan *scan, uint16_t pos, uint8_t c);
+static void jpeg_dc_byte(Jpeg_Dc *dc, uint8_t c);
+static void jpeg_dc_bit(Jpeg_Dc *dc, uint8_t bit);
+static void jpeg_dc_symbol(Jpeg_Dc *dc, uint8_t sym);
+static void jpeg_dc_value(Jpeg_Dc *dc);
+static void jpeg_dc_block(Jpeg_Dc *dc);
+static void jpeg_dc_restart(Jpeg_Dc *dc);
+
+/******************** FUNCTION DECLARATION************************************/
+
+/*****************************************************************************/
+/*! @fn       jpeg_init
+ *  @brief    Resets the scanner for a new image.
+ *  @param    Scanner, DC decoder (NULL to only check the markers)
+ */
+/*****************************************************************************/
+void jpeg_init(Jpeg_Scan *scan, Jpeg_Dc *dc){
+
+	memset(scan, 0, sizeof(*scan));
+	scan->state = JPEG_S_SOI0;
+
+	if(dc != NULL){
+		memset(dc, 0, sizeof(*dc));
+		scan->dc = dc;
+	}
+}
+
+/*****************************************************************************/
+/*! @fn       jpeg_feed
+ *  @brief    Scans the next bytes of the stream. Bytes after EOI are only
+ *  		  counted.
+ *  @param    Scanner, data, data size
+ *  @return   pass or fail (scan->error tells why)
+ */
+/*****************************************************************************/
+uint8_t jpeg_feed(Jpeg_Scan *scan, const uint8_t *data, uint32_t size){
+
+	uint32_t i;
+	uint8_t c;
+
+	for(i = 0; i < size && scan->state != JPEG_S_ERROR; i++, scan->offset++){
+
+		c = data[i];
+
+		switch(scan->state){
+
+		case JPEG_S_SOI0:
+			if(c != 0xFF){
+				jpeg_fail(scan, JPEG_ERR_SOI);
+			}else{
+				scan->state = JPEG_S_SOI1;
+			}
+			break;
+
+		case JPEG_S_SOI1:
+			if(c != JPEG_SOI){
+				jpeg_fail(scan, JPEG_ERR_SOI);
+			}else{
+				scan->offset--;		// Index the 0xFF byte
+				jpeg_index(scan, JPEG_SOI);
+				scan->offset++;
+				scan->flags |= JPEG_HAS_SOI;
+				scan->state  = JPEG_S_MARK0;
+			}
+			break;
+
+		case JPEG_S_MARK0:
+			if(c != 0xFF){
+				jpeg_fail(scan, JPEG_ERR_ORDER);	// Junk between segments
+			}else{
+				scan->state = JPEG_S_MARK1;
+			}
+			break;
+
+		case JPEG_S_MARK1:
+			if(c != 0xFF){		// 0xFF fill bytes are allowed before a marker
+				jpeg_marker(scan, c);
+			}
+			break;
+
+		case JPEG_S_LEN0:
+			scan->seg_len = c << 8;
+			scan->state   = JPEG_S_LEN1;
+			break;
+
+		case JPEG_S_LEN1:
+			scan->seg_len |= c;
+
+			if(scan->seg_len < 2){
+				jpeg_fail(scan, JPEG_ERR_LENGTH);
+				break;
+			}
+
+			if(scan->count && scan->count <= JPEG_INDEX_MAX){
+				scan->index[scan->count - 1].length = scan->seg_len;
+			}
+
+			scan->seg_left = scan->seg_len - 2;
+			scan->sof_idx  = 0;
+
+			if(jpeg_is_sof(scan->marker) && scan->seg_left < sizeof(scan->sof)){
+				jpeg_fail(scan, JPEG_ERR_SOF);
+				break;
+			}
+
+			scan->state = scan->seg_left ? JPEG_S_SEG : JPEG_S_MARK0;
+			if(scan->seg_left == 0 && scan->marker == JPEG_SOS){
+				scan->state = JPEG_S_DATA;
+			}
+			break;
+
+		case JPEG_S_SEG:
+			jpeg_segment(scan, c);
+			break;
+
+		case JPEG_S_DATA:
+			if(c == 0xFF){
+				scan->state = JPEG_S_DATA_FF;
+			}else if(scan->dc != NULL){
+				jpeg_dc_byte(scan->dc, c);
+			}
+			break;
+
+		case JPEG_S_DATA_FF:
+			if(c == 0x00){
+				scan->state = JPEG_S_DATA;	// Stuffed byte
+				if(scan->dc != NULL){
+					jpeg_dc_byte(scan->dc, 0xFF);
+				}
+			}else if(c >= JPEG_RST0 && c <= JPEG_RST7){
+				scan->state = JPEG_S_DATA;	// Restart marker
+				if(scan->dc != NULL){
+					jpeg_dc_restart(scan->dc);
+				}
+			}else if(c != 0xFF){
+				jpeg_marker(scan, c);		// EOI, or next scan of a progressive image
+			}
+			break;
+
+		default:	// JPEG_S_DONE, trailing bytes are ignored
+			break;
+		}
+	}
+
+	return (scan->state == JPEG_S_ERROR) ? JPEG_FAIL : JPEG_PASS;
+}
+
+/*****************************************************************************/
+/*! @fn       jpeg_check
+ *  @brief    Final check once the whole image was fed. The image must be
+ *  		  complete (SOI, SOF, SOS, EOI) and, if given, match the
+ *  		  expected dimensions.
+ *  @param    Scanner, expected width and height (0 to skip)
+ *  @return   pass or fail
+ */
+/*****************************************************************************/
+uint8_t jpeg_check(Jpeg_Scan *scan, uint16_t width, uint16_t height){
+
+	if(scan->error != JPEG_OK){
+		return JPEG_FAIL;
+	}
+
+	if((scan->flags & JPEG_COMPLETE) != JPEG_COMPLETE){
+		jpeg_fail(scan, JPEG_ERR_TRUNC);
+		return JPEG_FAIL;
+	}
+
+	if((width && scan->width != width) || (height && scan->height != height)){
+		jpeg_fail(scan, JPEG_ERR_SOF);
+		return JPEG_FAIL;
+	}
+
+	return JPEG_PASS;
+}
+
+/*****************************************************************************/
+/*! @fn       jpeg_find
+ *  @brief    Looks up a marker in the index.
+ *  @param    Scanner, marker code
+ *  @return   first index entry of the marker or NULL
+ */
+/*****************************************************************************/
+const Jpeg_Marker* jpeg_find(const Jpeg_Scan *scan, uint8_t marker){
+
+	uint8_t i;
+	uint8_t count = (scan->count > JPEG_INDEX_MAX) ? JPEG_INDEX_MAX : scan->count;
+
+	for(i = 0; i < count; i++){
+		if(scan->index[i].marker == marker){
+			return &scan->index[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*****************************************************************************/
+/*! @fn       jpeg_dc_hash
+ *  @brief    Fingerprint of the image once it was fed completely. Bit n is
+ *  		  set when grid cell n (row major) is brighter than the mean of
+ *  		  all cells. It does not depend on the quality setting and
+ *  		  little on the resolution.
+ *  @param    DC decoder, fingerprint
+ *  @return   pass, or fail when the image could not be decoded
+ *  		  (progressive, corrupt, smaller than the grid)
+ */
+/*****************************************************************************/
+uint8_t jpeg_dc_hash(const Jpeg_Dc *dc, uint64_t *hash){
+
+	uint8_t i;
+	int32_t mean = 0;
+
+	if(dc->state != JPEG_DC_DONE){
+		return JPEG_FAIL;
+	}
+
+	for(i = 0; i < JPEG_DC_CELLS; i++){
+		if(dc->cnt[i] == 0){
+			return JPEG_FAIL;
+		}
+		mean += dc->sum[i] / dc->cnt[i];
+	}
+
+	mean /= JPEG_DC_CELLS;
+	*hash = 0;
+
+	for(i = 0; i < JPEG_DC_CELLS; i++){
+		if(dc->sum[i] / dc->cnt[i] > mean){
+			*hash |= (uint64_t)1 << i;
+		}
+	}
+
+	return JPEG_PASS;
+}
+
+/*****************************************************************************/
+/*! @fn       jpeg_dc_distance
+ *  @brief    Number of fingerprint bits that differ.
+ */
+/*****************************************************************************/
+uint8_t jpeg_dc_distance(uint64_t a, uint64_t b){
+
+	uint8_t n = 0;
+
+	for(a ^= b; a; a &= a - 1){
+		n++;
+	}
+
+	return n;
+}
+
+/*****************************************************************************/
+/*! @Function Name: jpeg_marker
+ *  @brief        : Handles a marker code. Called with scan->offset at the
+ *  				code byte.
+ */
+/*****************************************************************************/
+static void jpeg_marker(Jpeg_Scan *scan, uint8_t marker){
+
+	scan->marker = marker;
+
+	scan->offset--;		// Index the 0xFF byte
+	jpeg_index(scan, marker);
+	scan->offset++;
+
+	if(marker == JPEG_SOI){
+		jpeg_fail(scan, JPEG_ERR_ORDER);
+		return;
+	}
+
+	if(marker == JPEG_EOI){
+		if(!(scan->flags & JPEG_HAS_SOS)){
+			jpeg_fail(scan, JPEG_ERR_ORDER);	// No image data
+			return;
+		}
+		scan->flags |= JPEG_HAS_EOI;
+		scan->eoi    = scan->offset + 1;
+		scan->state  = JPEG_S_DONE;
+		return;
+	}
+
+	if(marker >= JPEG_RST0 && marker <= JPEG_RST7){
+		jpeg_fail(scan, JPEG_ERR_ORDER);	// Restart outside of scan data
+		return;
+	}
+
+	if(marker == JPEG_SOS && !(scan->flags & JPEG_HAS_SOF)){
+		jpeg_fail(scan, JPEG_ERR_ORDER);
+		return;
+	}
+
+	if(jpeg_is_sof(marker) && (scan->flags & JPEG_HAS_SOF)){
+		jpeg_fail(scan, JPEG_ERR_ORDER);	// Second frame header
+		return;
+	}
+
+	if(marker == JPEG_SOS){
+		scan->flags |= JPEG_HAS_SOS;
+	}
+
+	scan->state = JPEG_S_LEN0;
+}
+
+/*****************************************************************************/
+/*! @Function Name: jpeg_segment
+ *  @brief        : Consumes one segment payload byte. The frame header is
+ *  				kept to read the image dimensions.
+ */
+/*****************************************************************************/
+static void jpeg_segment(Jpeg_Scan *scan, uint8_t c){
+
+	if(scan->dc != NULL){
+		jpeg_dc_segment(scan, c);
+	}
+
+	if(jpeg_is_sof(scan->marker) && scan->sof_idx < sizeof(scan->sof)){
+
+		scan->sof[scan->sof_idx++] = c;
+
+		if(scan->sof_idx == sizeof(scan->sof)){
+
+			scan->height     = (scan->sof[1] << 8) | scan->sof[2];
+			scan->width      = (scan->sof[3] << 8) | scan->sof[4];
+			scan->components = scan->sof[5];
+
+			// 8 bit precision, 1 (gray) or 3 (YCbCr) components, non zero size
+			if(scan->sof[0] != 8 || scan->width == 0 || scan->height == 0 ||
+			   (scan->components != 1 && scan->components != 3) ||
+			   scan->seg_len != 8 + 3 * scan->components){
+				jpeg_fail(scan, JPEG_ERR_SOF);
+				return;
+			}
+
+			scan->flags |= JPEG_HAS_SOF;
+		}
+	}
+
+	if(--scan->seg_left == 0){
+		scan->state = (scan->marker == JPEG_SOS) ? JPEG_S_DATA : JPEG_S_MARK0;
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: jpeg_index
+ *  @brief        : Adds a marker at scan->offset to the index. Markers past
+ *  				JPEG_INDEX_MAX are counted only.
+ */
+/*****************************************************************************/
+static void jpeg_index(Jpeg_Scan *scan, uint8_t marker){
+
+	if(scan->count < JPEG_INDEX_MAX){
+		scan->index[scan->count].marker = marker;
+		scan->index[scan->count].length = 0;
+		scan->index[scan->count].offset = scan->offset;
+	}
+
+	if(scan->count < 0xFF){
+		scan->count++;
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: jpeg_fail
+ *  @brief        : Latches the first error and stops the scanner.
+ */
+/*****************************************************************************/
+static void jpeg_fail(Jpeg_Scan *scan, uint8_t error){
+
+	if(scan->error == JPEG_OK){
+		scan->error = error;
+	}
+
+	scan->state = JPEG_S_ERROR;
+}
+
+/*****************************************************************************/
+/*! @Function Name: jpeg_is_sof
+ *  @brief        : Check for a start of frame marker (SOF0-SOF15 except DHT,
+ *  				JPG and DAC).
+ */
+/*****************************************************************************/
+static uint8_t jpeg_is_sof(uint8_t marker){
+
+	return (marker >= 0xC0 && marker <= 0xCF &&
+			marker != JPEG_DHT && marker != 0xC8 && marker != 0xCC) ? 1 : 0;
+}
+
+/*****************************************************************************/
+/*! @Function Name: jpeg_dc_segment
+ *  @brief        : Collects the tables and headers the DC decoder needs from
+ *  				the segment payload. Only baseline Huffman frames with
+ *  				one interleaved scan are decoded.
+ */
+/*****************************************************************************/
+static void jpeg_dc_segment(Jpeg_Scan *scan, uint8_t c){
+
+	Jpeg_Dc *dc = scan->dc;
+	uint16_t pos = scan->seg_len - 2 - scan->seg_left;	// Byte in the payload
+	uint8_t i;
+
+	if(dc->state == JPEG_DC_OFF){
+		return;
+	}
+
+	if(scan->marker == JPEG_DHT){
+		if(pos == 0){
+			dc->pos = 0;
+		}
+		jpeg_dc_dht(dc, c);
+
+	}else if(jpeg_is_sof(scan->marker)){
+
+		if(scan->marker != JPEG_SOF0 && scan->marker != JPEG_SOF1){
+			dc->state = JPEG_DC_OFF;	// Progressive, lossless or arithmetic
+			return;
+		}
+
+		// Component specs follow P, Y, X, Nf: id, H << 4 | V, Tq
+		if(pos >= 6 && (pos - 6) / 3 < JPEG_DC_COMP_MAX){
+			i = (pos - 6) / 3;
+			if((pos - 6) % 3 == 0){
+				dc->comp_id[i] = c;
+				dc->comps = i + 1;
+			}else if((pos - 6) % 3 == 1){
+				dc->comp_hv[i] = c;
+			}
+		}
+
+	}else if(scan->marker == JPEG_SOS){
+		jpeg_dc_sos(scan, pos, c);
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: jpeg_dc_dht
+ *  @brief        : Loads one DHT byte. A segment may hold several tables,
+ *  				each is Tc << 4 | Th, 16 code counts and the symbols.
+ */
+/*****************************************************************************/
+static void jpeg_dc_dht(Jpeg_Dc *dc, uint8_t c){
+
+	Jpeg_Huff *huff;
+
+	if(dc->pos == 0){
+		if((c >> 4) > 1 || (c & 0x0F) > 1){
+			dc->state = JPEG_DC_OFF;	// Baseline uses tables 0 and 1 only
+			return;
+		}
+		dc->tbl   = ((c >> 4) << 1) | (c & 0x0F);
+		dc->total = 0;
+		dc->pos   = 1;
+		return;
+	}
+
+	huff = &dc->huff[dc->tbl];
+
+	if(dc->pos <= 16){
+		huff->bits[dc->pos - 1] = c;
+		dc->total += c;
+
+		if(++dc->pos == 17){
+			if(dc->total > JPEG_HUFF_VALS){
+				dc->state = JPEG_DC_OFF;
+			}else if(dc->total == 0){
+				dc->pos = 0;
+			}
+		}
+		return;
+	}
+
+	huff->val[dc->pos - 17] = c;
+
+	if(++dc->pos == 17 + dc->total){
+		dc->pos = 0;	// Next table
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: jpeg_dc_sos
+ *  @brief        : Reads the scan header: Ns, then Cs and Td << 4 | Ta per
+ *  				component, then three spectral selection bytes. The MCU
+ *  				layout is built on the last byte.
+ */
+/*****************************************************************************/
+static void jpeg_dc_sos(Jpeg_Scan *scan, uint16_t pos, uint8_t c){
+
+	Jpeg_Dc *dc = scan->dc;
+	uint8_t i, h, v, hv, hmax = 1, vmax = 1;
+
+	if(dc->state != JPEG_DC_IDLE){
+		dc->state = JPEG_DC_OFF;	// Only single scan images
+		return;
+	}
+
+	if(pos == 0){
+		if(c != dc->comps || c == 0){
+			dc->state = JPEG_DC_OFF;	// Non interleaved scans
+		}
+		dc->blocks = 0;
+		return;
+	}
+
+	if(pos <= 2 * dc->comps){
+
+		// Component selector, kept in pos until its table byte arrives
+		if(pos % 2 == 1){
+			dc->pos = JPEG_DC_COMP_MAX;
+			for(i = 0; i < dc->comps; i++){
+				if(dc->comp_id[i] == c){
+					dc->pos = i;
+				}
+			}
+			if(dc->pos == JPEG_DC_COMP_MAX){
+				dc->state = JPEG_DC_OFF;
+			}
+			return;
+		}
+
+		// A single component scan has one block per MCU
+		hv = (dc->comps == 1) ? 0x11 : dc->comp_hv[dc->pos];
+
+		if((hv >> 4) == 0 || (hv & 0x0F) == 0 || (c >> 4) > 1 || (c & 0x0F) > 1 ||
+		   dc->blocks + (hv >> 4) * (hv & 0x0F) > JPEG_DC_BLOCKS){
+			dc->state = JPEG_DC_OFF;
+			return;
+		}
+
+		for(v = 0; v < (hv & 0x0F); v++){
+			for(h = 0; h < (hv >> 4); h++){
+				dc->blk_comp[dc->blocks] = dc->pos;
+				dc->blk_tbl[dc->blocks]  = c;
+				dc->blk_pos[dc->blocks]  = (v << 4) | h;
+				dc->blocks++;
+			}
+		}
+		return;
+	}
+
+	if(scan->seg_left != 1){
+		return;	// Spectral selection, fixed for baseline
+	}
+
+	// Last header byte, the entropy coded data follows
+	for(i = 0; i < dc->comps && dc->comps > 1; i++){
+		if((dc->comp_hv[i] >> 4) > hmax){
+			hmax = dc->comp_hv[i] >> 4;
+		}
+		if((dc->comp_hv[i] & 0x0F) > vmax){
+			vmax = dc->comp_hv[i] & 0x0F;
+		}
+	}
+
+	dc->luma_h = (dc->comps == 1) ? 1 : dc->comp_hv[0] >> 4;
+	dc->luma_v = (dc->comps == 1) ? 1 : dc->comp_hv[0] & 0x0F;
+	dc->mcu_x  = (scan->width  + 8 * hmax - 1) / (8 * hmax);
+	dc->mcu_y  = (scan->height + 8 * vmax - 1) / (8 * vmax);
+
+	dc->state = JPEG_DC_HUFF;
+	jpeg_dc_restart(dc);
+}
+
+/*****************************************************************************/
+/*! @Function Name: jpeg_dc_byte
+ *  @brief        : Feeds one entropy coded byte, stuffing already removed.
+ */
+/*****************************************************************************/
+static void jpeg_dc_byte(Jpeg_Dc *dc, uint8_t c){
+
+	uint8_t i;
+
+	for(i = 0; i < 8; i++){
+
+		if(dc->state != JPEG_DC_HUFF && dc->state != JPEG_DC_BITS){
+			return;	// Done, or padding bits at the end of the data
+		}
+
+		jpeg_dc_bit(dc, (c >> (7 - i)) & 1);
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: jpeg_dc_bit
+ *  @brief        : Steps the decoder by one bit. Huffman codes are matched
+ *  				one length at a time against the canonical code ranges.
+ */
+/*****************************************************************************/
+static void jpeg_dc_bit(Jpeg_Dc *dc, uint8_t bit){
+
+	Jpeg_Huff *huff;
+	uint8_t count;
+
+	if(dc->state == JPEG_DC_BITS){
+		dc->value = (dc->value << 1) | bit;
+		if(--dc->need == 0){
+			jpeg_dc_value(dc);
+		}
+		return;
+	}
+
+	if(dc->k == 0){
+		huff = &dc->huff[dc->blk_tbl[dc->blk] >> 4];			// DC table
+	}else{
+		huff = &dc->huff[2 + (dc->blk_tbl[dc->blk] & 0x0F)];	// AC table
+	}
+
+	dc->code |= bit;
+	count = huff->bits[dc->len];
+
+	if(dc->code - dc->first < count){
+		jpeg_dc_symbol(dc, huff->val[dc->index + dc->code - dc->first]);
+		return;
+	}
+
+	dc->index += count;
+	dc->first  = (dc->first + count) << 1;
+	dc->code <<= 1;
+
+	if(++dc->len == 16){
+		dc->state = JPEG_DC_OFF;	// No such code
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: jpeg_dc_symbol
+ *  @brief        : Handles a decoded symbol. DC symbols give the size of the
+ *  				difference, AC symbols a zero run and a size, or EOB.
+ */
+/*****************************************************************************/
+static void jpeg_dc_symbol(Jpeg_Dc *dc, uint8_t sym){
+
+	dc->code  = 0;
+	dc->first = 0;
+	dc->index = 0;
+	dc->len   = 0;
+
+	if(dc->k == 0){
+		if(sym > 11){
+			dc->state = JPEG_DC_OFF;
+			return;
+		}
+		dc->size  = sym;
+		dc->need  = sym;
+		dc->value = 0;
+		if(sym == 0){
+			jpeg_dc_value(dc);	// No difference
+		}else{
+			dc->state = JPEG_DC_BITS;
+		}
+		return;
+	}
+
+	if((sym & 0x0F) == 0){
+		if(sym == 0xF0 && dc->k + 16 < 64){
+			dc->k += 16;	// Sixteen zeros
+		}else if(sym == 0x00){
+			jpeg_dc_block(dc);	// End of block
+		}else{
+			dc->state = JPEG_DC_OFF;
+		}
+		return;
+	}
+
+	dc->k += sym >> 4;
+
+	if(dc->k > 63){
+		dc->state = JPEG_DC_OFF;
+		return;
+	}
+
+	dc->size  = sym & 0x0F;
+	dc->need  = dc->size;
+	dc->value = 0;
+	dc->state = JPEG_DC_BITS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: jpeg_dc_value
+ *  @brief        : Completes a coefficient. The DC difference is added to
+ *  				the component predictor and luma DC terms go to their
+ *  				grid cell, AC values are not needed.
+ */
+/*****************************************************************************/
+static void jpeg_dc_value(Jpeg_Dc *dc){
+
+	int16_t diff;
+	uint8_t comp, cell;
+	uint32_t bx, by;
+
+	dc->state = JPEG_DC_HUFF;
+
+	if(dc->k != 0){
+		if(++dc->k == 64){
+			jpeg_dc_block(dc);
+		}
+		return;
+	}
+
+	// Sign extension: values below 2^(size-1) are negative
+	diff = dc->value;
+	if(dc->size && diff < (1 << (dc->size - 1))){
+		diff -= (1 << dc->size) - 1;
+	}
+
+	comp = dc->blk_comp[dc->blk];
+	dc->pred[comp] += diff;
+	dc->k = 1;
+
+	if(comp == 0){
+		bx = (dc->mcu % dc->mcu_x) * dc->luma_h + (dc->blk_pos[dc->blk] & 0x0F);
+		by = (dc->mcu / dc->mcu_x) * dc->luma_v + (dc->blk_pos[dc->blk] >> 4);
+
+		cell = (by * JPEG_DC_GRID / (dc->mcu_y * dc->luma_v)) * JPEG_DC_GRID +
+		        bx * JPEG_DC_GRID / (dc->mcu_x * dc->luma_h);
+
+		dc->sum[cell] += dc->pred[0];
+		dc->cnt[cell]++;
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: jpeg_dc_block
+ *  @brief        : Moves to the next block, and MCU when the MCU is full.
+ */
+/*****************************************************************************/
+static void jpeg_dc_block(Jpeg_Dc *dc){
+
+	dc->k = 0;
+
+	if(++dc->blk == dc->blocks){
+		dc->blk = 0;
+		if(++dc->mcu == (uint32_t)dc->mcu_x * dc->mcu_y){
+			dc->state = JPEG_DC_DONE;
+		}
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: jpeg_dc_restart
+ *  @brief        : Start of scan or restart marker: predictors are reset and
+ *  				the padding bits of the interval are dropped.
+ */
+/*****************************************************************************/
+static void jpeg_dc_restart(Jpeg_Dc *dc){
+
+	uint8_t i;
+
+	if(dc->state == JPEG_DC_BITS){
+		dc->state = JPEG_DC_HUFF;
+	}
+
+	for(i = 0; i < JPEG_DC_COMP_MAX; i++){
+		dc->pred[i] = 0;
+	}
+
+	dc->k     = 0;
+	dc->blk   = 0;
+	dc->code  = 0;
+	dc->first = 0;
+	dc->index = 0;
+	dc->len   = 0;
+}
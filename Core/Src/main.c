@@ -25,7 +25,10 @@
 #include "uart.h"
 #include "api_camera.h"
 #include "api_wifi.h"
+#include "api_ltegps.h"
 #include "round_robin.h"
+#include "power.h"
+#include "http.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -35,6 +38,9 @@
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
+#define UPLOAD_HOST "192.168.1.10"	// Image server, set per deployment
+#define UPLOAD_PORT 80
+#define UPLOAD_PATH "/images"
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -50,7 +56,7 @@ UART_HandleTypeDef huart3;
 
 /* USER CODE BEGIN PV */
 
-
+static Http_Client upload_http;	// Image uploads, the connection is kept between them
 
 /* USER CODE END PV */
 
@@ -68,6 +74,13 @@ static void MX_UART4_Init(void);
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
 
+/* Device sequences, one task per module UART */
+static Rr_Task rr_tasks[] = {
+	{ .name = "CAMERA", .thread = api_camera_task,    .port = &uart_camera },
+	{ .name = "WIFI",   .thread = api_wifi_task,      .port = &uart_wifi },
+	{ .name = "GPS",    .thread = api_ltegps_gpstask, .port = &uart_ltegps },
+};
+
 /* USER CODE END 0 */
 
 /**
@@ -103,6 +116,9 @@ int main(void)
   MX_USART1_UART_Init();
   MX_UART4_Init();
   /* USER CODE BEGIN 2 */
+  uart_init(); // Start per-port RX DMA
+  power_init(); // Wake timers for sleep/Stop 2 waits
+  http_init(&upload_http, &wifi_transport, UPLOAD_HOST, UPLOAD_PORT, 0);
 
   /* USER CODE END 2 */
 
@@ -113,86 +129,48 @@ int main(void)
     /* USER CODE END WHILE */
 #if 0
 	    api_ltegps_check();
-		HAL_Delay(1000);
+		power_stop(1000);
 		api_ltegps_gpsconnect();
 		api_ltegps_lteconnect();
 		api_ltegps_lteping();
-		HAL_Delay(1000);
+		power_stop(1000);
 #endif
 
-#if 1
-		api_wifi_check();
-		HAL_Delay(1000);
-		api_wifi_check();
-		HAL_Delay(1000);
-		api_wifi_check();
-		HAL_Delay(1000);
-		api_wifi_connect();
-		HAL_Delay(1000);
+#if 0
+		api_wifi_connect();		// Only the setup steps the link state needs
 		api_wifi_ping();
-		__NOP();
+		power_stop(1000);
 #endif
 
 #if 0
 		api_wifi_connect();
-		HAL_Delay(5000);
+		power_stop(5000);
 		api_wifi_ping();
 #endif
 
 #if 0
 
 		api_camera_connect();
-		HAL_Delay(5000);
+		power_stop(5000);
 #endif
 
 #if 0
-		switch(rrCurrentState){
-
-		case START:
-
-			rrCurrentState = CAMERA;
-
-			break;
-
-		case CAMERA:
-
-			// camera image data get using SC03MPA module
-			//api_camera_connect();
-			HAL_Delay(1000);
-
-			rrPreviousState = rrCurrentState;
-			rrCurrentState = WIFI;
-
-			break;
-
-		case WIFI:
-
-			// Wi-Fi ping to google.com using WE310F5-I dev kit
-			api_wifi_connect();
-			HAL_Delay(1000);
-
-			rrPreviousState = rrCurrentState;
-			rrCurrentState = DATA_AQ;
-
-			break;
-
-
-
-		case DATA_AQ:
-
-			// retreive information from sensors
-			//api_camera_connect();
-			HAL_Delay(1000);
-			api_wifi_ping();
-			HAL_Delay(1000);
-			// upload information
-
-			// return to Wi-Fi or LTE
-			rrCurrentState = rrPreviousState;
-
-			break;
+		// Capture only when the camera sees motion, Stop 1 in between
+		api_camera_motioncapture(CAMERA_MOTION_TIMEOUT);
+#endif
 
+#if 0
+		// Camera read and Wi-Fi upload overlap chunk by chunk
+		if( api_wifi_connect() == PASS ){
+			api_camera_upload(&upload_http, UPLOAD_PATH);
 		}
+		power_stop(5000);
+#endif
+
+#if 1
+		// Camera, Wi-Fi and GPS sequences run concurrently on their ports
+		rr_run(rr_tasks, sizeof(rr_tasks) / sizeof(rr_tasks[0]));
+		power_stop(1000);
 #endif
     /* USER CODE BEGIN 3 */
   }
@@ -287,8 +265,7 @@ static void MX_UART4_Init(void)
     Error_Handler();
   }
   /* USER CODE BEGIN UART4_Init 2 */
-  UART4->CR1 |= USART_CR1_RXNEIE; // Enable RXNE interrupt
-  UART4->RQR |= USART_RQR_RXFRQ;  // Clear RXNE flag
+  UART4->RQR |= USART_RQR_RXFRQ;  // Clear RXNE flag, RX is moved by DMA
   /* USER CODE END UART4_Init 2 */
 
 }
@@ -323,8 +300,7 @@ static void MX_USART1_UART_Init(void)
     Error_Handler();
   }
   /* USER CODE BEGIN USART1_Init 2 */
-  USART1->CR1 |= USART_CR1_RXNEIE; // Enable RXNE interrupt
-  USART1->RQR |= USART_RQR_RXFRQ;  // Clear RXNE flag
+  USART1->RQR |= USART_RQR_RXFRQ;  // Clear RXNE flag, RX is moved by DMA
   /* USER CODE END USART1_Init 2 */
 
 }
@@ -395,8 +371,7 @@ static void MX_USART3_UART_Init(void)
     Error_Handler();
   }
   /* USER CODE BEGIN USART3_Init 2 */
-  USART3->CR1 |= USART_CR1_RXNEIE; // enable RX interrupt
-  USART3->RQR |= USART_RQR_RXFRQ;  // Clear RXNE flag
+  USART3->RQR |= USART_RQR_RXFRQ;  // Clear RXNE flag, RX is moved by DMA
   /* USER CODE END USART3_Init 2 */
 
 }
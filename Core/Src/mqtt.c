@@ -0,0 +1,460 @@
+/*****************************************************************************/
+/*!
+ * @project    EcoSense
+ * @file       mqtt.c
+ * @author     Long Tran
+ * @version    0.0.1
+ * @brief	   MQTT 3.1.1 QoS 1 publisher
+ * @date       28/July/2021
+ * @bug        NA
+
+ * @note       The in-flight slots form a ring in send order, so publishes
+ * 			   are sent again in their original order after a reconnect.
+ * 			   A slot is reused once every older slot is acknowledged;
+ * 			   brokers acknowledge in order, so this costs nothing.
+ */
+/*****************************************************************************/
+
+/******************** INCLUDE FILES ******************************************/
+#include "stdint.h"
+#include "string.h"
+#include "mqtt.h"
+#include "uart.h"
+#include "stm32l4xx_hal.h"
+
+/******************** STATIC FUNCTION DECLARATION*****************************/
+
+static uint8_t mqtt_read(Mqtt_Client *mqtt, uint32_t timeout);
+static void mqtt_feed(Mqtt_Client *mqtt, const uint8_t *data, uint16_t size);
+static void mqtt_packet(Mqtt_Client *mqtt);
+static uint8_t mqtt_send(Mqtt_Client *mqtt, uint16_t len);
+static uint8_t mqtt_sendslot(Mqtt_Client *mqtt, Mqtt_Slot *slot);
+static uint16_t mqtt_header(uint8_t *buff, uint8_t type, uint32_t remaining);
+static void mqtt_lost(Mqtt_Client *mqtt);
+
+/******************** FUNCTION DECLARATION************************************/
+
+/*****************************************************************************/
+/*! @fn       mqtt_init
+ *  @brief    Sets up a client, no connection is made yet. The in-flight
+ *  		  slots start empty, call once, not per connection.
+ *  @param    Client, transport, broker, port, 1 for TLS, client id
+ */
+/*****************************************************************************/
+void mqtt_init(Mqtt_Client *mqtt, const Transport *net, const char *host,
+			   uint16_t port, uint8_t tls, const char *client_id){
+
+	memset(mqtt, 0, sizeof(*mqtt));
+	mqtt->net       = net;
+	mqtt->host      = host;
+	mqtt->port      = port;
+	mqtt->tls       = tls;
+	mqtt->client_id = client_id;
+}
+
+/*****************************************************************************/
+/*! @fn       mqtt_connect
+ *  @brief    Opens the socket, sends CONNECT and waits for CONNACK, then
+ *  		  sends the publishes still in flight again with DUP. Returns
+ *  		  at once when connected.
+ *  @return   pass or fail
+ */
+/*****************************************************************************/
+uint8_t mqtt_connect(Mqtt_Client *mqtt){
+
+	uint16_t id_len = strlen(mqtt->client_id);
+	uint16_t len;
+	uint32_t start;
+	uint8_t i;
+
+	if(mqtt->connected){
+		return PASS;
+	}
+
+	if(id_len > MQTT_BUFF - 19){
+		return FAIL;
+	}
+
+	if( mqtt->net->open(mqtt->host, mqtt->port, mqtt->tls) ){
+		LOG("MQTT: Connect failed.\r\n");
+		return FAIL;
+	}
+
+	mqtt->state   = MQTT_S_TYPE;
+	mqtt->connack = 0xFF;
+
+	// Protocol name and level, flags (clean session 0), keep alive, client id
+	len = mqtt_header(mqtt->buff, MQTT_CONNECT, 12 + id_len);
+	memcpy(&mqtt->buff[len], "\x00\x04MQTT\x04\x00", 8);
+	len += 8;
+	mqtt->buff[len++] = MQTT_KEEPALIVE >> 8;
+	mqtt->buff[len++] = MQTT_KEEPALIVE & 0xFF;
+	mqtt->buff[len++] = id_len >> 8;
+	mqtt->buff[len++] = id_len & 0xFF;
+	memcpy(&mqtt->buff[len], mqtt->client_id, id_len);
+	len += id_len;
+
+	mqtt->connected = 1;	// For mqtt_send, confirmed by CONNACK below
+	if( mqtt_send(mqtt, len) ){
+		return FAIL;
+	}
+
+	start = HAL_GetTick();
+	while(mqtt->connack == 0xFF){
+
+		if( HAL_GetTick() - start >= MQTT_TIMEOUT ||
+			mqtt_read(mqtt, MQTT_TIMEOUT - (HAL_GetTick() - start)) ){
+			LOG("MQTT: No CONNACK.\r\n");
+			mqtt_lost(mqtt);
+			return FAIL;
+		}
+	}
+
+	if(mqtt->connack != 0){
+		LOG("MQTT: Connection refused.\r\n");
+		mqtt_lost(mqtt);
+		return FAIL;
+	}
+
+	// Publishes not acknowledged before, in their original order
+	for(i = 0; i < mqtt->count; i++){
+
+		Mqtt_Slot *slot = &mqtt->slot[(mqtt->head + i) % MQTT_INFLIGHT];
+
+		if(slot->id && mqtt_sendslot(mqtt, slot)){
+			return FAIL;
+		}
+	}
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @fn       mqtt_publish
+ *  @brief    Queues a QoS 1 publish and sends it without waiting for its
+ *  		  PUBACK. With all MQTT_INFLIGHT slots in use, waits for the
+ *  		  oldest to be acknowledged first. Connects when needed.
+ *  @param    Client, topic, payload, payload length
+ *  @return   pass once sent, fail when it does not fit, no slot came free
+ *  		  or the send failed. A queued publish stays queued through a
+ *  		  failed send and goes out on the next connect.
+ */
+/*****************************************************************************/
+uint8_t mqtt_publish(Mqtt_Client *mqtt, const char *topic, const uint8_t *payload, uint8_t len){
+
+	uint16_t topic_len = strlen(topic);
+	uint32_t start = HAL_GetTick();
+	Mqtt_Slot *slot;
+
+	if(topic_len == 0 || topic_len > MQTT_TOPIC_MAX || len > MQTT_PAYLOAD_MAX){
+		return FAIL;
+	}
+
+	// Window full, wait for the oldest PUBACK
+	while(mqtt->count == MQTT_INFLIGHT){
+
+		if( mqtt_connect(mqtt) || HAL_GetTick() - start >= MQTT_TIMEOUT ){
+			return FAIL;
+		}
+
+		mqtt_read(mqtt, MQTT_TIMEOUT - (HAL_GetTick() - start));
+	}
+
+	slot = &mqtt->slot[(mqtt->head + mqtt->count) % MQTT_INFLIGHT];
+
+	if(++mqtt->next_id == 0){
+		mqtt->next_id = 1;	// 0 is not a valid identifier
+	}
+
+	slot->id        = mqtt->next_id;
+	slot->sent      = 0;
+	slot->topic_len = topic_len;
+	slot->len       = len;
+	memcpy(slot->topic, topic, topic_len);
+	memcpy(slot->payload, payload, len);
+
+	mqtt->count++;
+	mqtt->inflight++;
+
+	if( !mqtt->connected ){
+		return mqtt_connect(mqtt);	// Sends the queue, this one included
+	}
+
+	return mqtt_sendslot(mqtt, slot);
+}
+
+/*****************************************************************************/
+/*! @fn       mqtt_flush
+ *  @brief    Waits until every publish in flight is acknowledged.
+ *  @param    Client, timeout in ms
+ *  @return   pass or fail (some still in flight)
+ */
+/*****************************************************************************/
+uint8_t mqtt_flush(Mqtt_Client *mqtt, uint32_t timeout){
+
+	uint32_t start = HAL_GetTick();
+
+	while(mqtt->inflight){
+
+		if( mqtt_connect(mqtt) || HAL_GetTick() - start >= timeout ){
+			return FAIL;
+		}
+
+		mqtt_read(mqtt, timeout - (HAL_GetTick() - start));
+	}
+
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @fn       mqtt_poll
+ *  @brief    Reads incoming packets for up to timeout ms, or until one
+ *  		  arrives. Sends PINGREQ when the link was idle for half the
+ *  		  keep alive.
+ *  @param    Client, timeout in ms
+ *  @return   pass, or fail when the connection was lost
+ */
+/*****************************************************************************/
+uint8_t mqtt_poll(Mqtt_Client *mqtt, uint32_t timeout){
+
+	if( !mqtt->connected ){
+		return FAIL;
+	}
+
+	if(HAL_GetTick() - mqtt->last_tx >= MQTT_KEEPALIVE * 500UL){
+		mqtt->buff[0] = MQTT_PINGREQ;
+		mqtt->buff[1] = 0;
+		if( mqtt_send(mqtt, 2) ){
+			return FAIL;
+		}
+	}
+
+	return mqtt_read(mqtt, timeout);
+}
+
+/*****************************************************************************/
+/*! @fn       mqtt_disconnect
+ *  @brief    Sends DISCONNECT and closes the socket. Publishes in flight
+ *  		  stay queued for the next connect.
+ */
+/*****************************************************************************/
+void mqtt_disconnect(Mqtt_Client *mqtt){
+
+	if( !mqtt->connected ){
+		return;
+	}
+
+	mqtt->buff[0] = MQTT_DISCONNECT;
+	mqtt->buff[1] = 0;
+	mqtt_send(mqtt, 2);
+
+	mqtt_lost(mqtt);
+}
+
+/*****************************************************************************/
+/*! @Function Name: mqtt_read
+ *  @brief        : Reads what the socket has within timeout ms and parses it.
+ *  @return       : pass, or fail when the connection was lost
+ */
+/*****************************************************************************/
+static uint8_t mqtt_read(Mqtt_Client *mqtt, uint32_t timeout){
+
+	int16_t n;
+
+	n = mqtt->net->recv(mqtt->buff, sizeof(mqtt->buff), timeout);
+
+	if(n == TRANSPORT_CLOSED){
+		LOG("MQTT: Connection lost.\r\n");
+		mqtt_lost(mqtt);
+		return FAIL;
+	}
+
+	mqtt_feed(mqtt, mqtt->buff, (uint16_t)n);
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: mqtt_feed
+ *  @brief        : Incoming packet parser, takes bytes in chunks of any size.
+ *  				Only the first bytes of a body are kept, that is all
+ *  				CONNACK and PUBACK have.
+ */
+/*****************************************************************************/
+static void mqtt_feed(Mqtt_Client *mqtt, const uint8_t *data, uint16_t size){
+
+	uint8_t c;
+
+	while(size--){
+
+		c = *data++;
+
+		switch(mqtt->state){
+
+		case MQTT_S_TYPE:
+			mqtt->type     = c;
+			mqtt->left     = 0;
+			mqtt->shift    = 0;
+			mqtt->body_len = 0;
+			mqtt->state    = MQTT_S_LENGTH;
+			break;
+
+		case MQTT_S_LENGTH:
+			mqtt->left |= (uint32_t)(c & 0x7F) << mqtt->shift;
+			mqtt->shift += 7;
+			if(c & 0x80){
+				if(mqtt->shift > 21){
+					mqtt_lost(mqtt);	// Malformed, more than 4 bytes
+					return;
+				}
+				break;
+			}
+			if(mqtt->left == 0){
+				mqtt_packet(mqtt);
+				mqtt->state = MQTT_S_TYPE;
+			}else{
+				mqtt->state = MQTT_S_BODY;
+			}
+			break;
+
+		default:
+			if(mqtt->body_len < sizeof(mqtt->body)){
+				mqtt->body[mqtt->body_len++] = c;
+			}
+			if(--mqtt->left == 0){
+				mqtt_packet(mqtt);
+				mqtt->state = MQTT_S_TYPE;
+			}
+			break;
+		}
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: mqtt_packet
+ *  @brief        : Handles a complete incoming packet. A PUBACK frees its
+ *  				slot, the ring head then moves past acknowledged slots.
+ */
+/*****************************************************************************/
+static void mqtt_packet(Mqtt_Client *mqtt){
+
+	uint16_t id;
+	uint8_t i;
+
+	switch(mqtt->type & 0xF0){
+
+	case MQTT_CONNACK:
+		if(mqtt->body_len >= 2){
+			mqtt->session = mqtt->body[0] & 0x01;
+			mqtt->connack = mqtt->body[1];
+		}
+		break;
+
+	case MQTT_PUBACK:
+		if(mqtt->body_len < 2){
+			break;
+		}
+
+		id = (mqtt->body[0] << 8) | mqtt->body[1];
+
+		for(i = 0; i < mqtt->count; i++){
+			Mqtt_Slot *slot = &mqtt->slot[(mqtt->head + i) % MQTT_INFLIGHT];
+			if(slot->id == id){
+				slot->id = 0;
+				mqtt->inflight--;
+				mqtt->acked++;
+				break;
+			}
+		}
+
+		while(mqtt->count && mqtt->slot[mqtt->head].id == 0){
+			mqtt->head = (mqtt->head + 1) % MQTT_INFLIGHT;
+			mqtt->count--;
+		}
+		break;
+
+	default:
+		break;	// PINGRESP, nothing is subscribed
+	}
+}
+
+/*****************************************************************************/
+/*! @Function Name: mqtt_send
+ *  @brief        : Sends len bytes of buff, the connection is dropped on
+ *  				failure.
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+static uint8_t mqtt_send(Mqtt_Client *mqtt, uint16_t len){
+
+	if( !mqtt->connected || mqtt->net->send(mqtt->buff, len) ){
+		mqtt_lost(mqtt);
+		return FAIL;
+	}
+
+	mqtt->last_tx = HAL_GetTick();
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @Function Name: mqtt_sendslot
+ *  @brief        : Sends the QoS 1 PUBLISH of a slot, with DUP when it went
+ *  				out before.
+ *  @return       : pass or fail
+ */
+/*****************************************************************************/
+static uint8_t mqtt_sendslot(Mqtt_Client *mqtt, Mqtt_Slot *slot){
+
+	uint16_t len;
+
+	len = mqtt_header(mqtt->buff, MQTT_PUBLISH | MQTT_QOS1 | (slot->sent ? MQTT_DUP : 0),
+					  2 + slot->topic_len + 2 + slot->len);
+
+	mqtt->buff[len++] = 0;
+	mqtt->buff[len++] = slot->topic_len;
+	memcpy(&mqtt->buff[len], slot->topic, slot->topic_len);
+	len += slot->topic_len;
+	mqtt->buff[len++] = slot->id >> 8;
+	mqtt->buff[len++] = slot->id & 0xFF;
+	memcpy(&mqtt->buff[len], slot->payload, slot->len);
+	len += slot->len;
+
+	slot->sent = 1;
+	return mqtt_send(mqtt, len);
+}
+
+/*****************************************************************************/
+/*! @Function Name: mqtt_header
+ *  @brief        : Writes the fixed header, remaining length as a varint.
+ *  @return       : header length
+ */
+/*****************************************************************************/
+static uint16_t mqtt_header(uint8_t *buff, uint8_t type, uint32_t remaining){
+
+	uint16_t len = 0;
+
+	buff[len++] = type;
+
+	do{
+		buff[len] = remaining & 0x7F;
+		remaining >>= 7;
+		if(remaining){
+			buff[len] |= 0x80;
+		}
+		len++;
+	}while(remaining);
+
+	return len;
+}
+
+/*****************************************************************************/
+/*! @Function Name: mqtt_lost
+ *  @brief        : Closes the socket after a failure or disconnect. The
+ *  				in-flight slots are kept.
+ */
+/*****************************************************************************/
+static void mqtt_lost(Mqtt_Client *mqtt){
+
+	mqtt->net->close();
+	mqtt->connected = 0;
+	mqtt->state     = MQTT_S_TYPE;
+}
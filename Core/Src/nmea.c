@@ -0,0 +1,921 @@
+/*****************************************************************************/
+/*!
+ * @project    EcoSense
+ * @file       nmea.c
+ * @author     Long Tran
+ * @version    0.0.1
+ * @brief	   NMEA 0183 stream parser
+ * @date       28/July/2021
+ * @bug        NA
+
+ * @note       Each field is handed to its sentence at the ',' or '*' that
+ * 			   ends it. Sentences of other types are dropped at their
+ * 			   address field and cost nothing more. Only one sentence is
+ * 			   read at a time, the pending records share a union.
+ */
+/*****************************************************************************/
+
+/******************** INCLUDE FILES ******************************************/
+#include "stdint.h"
+#include "string.h"
+#include "nmea.h"
+#include "uart.h"
+
+/******************** DEFINE MACROS ******************************************/
+
+/* Fields a sentence needs to be taken, address included */
+#define NMEA_RMC_FIELDS   10		// Up to the date
+#define NMEA_GGA_FIELDS   10		// Up to the altitude
+#define NMEA_GSA_FIELDS   18		// Up to VDOP
+#define NMEA_GSV_FIELDS   4		// Up to satellites in view
+#define NMEA_VTG_FIELDS   9		// Up to the speed unit
+
+/******************** STATIC FUNCTION DECLARATION*****************************/
+
+static void nmea_put(Nmea_Parser *nmea, char c);
+static void nmea_field(Nmea_Parser *nmea);
+static void nmea_address(Nmea_Parser *nmea);
+static void nmea_rmc(Nmea_Parser *nmea, const Nmea_Field *f);
+static void nmea_gga(Nmea_Parser *nmea, const Nmea_Field *f);
+static void nmea_gsa(Nmea_Parser *nmea, const Nmea_Field *f);
+static void nmea_gsv(Nmea_Parser *nmea, const Nmea_Field *f);
+static void nmea_vtg(Nmea_Parser *nmea, const Nmea_Field *f);
+static uint8_t nmea_take(Nmea_Parser *nmea);
+static void nmea_sky(Nmea_Parser *nmea, const Nmea_Gsv *gsv);
+static uint8_t nmea_epoch(Nmea_Parser *nmea, uint32_t time);
+static uint8_t nmea_publish(Nmea_Parser *nmea);
+static uint8_t nmea_gnss(const char *talker);
+static uint16_t nmea_dop(const Nmea_Field *f);
+static uint8_t nmea_hex(char c);
+static uint32_t nmea_fixed(const Nmea_Field *f, uint8_t digits);
+static uint8_t nmea_time(const Nmea_Field *f, uint32_t *ms);
+static uint8_t nmea_angle(const Nmea_Field *f, uint8_t deg_max, int32_t *angle);
+
+/******************** FUNCTION DECLARATION************************************/
+
+/*****************************************************************************/
+/*! @fn       nmea_init
+ *  @brief    Clears the parser and its results.
+ */
+/*****************************************************************************/
+void nmea_init(Nmea_Parser *nmea){
+
+	memset(nmea, 0, sizeof(Nmea_Parser));
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_feed
+ *  @brief    Parses the next bytes of the stream. Sentences may be split
+ *  		  across calls at any byte.
+ *  @param    Parser, data, size
+ *  @return   NMEA_* bits of the sentences taken in this call
+ */
+/*****************************************************************************/
+uint8_t nmea_feed(Nmea_Parser *nmea, const char *data, uint16_t size){
+
+	uint8_t taken = 0;
+	uint8_t hex;
+	uint16_t i;
+	char c;
+
+	for(i = 0; i < size; i++){
+
+		c = data[i];
+
+		// '$' always starts a sentence, a cut one is dropped
+		if(c == '$'){
+			if(nmea->state != NMEA_S_IDLE && nmea->type){
+				nmea->errors++;
+			}
+			memset(&nmea->field, 0, sizeof(Nmea_Field));
+			nmea->state    = NMEA_S_BODY;
+			nmea->sum      = 0;
+			nmea->length   = 0;
+			nmea->type     = 0;
+			nmea->index    = 0;
+			nmea->addr_len = 0;
+			continue;
+		}
+
+		switch(nmea->state){
+
+		case NMEA_S_BODY:
+
+			if(c == '*'){
+				nmea_field(nmea);
+				nmea->state = NMEA_S_SUM_HI;
+
+			}else if(c < ' ' || c > '~' || ++nmea->length > NMEA_LINE_MAX){
+				nmea->state = NMEA_S_IDLE;	// No checksum or garbage
+				nmea->errors++;
+
+			}else{
+				nmea->sum ^= c;
+				if(c == ','){
+					nmea_field(nmea);
+				}else{
+					nmea_put(nmea, c);
+				}
+			}
+
+			// Other sentence types are not read further
+			if(nmea->index > 0 && nmea->type == 0){
+				nmea->state = NMEA_S_IDLE;
+			}
+			break;
+
+		case NMEA_S_SUM_HI:
+
+			hex = nmea_hex(c);
+			nmea->check = hex << 4;
+			nmea->state = (hex > 0x0F) ? NMEA_S_IDLE : NMEA_S_SUM_LO;
+			if(hex > 0x0F){
+				nmea->errors++;
+			}
+			break;
+
+		case NMEA_S_SUM_LO:
+
+			hex = nmea_hex(c);
+			nmea->state = NMEA_S_IDLE;
+			if(hex > 0x0F || (nmea->check | hex) != nmea->sum){
+				nmea->errors++;
+			}else{
+				taken |= nmea_take(nmea);
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return taken;
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_close
+ *  @brief    Publishes the epoch being merged, for the end of a stream.
+ *  @return   NMEA_FIX, or 0 when nothing was merged
+ */
+/*****************************************************************************/
+uint8_t nmea_close(Nmea_Parser *nmea){
+
+	return nmea_publish(nmea);
+}
+
+/******************** STATIC FUNCTION DEFINITION******************************/
+
+/*****************************************************************************/
+/*! @fn       nmea_put
+ *  @brief    Adds a character to the field being read.
+ */
+/*****************************************************************************/
+static void nmea_put(Nmea_Parser *nmea, char c){
+
+	Nmea_Field *f = &nmea->field;
+
+	if(nmea->index == 0){
+		if(nmea->addr_len < NMEA_ADDR_MAX){
+			nmea->addr[nmea->addr_len] = c;
+		}
+		nmea->addr_len++;
+		return;
+	}
+
+	if(f->len == 0){
+		f->first  = c;
+		f->number = 1;
+	}
+	if(f->len < 0xFF){
+		f->len++;
+	}
+
+	if(!f->number){
+		return;
+	}
+
+	if(c >= '0' && c <= '9'){
+		if(f->dot){
+			if(f->frac_len < NMEA_FRAC_DIGITS){
+				f->frac = f->frac * 10 + (c - '0');
+				f->frac_len++;
+			}
+		}else if(f->whole < 100000000){
+			f->whole = f->whole * 10 + (c - '0');
+		}else{
+			f->number = 0;	// Too long for 32 bits
+		}
+	}else if(c == '.' && !f->dot){
+		f->dot = 1;
+	}else if(c == '-' && f->len == 1){
+		f->neg = 1;
+	}else{
+		f->number = 0;
+	}
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_field
+ *  @brief    Ends the field being read and hands it to its sentence.
+ */
+/*****************************************************************************/
+static void nmea_field(Nmea_Parser *nmea){
+
+	Nmea_Field *f = &nmea->field;
+
+	while(f->frac_len < NMEA_FRAC_DIGITS){
+		f->frac *= 10;
+		f->frac_len++;
+	}
+
+	if(nmea->index == 0){
+		nmea_address(nmea);
+	}
+
+	switch(nmea->index ? nmea->type : 0){
+
+	case NMEA_RMC:
+		nmea_rmc(nmea, f);
+		break;
+
+	case NMEA_GGA:
+		nmea_gga(nmea, f);
+		break;
+
+	case NMEA_GSA:
+		nmea_gsa(nmea, f);
+		break;
+
+	case NMEA_GSV:
+		nmea_gsv(nmea, f);
+		break;
+
+	case NMEA_VTG:
+		nmea_vtg(nmea, f);
+		break;
+
+	default:
+		break;
+	}
+
+	if(nmea->index < 0xFF){
+		nmea->index++;
+	}
+	memset(f, 0, sizeof(Nmea_Field));
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_address
+ *  @brief    Sorts the sentence by its type, any talker (GP, GN, GL..).
+ */
+/*****************************************************************************/
+static void nmea_address(Nmea_Parser *nmea){
+
+	nmea->type = 0;
+
+	if(nmea->addr_len != NMEA_ADDR_MAX){
+		return;
+	}
+
+	memset(&nmea->pend, 0, sizeof(nmea->pend));
+
+	if(memcmp(nmea->addr + 2, "RMC", 3) == 0){
+		nmea->type = NMEA_RMC;
+		nmea->pend.rmc.valid = 1;	// Until a field says otherwise
+
+	}else if(memcmp(nmea->addr + 2, "GGA", 3) == 0){
+		nmea->type = NMEA_GGA;
+		nmea->pend.gga.valid = 1;
+
+	}else if(memcmp(nmea->addr + 2, "GSA", 3) == 0){
+		nmea->type = NMEA_GSA;
+
+	}else if(memcmp(nmea->addr + 2, "GSV", 3) == 0){
+		nmea->type = NMEA_GSV;
+		nmea->pend.gsv.gnss = nmea_gnss(nmea->addr);
+
+	}else if(memcmp(nmea->addr + 2, "VTG", 3) == 0){
+		nmea->type = NMEA_VTG;
+	}
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_rmc
+ *  @brief    RMC field, ex.
+ *  		  $GPRMC,161229.487,A,3723.2475,N,12158.3416,W,0.13,309.62,120598,,*10
+ */
+/*****************************************************************************/
+static void nmea_rmc(Nmea_Parser *nmea, const Nmea_Field *f){
+
+	Nmea_Rmc *rmc = &nmea->pend.rmc;
+	uint32_t knots;
+
+	switch(nmea->index){
+
+	case 1:
+		if( nmea_time(f, &rmc->time) ){
+			rmc->valid = 0;
+		}else{
+			rmc->timed = 1;
+		}
+		break;
+
+	case 2:
+		if(f->len != 1 || f->first != 'A'){
+			rmc->valid = 0;
+		}
+		break;
+
+	case 3:
+		if( nmea_angle(f, 90, &rmc->lat) ){
+			rmc->valid = 0;
+		}
+		break;
+
+	case 4:
+		if(f->len == 1 && f->first == 'S'){
+			rmc->lat = -rmc->lat;
+		}else if(f->len != 1 || f->first != 'N'){
+			rmc->valid = 0;
+		}
+		break;
+
+	case 5:
+		if( nmea_angle(f, 180, &rmc->lon) ){
+			rmc->valid = 0;
+		}
+		break;
+
+	case 6:
+		if(f->len == 1 && f->first == 'W'){
+			rmc->lon = -rmc->lon;
+		}else if(f->len != 1 || f->first != 'E'){
+			rmc->valid = 0;
+		}
+		break;
+
+	case 7:
+		// Knots to m/h, 1 knot is 1852 m/h
+		if(f->len && f->number && !f->neg && f->whole < 1000000){
+			knots = nmea_fixed(f, 3);
+			rmc->speed = (knots / 1000) * 1852 + (knots % 1000) * 1852 / 1000;
+		}
+		break;
+
+	case 8:
+		if(f->len && f->number && !f->neg && f->whole < 360){
+			rmc->course = nmea_fixed(f, 2);
+		}
+		break;
+
+	case 9:
+		if(f->len == 6 && f->number && !f->dot){
+			rmc->day   = f->whole / 10000;
+			rmc->month = f->whole / 100 % 100;
+			rmc->year  = 2000 + f->whole % 100;
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_gga
+ *  @brief    GGA field, ex.
+ *  		  $GPGGA,161229.487,3723.2475,N,12158.3416,W,1,07,1.0,9.0,M,,,,0000*18
+ */
+/*****************************************************************************/
+static void nmea_gga(Nmea_Parser *nmea, const Nmea_Field *f){
+
+	Nmea_Gga *gga = &nmea->pend.gga;
+
+	switch(nmea->index){
+
+	case 1:
+		if( nmea_time(f, &gga->time) == PASS ){
+			gga->timed = 1;
+		}
+		break;
+
+	case 2:
+		if( nmea_angle(f, 90, &gga->lat) ){
+			gga->valid = 0;
+		}
+		break;
+
+	case 3:
+		if(f->len == 1 && f->first == 'S'){
+			gga->lat = -gga->lat;
+		}else if(f->len != 1 || f->first != 'N'){
+			gga->valid = 0;
+		}
+		break;
+
+	case 4:
+		if( nmea_angle(f, 180, &gga->lon) ){
+			gga->valid = 0;
+		}
+		break;
+
+	case 5:
+		if(f->len == 1 && f->first == 'W'){
+			gga->lon = -gga->lon;
+		}else if(f->len != 1 || f->first != 'E'){
+			gga->valid = 0;
+		}
+		break;
+
+	case 6:
+		if(f->len == 1 && f->number && f->whole){
+			gga->quality = f->whole;
+		}else{
+			gga->valid = 0;
+		}
+		break;
+
+	case 7:
+		if(f->len && f->number && !f->dot && f->whole < 0x100){
+			gga->used = f->whole;
+		}
+		break;
+
+	case 8:
+		gga->hdop = nmea_dop(f);
+		break;
+
+	case 9:
+		// Metres to cm, kept within +-100 km
+		if(f->len && f->number && f->whole < 100000){
+			gga->alt = (int32_t)nmea_fixed(f, 2);
+			if(f->neg){
+				gga->alt = -gga->alt;
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_gsa
+ *  @brief    GSA field, ex.
+ *  		  $GPGSA,A,3,07,02,26,27,09,04,15,,,,,,1.8,1.0,1.5*33
+ */
+/*****************************************************************************/
+static void nmea_gsa(Nmea_Parser *nmea, const Nmea_Field *f){
+
+	Nmea_Gsa *gsa = &nmea->pend.gsa;
+
+	switch(nmea->index){
+
+	case 2:
+		if(f->len == 1 && f->number && f->whole >= NMEA_FIX_NONE && f->whole <= NMEA_FIX_3D){
+			gsa->fix = f->whole;
+		}
+		break;
+
+	case 15:
+		gsa->pdop = nmea_dop(f);
+		break;
+
+	case 16:
+		gsa->hdop = nmea_dop(f);
+		break;
+
+	case 17:
+		gsa->vdop = nmea_dop(f);
+		break;
+
+	default:
+		// Satellites used, 12 fields
+		if(nmea->index >= 3 && nmea->index <= 14 && f->len){
+			gsa->used++;
+		}
+		break;
+	}
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_gsv
+ *  @brief    GSV field, ex. $GPGSV,2,1,07,07,79,048,42,02,51,062,43,26,36,256,42,27,27,138,42*71
+ *  		  After the header come four fields per satellite: number,
+ *  		  elevation, azimuth and C/N0 (empty when not tracked).
+ */
+/*****************************************************************************/
+static void nmea_gsv(Nmea_Parser *nmea, const Nmea_Field *f){
+
+	Nmea_Gsv *gsv = &nmea->pend.gsv;
+	uint8_t sat;
+
+	if(nmea->index == 2){
+		gsv->number = (f->number && f->whole < 0x100) ? f->whole : 0;
+		return;
+	}
+
+	if(nmea->index == 3){
+		gsv->view = (f->number && f->whole < 0x100) ? f->whole : 0;
+		return;
+	}
+
+	if(nmea->index < 4 || (sat = (nmea->index - 4) / 4) >= NMEA_GSV_SATS){
+		return;
+	}
+
+	switch((nmea->index - 4) % 4){
+
+	case 0:
+		if(f->len){
+			gsv->count = sat + 1;
+		}
+		// GN talker, sort by satellite number
+		if(gsv->gnss == NMEA_GNSS_NONE && f->number){
+			if(f->whole >= 1 && f->whole <= 32){
+				gsv->gnss = NMEA_GNSS_GPS;
+			}else if(f->whole >= 65 && f->whole <= 96){
+				gsv->gnss = NMEA_GNSS_GLONASS;
+			}
+		}
+		break;
+
+	case 3:
+		if(f->len && f->number && !f->dot && f->whole < 100){
+			gsv->cn0[sat] = f->whole;
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_vtg
+ *  @brief    VTG field, ex. $GPVTG,309.62,T,,M,0.13,N,0.2,K,A*23
+ */
+/*****************************************************************************/
+static void nmea_vtg(Nmea_Parser *nmea, const Nmea_Field *f){
+
+	Nmea_Vtg *vtg = &nmea->pend.vtg;
+
+	switch(nmea->index){
+
+	case 1:
+		if(f->len && f->number && !f->neg && f->whole < 360){
+			vtg->course = nmea_fixed(f, 2);
+		}
+		break;
+
+	case 7:
+		// km/h to m/h
+		if(f->len && f->number && !f->neg && f->whole < 1000000){
+			vtg->speed = nmea_fixed(f, 3);
+			vtg->valid = 1;
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_take
+ *  @brief    Takes the pending record of a sentence whose checksum passed
+ *  		  and merges it into the epoch. A new time in GGA or RMC
+ *  		  publishes the epoch before.
+ *  @return   NMEA_* bits of the sentence and NMEA_FIX, 0 when cut short
+ */
+/*****************************************************************************/
+static uint8_t nmea_take(Nmea_Parser *nmea){
+
+	Nmea_Fix *epoch = &nmea->epoch;
+	uint8_t taken = 0;
+
+	switch(nmea->type){
+
+	case NMEA_RMC:
+		if(nmea->index < NMEA_RMC_FIELDS){
+			break;
+		}
+		nmea->rmc = nmea->pend.rmc;
+		if(nmea->rmc.timed){
+			taken = nmea_epoch(nmea, nmea->rmc.time);
+		}
+		epoch->day   = nmea->rmc.day;
+		epoch->month = nmea->rmc.month;
+		epoch->year  = nmea->rmc.year;
+		if( !(epoch->seen & NMEA_VTG) ){
+			epoch->speed  = nmea->rmc.speed;
+			epoch->course = nmea->rmc.course;
+		}
+		if( !(epoch->seen & NMEA_GGA) ){
+			epoch->valid = nmea->rmc.valid;
+			epoch->lat   = nmea->rmc.lat;
+			epoch->lon   = nmea->rmc.lon;
+		}
+		epoch->seen |= NMEA_RMC;
+		nmea->sentences++;
+		return taken | NMEA_RMC;
+
+	case NMEA_GGA:
+		if(nmea->index < NMEA_GGA_FIELDS){
+			break;
+		}
+		if(nmea->pend.gga.timed){
+			taken = nmea_epoch(nmea, nmea->pend.gga.time);
+		}
+		epoch->valid   = nmea->pend.gga.valid;	// Over RMC
+		epoch->lat     = nmea->pend.gga.lat;
+		epoch->lon     = nmea->pend.gga.lon;
+		epoch->alt     = nmea->pend.gga.alt;
+		epoch->quality = nmea->pend.gga.quality;
+		epoch->used    = nmea->pend.gga.used;
+		if(nmea->pend.gga.hdop){
+			epoch->hdop = nmea->pend.gga.hdop;
+		}
+		epoch->seen |= NMEA_GGA;
+		nmea->sentences++;
+		return taken | NMEA_GGA;
+
+	case NMEA_GSA:
+		if(nmea->index < NMEA_GSA_FIELDS){
+			break;
+		}
+		// One GSA per constellation in a combined fix
+		if(nmea->pend.gsa.fix > epoch->fix){
+			epoch->fix = nmea->pend.gsa.fix;
+		}
+		nmea->gsa_used += nmea->pend.gsa.used;
+		if(nmea->pend.gsa.pdop){
+			epoch->pdop = nmea->pend.gsa.pdop;
+		}
+		if(nmea->pend.gsa.hdop && !(epoch->seen & NMEA_GGA)){
+			epoch->hdop = nmea->pend.gsa.hdop;
+		}
+		if(nmea->pend.gsa.vdop){
+			epoch->vdop = nmea->pend.gsa.vdop;
+		}
+		epoch->seen |= NMEA_GSA;
+		nmea->sentences++;
+		return NMEA_GSA;
+
+	case NMEA_GSV:
+		if(nmea->index < NMEA_GSV_FIELDS){
+			break;
+		}
+		nmea_sky(nmea, &nmea->pend.gsv);
+		epoch->seen |= NMEA_GSV;
+		nmea->sentences++;
+		return NMEA_GSV;
+
+	case NMEA_VTG:
+		if(nmea->index < NMEA_VTG_FIELDS){
+			break;
+		}
+		if(nmea->pend.vtg.valid){
+			epoch->speed  = nmea->pend.vtg.speed;
+			epoch->course = nmea->pend.vtg.course;
+			epoch->seen  |= NMEA_VTG;
+		}
+		nmea->sentences++;
+		return NMEA_VTG;
+
+	default:
+		return 0;
+	}
+
+	nmea->errors++;
+	return 0;
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_sky
+ *  @brief    Adds one GSV sentence to its constellation. The first of a
+ *  		  set starts the constellation over.
+ */
+/*****************************************************************************/
+static void nmea_sky(Nmea_Parser *nmea, const Nmea_Gsv *gsv){
+
+	Nmea_Sky *sky;
+	uint8_t i;
+
+	if(gsv->gnss >= NMEA_GNSS_COUNT){
+		return;
+	}
+
+	sky = &nmea->epoch.sky[gsv->gnss];
+
+	if(gsv->number <= 1){
+		memset(sky, 0, sizeof(Nmea_Sky));
+		nmea->cn0_sum[gsv->gnss] = 0;
+	}
+
+	sky->view = gsv->view;
+
+	for(i = 0; i < gsv->count; i++){
+		if(gsv->cn0[i]){
+			sky->tracked++;
+			nmea->cn0_sum[gsv->gnss] += gsv->cn0[i];
+			if(gsv->cn0[i] > sky->cn0_max){
+				sky->cn0_max = gsv->cn0[i];
+			}
+		}
+	}
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_epoch
+ *  @brief    Time of a GGA or RMC, publishes the epoch when it changed.
+ *  @return   NMEA_FIX when published
+ */
+/*****************************************************************************/
+static uint8_t nmea_epoch(Nmea_Parser *nmea, uint32_t time){
+
+	uint8_t taken = 0;
+
+	if(nmea->epoch_timed && nmea->epoch.time != time){
+		taken = nmea_publish(nmea);
+	}
+
+	nmea->epoch_timed = 1;
+	nmea->epoch.time  = time;
+
+	return taken;
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_publish
+ *  @brief    Completes the epoch into fix and starts the next one empty.
+ *  @return   NMEA_FIX, or 0 when nothing was merged
+ */
+/*****************************************************************************/
+static uint8_t nmea_publish(Nmea_Parser *nmea){
+
+	Nmea_Fix *epoch = &nmea->epoch;
+	uint8_t g;
+
+	if(epoch->seen == 0){
+		return 0;
+	}
+
+	epoch->view = 0;
+	for(g = 0; g < NMEA_GNSS_COUNT; g++){
+		epoch->view += epoch->sky[g].view;
+		if(epoch->sky[g].tracked){
+			epoch->sky[g].cn0_mean = nmea->cn0_sum[g] / epoch->sky[g].tracked;
+		}
+	}
+
+	// GGA stops at 12 satellites in older NMEA versions
+	if(nmea->gsa_used > epoch->used){
+		epoch->used = nmea->gsa_used;
+	}
+
+	nmea->fix = *epoch;
+
+	memset(epoch, 0, sizeof(Nmea_Fix));
+	memset(nmea->cn0_sum, 0, sizeof(nmea->cn0_sum));
+	nmea->gsa_used    = 0;
+	nmea->epoch_timed = 0;
+
+	return NMEA_FIX;
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_gnss
+ *  @brief    Constellation of a talker, NMEA_GNSS_NONE for GN (combined).
+ */
+/*****************************************************************************/
+static uint8_t nmea_gnss(const char *talker){
+
+	if(talker[0] == 'G' && talker[1] == 'P'){
+		return NMEA_GNSS_GPS;
+	}
+	if(talker[0] == 'G' && talker[1] == 'L'){
+		return NMEA_GNSS_GLONASS;
+	}
+	if(talker[0] == 'G' && talker[1] == 'A'){
+		return NMEA_GNSS_GALILEO;
+	}
+	if((talker[0] == 'G' && talker[1] == 'B') || (talker[0] == 'B' && talker[1] == 'D')){
+		return NMEA_GNSS_BEIDOU;
+	}
+	return NMEA_GNSS_NONE;
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_dop
+ *  @brief    Dilution of precision in 0.01, 0 when empty, 9999 at most.
+ */
+/*****************************************************************************/
+static uint16_t nmea_dop(const Nmea_Field *f){
+
+	if(f->len == 0 || !f->number || f->neg){
+		return 0;
+	}
+	if(f->whole >= 100){
+		return 9999;
+	}
+	return nmea_fixed(f, 2);
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_hex
+ *  @brief    Checksum digit value, 0xFF when not a hex digit.
+ */
+/*****************************************************************************/
+static uint8_t nmea_hex(char c){
+
+	if(c >= '0' && c <= '9'){
+		return c - '0';
+	}
+	if(c >= 'A' && c <= 'F'){
+		return c - 'A' + 10;
+	}
+	if(c >= 'a' && c <= 'f'){
+		return c - 'a' + 10;
+	}
+	return 0xFF;
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_fixed
+ *  @brief    Field as an integer in units of 10^-digits, ex. 12.345 with
+ *  		  digits 2 is 1234. The caller bounds the integer part.
+ */
+/*****************************************************************************/
+static uint32_t nmea_fixed(const Nmea_Field *f, uint8_t digits){
+
+	uint32_t scale = 1;
+	uint32_t cut = 1;
+	uint8_t i;
+
+	for(i = 0; i < digits; i++){
+		scale *= 10;
+	}
+	for(i = digits; i < NMEA_FRAC_DIGITS; i++){
+		cut *= 10;
+	}
+
+	return f->whole * scale + f->frac / cut;
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_time
+ *  @brief    hhmmss.sss to ms since midnight.
+ *  @return   pass or fail (empty or out of range)
+ */
+/*****************************************************************************/
+static uint8_t nmea_time(const Nmea_Field *f, uint32_t *ms){
+
+	uint32_t h, m, s;
+
+	if(f->len < 6 || !f->number || f->neg){
+		return FAIL;
+	}
+
+	h = f->whole / 10000;
+	m = f->whole / 100 % 100;
+	s = f->whole % 100;
+
+	if(h > 23 || m > 59 || s > 60){	// 60 for a leap second
+		return FAIL;
+	}
+
+	*ms = ((h * 60 + m) * 60 + s) * 1000 + f->frac / 10000;
+	return PASS;
+}
+
+/*****************************************************************************/
+/*! @fn       nmea_angle
+ *  @brief    (d)ddmm.mmmm to 1e-7 degree, rounded. The minutes keep all
+ *  		  NMEA_FRAC_DIGITS fraction digits before the division by 60.
+ *  @return   pass or fail (empty or out of range)
+ */
+/*****************************************************************************/
+static uint8_t nmea_angle(const Nmea_Field *f, uint8_t deg_max, int32_t *angle){
+
+	uint32_t deg, min;
+
+	if(f->len == 0 || !f->number || f->neg){
+		return FAIL;
+	}
+
+	deg = f->whole / 100;
+	min = f->whole % 100;
+
+	if(min > 59 || deg > deg_max || (deg == deg_max && (min || f->frac))){
+		return FAIL;
+	}
+
+	// Minutes in 1e-7, below 6e8
+	min = min * NMEA_DEGREE + f->frac;
+
+	*angle = (int32_t)(deg * NMEA_DEGREE + (min + 30) / 60);
+	return PASS;
+}
@@ -6,3 +6,110 @@
  */
 
 
+/*****************************************************************************/
+/*!
+ * @project    EcoSense
+ * @file       round_robin.c
+ * @author     Long Tran
+ * @version    1.2
+ * @brief	   Round Robin handler
+ * @date       28/July/2021
+ * @bug        NA
+
+ * @note       A cycle takes as long as its slowest task, not the sum of
+ * 			   all tasks.
+ */
+/*****************************************************************************/
+
+/******************** HEADER FILES *******************************************/
+#include "stdint.h"
+#include "round_robin.h"
+#include "uart.h"
+#include "power.h"
+
+/******************** FUNCTION DECLARATION************************************/
+
+/*****************************************************************************/
+/*! @fn       rr_run
+ *  @brief    Runs the tasks concurrently until every task is done or failed.
+ *  		  The core sleeps between task steps.
+ *  @param    Task array, number of tasks (RR_TASK_MAX max)
+ *  @return   pass when all tasks are done, else fail
+ */
+/*****************************************************************************/
+char rr_run(Rr_Task *tasks, uint8_t count){
+
+	uint8_t i, running;
+	uint32_t now, left, wait;
+	char Status = PASS;
+
+	if(count > RR_TASK_MAX){
+		return FAIL;
+	}
+
+	for(i = 0; i < count; i++){
+		tasks[i].line  = 0;
+		tasks[i].step  = 0;
+		tasks[i].hit   = UART_NO_MATCH;
+		tasks[i].state = RR_RUNNING;
+	}
+
+	while(1){
+
+		uart_event = 0;	// UART events from here on wake the sleep below
+		running = 0;
+		wait = UINT32_MAX;
+
+		for(i = 0; i < count; i++){
+
+			if(tasks[i].state != RR_RUNNING){
+				continue;
+			}
+
+			tasks[i].state = tasks[i].thread(&tasks[i]);
+
+			if(tasks[i].state == RR_RUNNING){
+
+				running++;
+
+				// Time left on the wait this task yielded in
+				now  = HAL_GetTick() - tasks[i].start;
+				left = (now < tasks[i].timeout) ? tasks[i].timeout - now : 0;
+
+				if(left < wait){
+					wait = left;
+				}
+
+			}else if(tasks[i].state == RR_FAILED){
+				LOG("\r\nERROR: Task failed: ");
+				LOG((char*)tasks[i].name);
+				LOG("\r\n");
+			}
+		}
+
+		if(running == 0){
+			break;
+		}
+
+		power_wait(&uart_event, 0, wait);
+	}
+
+	for(i = 0; i < count; i++){
+		if(tasks[i].state != RR_DONE){
+			Status = FAIL;
+		}
+	}
+
+	return Status;
+}
+
+/*****************************************************************************/
+/*! @fn       rr_expired
+ *  @brief    Check the current wait of a task for timeout.
+ *  @return   1 when the wait timed out, else 0
+ */
+/*****************************************************************************/
+uint8_t rr_expired(Rr_Task *task){
+
+	return (HAL_GetTick() - task->start >= task->timeout) ? 1 : 0;
+}
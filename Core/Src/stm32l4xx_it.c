@@ -24,6 +24,7 @@
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #include "uart.h"
+#include "power.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -209,7 +210,7 @@ void SysTick_Handler(void)
 void USART1_IRQHandler(void)
 {
   /* USER CODE BEGIN USART1_IRQn 0 */
-  uart_isr(WIFI_UART);
+  uart_isr(&uart_wifi);
   /* USER CODE END USART1_IRQn 0 */
   //HAL_UART_IRQHandler(&huart1);
   /* USER CODE BEGIN USART1_IRQn 1 */
@@ -223,7 +224,7 @@ void USART1_IRQHandler(void)
 void USART2_IRQHandler(void)
 {
   /* USER CODE BEGIN USART2_IRQn 0 */
-  uart_isr(PC_UART);
+  PC_UART->ICR = USART_ICR_ORECF; // PC port is TX-only, polled by LOG
   /* USER CODE END USART2_IRQn 0 */
   //HAL_UART_IRQHandler(&huart2);
   /* USER CODE BEGIN USART2_IRQn 1 */
@@ -237,7 +238,7 @@ void USART2_IRQHandler(void)
 void USART3_IRQHandler(void)
 {
   /* USER CODE BEGIN USART3_IRQn 0 */
-  uart_isr(CAMERA_UART);
+  uart_isr(&uart_camera);
   /* USER CODE END USART3_IRQn 0 */
   //HAL_UART_IRQHandler(&huart3);
   /* USER CODE BEGIN USART3_IRQn 1 */
@@ -251,7 +252,7 @@ void USART3_IRQHandler(void)
 void UART4_IRQHandler(void)
 {
   /* USER CODE BEGIN UART4_IRQn 0 */
-   uart_isr(LTEGPS_UART);
+  uart_isr(&uart_ltegps);
   /* USER CODE END UART4_IRQn 0 */
   //HAL_UART_IRQHandler(&huart4);
   /* USER CODE BEGIN UART4_IRQn 1 */
@@ -261,5 +262,69 @@ void UART4_IRQHandler(void)
 
 /* USER CODE BEGIN 1 */
 
+/**
+  * @brief This function handles DMA1 channel2 global interrupt (USART3 TX).
+  */
+void DMA1_Channel2_IRQHandler(void)
+{
+  uart_dma_tx_isr(&uart_camera);
+}
+
+/**
+  * @brief This function handles DMA1 channel3 global interrupt (USART3 RX).
+  */
+void DMA1_Channel3_IRQHandler(void)
+{
+  uart_dma_rx_isr(&uart_camera);
+}
+
+/**
+  * @brief This function handles DMA1 channel4 global interrupt (USART1 TX).
+  */
+void DMA1_Channel4_IRQHandler(void)
+{
+  uart_dma_tx_isr(&uart_wifi);
+}
+
+/**
+  * @brief This function handles DMA1 channel5 global interrupt (USART1 RX).
+  */
+void DMA1_Channel5_IRQHandler(void)
+{
+  uart_dma_rx_isr(&uart_wifi);
+}
+
+/**
+  * @brief This function handles DMA2 channel3 global interrupt (UART4 TX).
+  */
+void DMA2_Channel3_IRQHandler(void)
+{
+  uart_dma_tx_isr(&uart_ltegps);
+}
+
+/**
+  * @brief This function handles DMA2 channel5 global interrupt (UART4 RX).
+  */
+void DMA2_Channel5_IRQHandler(void)
+{
+  uart_dma_rx_isr(&uart_ltegps);
+}
+
+/**
+  * @brief This function handles TIM7 global interrupt (sleep wake timer).
+  */
+void TIM7_IRQHandler(void)
+{
+  power_tim_isr();
+}
+
+/**
+  * @brief This function handles LPTIM1 global interrupt (Stop 2 wake timer).
+  */
+void LPTIM1_IRQHandler(void)
+{
+  power_lptim_isr();
+}
+
 /* USER CODE END 1 */
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/